@@ -1,11 +1,13 @@
 #!/usr/bin/python3
+import csv
+import os
 from matplotlib import pyplot as plt
 
 def graph(test, data, color):
     mean = float(sum(data)) / float(len(data))
     fig = plt.figure(figsize=(8, 6), dpi=80)
     fig.text(.6,.8, "Mean: " + str(mean))
-    X = [j for j in range(100)]
+    X = [j for j in range(len(data))]
     plt.plot(X, data, c=color)
     plt.title("Graph " + test)
     plt.ylabel("Time (in seconds)")
@@ -14,34 +16,70 @@ def graph(test, data, color):
     plt.savefig("graph_" + test +".png")
     return
 
+def graph_heap_map(path):
+    # Fragmentation of every snapshot in the order they were taken, and the free block sizes of the last one
+    labels = []
+    free = {}
+    largest = {}
+    histogram = {}
+    with open(path) as fp:
+        for row in csv.DictReader(fp):
+            label = row['label']
+            if label not in free:
+                labels.append(label)
+                free[label] = 0
+                histogram[label] = []
+            if row['record'] == 'free':
+                free[label] += int(row['bytes'])
+                histogram[label].append((int(row['start']), int(row['blocks'])))
+            elif row['record'] == 'largest_free':
+                largest[label] = int(row['bytes'])
+    fragmentation = [1 - float(largest[l]) / free[l] if free[l] else 0 for l in labels]
+
+    plt.figure(figsize=(8, 6), dpi=80)
+    plt.plot(range(len(labels)), fragmentation, c='r')
+    plt.xticks(range(len(labels)), labels, rotation=90)
+    plt.title("Fragmentation")
+    plt.ylabel("Free space outside the largest free block")
+    plt.tight_layout()
+    plt.savefig("graph_fragmentation.png")
+
+    last = histogram[labels[-1]]
+    plt.figure(figsize=(8, 6), dpi=80)
+    plt.bar([str(size) for size, blocks in last], [blocks for size, blocks in last], color='g')
+    plt.title("Free blocks: " + labels[-1])
+    plt.ylabel("Blocks")
+    plt.xlabel("Size (bytes, at least)")
+    plt.savefig("graph_free_sizes.png")
+    return
+
 def main():
+        # data.txt holds one "workload seconds" line per run, in the order they were run.
+        # Lines of the older layout hold only the seconds, 100 runs of each test from A on.
+        tests = []
+        data = {}
+        unlabelled = 0
         fp = open('data.txt', 'r')
-        A = []
-        B = []
-        C = []
-        D = []
-        E = []
-        F = []
-        i = 0
         for line in fp:
-            line = line.split()[0]
-            if i < 100:
-                A.append(float(line))
-            elif i >= 100 and i < 200:
-                B.append(float(line))
-            elif i >= 200 and i < 300:
-                C.append(float(line))
-            elif i >= 300 and i < 400:
-                D.append(float(line))
-            elif i >= 400 and i < 500:
-                E.append(float(line))
-            elif i >= 500 and i < 600:
-                F.append(float(line))
-            i += 1
+            fields = line.split()
+            if len(fields) == 1:
+                test, seconds = chr(ord('A') + unlabelled // 100), fields[0]
+                unlabelled += 1
+            elif len(fields) == 2:
+                test, seconds = fields
+            else:
+                continue
+            if test not in data:
+                tests.append(test)
+                data[test] = []
+            data[test].append(float(seconds))
         fp.close()
 
-        for test, data, color in zip(['A','B','C','D','E','F'], [A,B,C,D,E,F], ['r','g','b','orange','black','purple']):
-            graph(test, data, color)
+        colors = ['r','g','b','orange','black','purple','brown']
+        for i, test in enumerate(tests):
+            graph(test, data[test], colors[i % len(colors)])
+        if os.path.exists('heap_map.csv'):
+            graph_heap_map('heap_map.csv')
         return
 
 if __name__ == '__main__':
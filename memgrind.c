@@ -4,15 +4,177 @@
  *      2019                                    *
  ************************************************/
 
+/* Before mymalloc.h, whose macros would rename the functions it declares */
+#include <malloc.h>
 #include "mymalloc.h"
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <dlfcn.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <math.h>
 
 #define TEST_MSG 0
 #define COLLECT_DATA 0
+#define OCCUPANCY_SWEEP 1
+#define THREAD_SCALING 1
+#define PRODUCER_CONSUMER 1
+#define SLAB_DENSITY 1
+#define POLICY_SWEEP 1
+#define VECTOR_APPEND 1
+#define TYPED_ACCESS 1
+#define BATCH_BURST 1
+#define SIZED_FREE 1
+#define SCRUB_SWEEP 1
+#define HEAP_MAP 1
+#define TRIM 1
+
+#define QUEUE_SLOTS 1024
+
+#define OUTPUT_TEXT 0
+#define OUTPUT_JSON 1
+#define OUTPUT_CSV 2
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define MAX_BACKENDS 4
+
+/*
+ *      Settings of a run, taken from the command line.
+ */
+struct config
+{
+        char * workloads;                       /* Comma separated names of what to run, or "all" */
+        int iterations;                         /* Timed runs of each workload */
+        int warmup;                             /* Untimed runs of each workload before the timed ones */
+        int min_size;                           /* Size of the fixed size workloads, smallest of the random ones */
+        int max_size;                           /* Largest size of the random size workloads */
+        unsigned int seed;                      /* Seed of rand() and next_random() */
+        int format;                             /* OUTPUT_TEXT, OUTPUT_JSON or OUTPUT_CSV */
+        char * output;                          /* File the results are written to, or NULL for stdout */
+        char * record;                          /* File every call is traced to, or NULL */
+        char * replay;                          /* Trace file replayed as a workload, or NULL */
+        char * backends;                        /* Comma separated allocators the workloads are run against */
+        int threads;                            /* Most threads the threaded patterns run on */
+};
+struct config CONFIG = {"all", 100, 1, 1, 64, 1, OUTPUT_TEXT, NULL, NULL, NULL, "mymalloc", 8};
+
+/*
+ *      Log-linear histogram of latencies in nanoseconds. Values below
+ *      LATENCY_SUB_BUCKETS get a bucket each, and every power of two above
+ *      that is split into LATENCY_SUB_BUCKETS buckets, so a percentile read
+ *      from it is within 1/LATENCY_SUB_BUCKETS of the true value, at any
+ *      scale, in fixed space.
+ */
+struct latency_histogram
+{
+        size_t counts[LATENCY_BUCKETS];
+        size_t samples;
+        double total;
+        double max;
+};
+
+/*
+ *      Everything measured of one workload: the latency of each of its mallocs
+ *      and frees, and the time of each of its runs.
+ */
+struct result
+{
+        char * workload;
+        char * backend;
+        struct latency_histogram malloc_latency;
+        struct latency_histogram free_latency;
+        int runs;
+        double * run_times;                     /* Nanoseconds taken by each run */
+        size_t peak_bytes;                      /* Most usable bytes of blocks live at once during a run */
+        size_t rss_bytes;                       /* Growth of the resident set of the process over its runs */
+};
+
+/*
+ *      An allocator the workloads can be run against: mymalloc, the C library
+ *      or any shared library exporting the standard functions. release_sized
+ *      and usable_size are NULL if the allocator has no such function.
+ */
+struct backend
+{
+        char * name;
+        int is_mymalloc;                        /* 1 for mymalloc, whose own checks and statistics apply */
+        void * (* allocate)(size_t size);
+        void (* release)(void * pointer);
+        void * (* allocate_zeroed)(size_t count, size_t size);
+        void * (* reallocate)(void * pointer, size_t size);
+        void * (* allocate_aligned)(size_t alignment, size_t size);
+        void (* release_sized)(void * pointer, size_t size);
+        size_t (* usable_size)(void * pointer);
+};
+
+/*
+ *      A call of a trace, ready to replay: the handles of the trace are
+ *      replaced by slots of an array of live pointers, so a replay looks
+ *      nothing up. slot is where an allocation stores its pointer, or what a
+ *      free frees, and from is the slot a realloc resizes, -1 for NULL.
+ */
+struct replay_op
+{
+        int op;
+        int slot;
+        int from;
+        size_t argument;
+        size_t size;
+};
+
+/*
+ *      A trace loaded from a file: its calls and the number of slots they use.
+ */
+struct replay_trace
+{
+        struct replay_op * ops;
+        size_t num_ops;
+        int num_slots;
+        size_t skipped;                         /* Calls dropped: failed allocations and frees of unknown handles */
+};
+
+/*
+ *      Histograms measured_malloc and measured_free record into, or NULL when
+ *      no workload is being timed.
+ */
+struct latency_histogram * MALLOC_LATENCY = NULL;
+struct latency_histogram * FREE_LATENCY = NULL;
+
+/*
+ *      Usable bytes of the blocks allocated and not yet freed by the workload
+ *      being timed, and the most there have been during the run.
+ */
+size_t LIVE_BYTES = 0;
+size_t PEAK_BYTES = 0;
+struct replay_trace REPLAY_TRACE;
+
+/*
+ *      Allocators selected by CONFIG.backends, and the one the workloads run
+ *      against at the moment.
+ */
+struct backend BACKENDS[MAX_BACKENDS];
+int NUM_BACKENDS = 0;
+struct backend * BACKEND = NULL;
+
+/*
+ *      State of the random numbers of the tests, one per thread so threads
+ *      running them at once neither share a lock nor each other's sequence.
+ *      OPS counts the mallocs and frees a thread has made through
+ *      measured_malloc and measured_free. SCRUB_CHECKS is cleared while
+ *      several threads run the tests, since a block one thread freed may be
+ *      handed to another before the first checks it.
+ */
+__thread unsigned int RANDOM_STATE = 1;
+__thread size_t OPS = 0;
+int SCRUB_CHECKS = 1;
 
 /*
  *      Returns time of day in seconds with precision to microseconds
@@ -25,32 +187,180 @@ double get_time()
 }
 
 /*
- *      Collect data from benchmarking test double array into a text file for further
- *      processing.
+ *      Returns a monotonic time in nanoseconds, for timing single calls
+ */
+double get_time_ns()
+{
+        struct timespec t_spec;
+        clock_gettime(CLOCK_MONOTONIC, &t_spec);
+        return t_spec.tv_sec * 1e9 + t_spec.tv_nsec;
+}
+
+/*
+ *      Appends the run times of workload, in seconds, to data.txt for
+ *      grapher.py, one "workload time" line per run.
  */
-void write_data(double * x, int num_tests)
+void write_data(char * workload, double * x, int num_tests)
 {
+        FILE * fp = fopen("data.txt", "a");
+        if (fp == NULL)
+                return;
         int i;
         for (i = 0; i < num_tests; i++)
+                fprintf(fp, "%s %lf\n", workload, x[i] * 1e-9);
+        fclose(fp);
+}
+
+/*
+ *      Returns the bucket of a latency histogram that ns nanoseconds fall in.
+ */
+int latency_bucket(double ns)
+{
+        unsigned long value = ns < 1 ? 0 : (unsigned long) ns;
+        if (value < LATENCY_SUB_BUCKETS)
+                return (int) value;
+        int exponent = 63 - __builtin_clzl(value);
+        return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + (int) ((value >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/*
+ *      Returns the smallest latency in nanoseconds that falls in bucket.
+ */
+double bucket_latency(int bucket)
+{
+        if (bucket < LATENCY_SUB_BUCKETS)
+                return bucket;
+        int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+        return (double) ((unsigned long) (LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (exponent - LATENCY_SUB_BITS));
+}
+
+/*
+ *      Adds a latency of ns nanoseconds to histogram.
+ */
+void record_latency(struct latency_histogram * histogram, double ns)
+{
+        histogram->counts[latency_bucket(ns)]++;
+        histogram->samples++;
+        histogram->total += ns;
+        if (ns > histogram->max)
+                histogram->max = ns;
+}
+
+/*
+ *      Returns the latency in nanoseconds that the fraction quantile of the
+ *      samples of histogram do not exceed, to within the width of its bucket.
+ */
+double latency_percentile(struct latency_histogram * histogram, double quantile)
+{
+        if (histogram->samples == 0)
+                return 0;
+        size_t rank = (size_t) (quantile * histogram->samples);
+        if (rank < quantile * histogram->samples || rank == 0)
+                rank++;
+        size_t seen = 0;
+        int bucket = 0;
+        for (; bucket < LATENCY_BUCKETS; bucket++)
         {
-                char output[50];
-                sprintf(output, "%lf", x[i]);
-                FILE * fp = fopen("data.txt", "a");
-                fwrite(output, 1, strlen(output), fp);
-                fwrite("\n", sizeof(char), sizeof(char), fp);
-                fclose(fp);
+                seen += histogram->counts[bucket];
+                if (seen >= rank)
+                        break;
         }
+        double latency = bucket_latency(bucket);
+        return latency < histogram->max ? latency : histogram->max;
 }
 
 /*
- *      mallocs 1 byte and immediately frees it (size times)
+ *      Returns the next random number of the calling thread, from 0 to
+ *      RAND_MAX.
+ */
+int next_random()
+{
+        return rand_r(&RANDOM_STATE);
+}
+
+/*
+ *      Adds the usable bytes of pointer to LIVE_BYTES, raising PEAK_BYTES with
+ *      it, or takes them away if freeing.
+ */
+void count_live(void * pointer, int freeing)
+{
+        if (BACKEND->usable_size == NULL || pointer == NULL)
+                return;
+        if (freeing)
+        {
+                LIVE_BYTES -= BACKEND->usable_size(pointer);
+                return;
+        }
+        LIVE_BYTES += BACKEND->usable_size(pointer);
+        if (LIVE_BYTES > PEAK_BYTES)
+                PEAK_BYTES = LIVE_BYTES;
+}
+
+/*
+ *      mallocs size bytes, timing the call into MALLOC_LATENCY while a
+ *      workload is being timed.
+ */
+void * measured_malloc(size_t size)
+{
+        OPS++;
+        if (MALLOC_LATENCY == NULL)
+                return BACKEND->allocate(size);
+        double start = get_time_ns();
+        void * pointer = BACKEND->allocate(size);
+        record_latency(MALLOC_LATENCY, get_time_ns() - start);
+        count_live(pointer, 0);
+        return pointer;
+}
+
+/*
+ *      frees pointer, timing the call into FREE_LATENCY while a workload is
+ *      being timed.
+ */
+void measured_free(void * pointer)
+{
+        OPS++;
+        if (FREE_LATENCY == NULL)
+        {
+                BACKEND->release(pointer);
+                return;
+        }
+        count_live(pointer, 1);
+        double start = get_time_ns();
+        BACKEND->release(pointer);
+        record_latency(FREE_LATENCY, get_time_ns() - start);
+}
+
+/*
+ *      Checks the first byte of a block that was just freed against the scrub
+ *      mode: zeroing on free must have cleared it and poisoning must have
+ *      overwritten it. The other modes leave freed data as it was, so there is
+ *      nothing to check, and neither is there for other allocators or while
+ *      SCRUB_CHECKS is cleared. Blocks of size bytes at or above the mmap
+ *      threshold are unmapped when freed, so they are not checked either.
+ *
+ *      Returns 1 if the byte is as the scrub mode leaves it, 0 otherwise.
+ */
+int scrubbed(char * pointer, size_t size)
+{
+        if (!SCRUB_CHECKS || (BACKEND != NULL && !BACKEND->is_mymalloc) || size >= mymalloc_get_mmap_threshold())
+                return 1;
+        switch (mymalloc_get_scrub())
+        {
+                case SCRUB_ZERO_ON_FREE: return pointer[0] == '\0';
+                case SCRUB_POISON: return pointer[0] == (char) SCRUB_POISON_BYTE;
+                default: return 1;
+        }
+}
+
+/*
+ *      mallocs size bytes and immediately frees it (num_times times)
  */
 int test_A(int size, int num_times)
 {
         int i = 0;
         while(i < num_times)
         {
-                char * test = (char *) malloc(size);
+                char * test = (char *) measured_malloc(size);
                 if (test == NULL)
                 {
                         fprintf(stderr, "TEST A: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
@@ -58,8 +368,8 @@ int test_A(int size, int num_times)
                 }
                 *test = '1';
                 if (DEBUG) printf("\nTEST %d PTR: \t %p\n\n", i+1, test);
-                free(test);
-                if (*test == '1')
+                measured_free(test);
+                if (!scrubbed(test, size))
                 {
                         fprintf(stderr, "TEST A: Error in free.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
                         return -1;
@@ -72,9 +382,9 @@ int test_A(int size, int num_times)
 }
 
 /*
- *      mallocs 1 byte, stores the pointer in an array (150 times). Once
- *      50 byte chunks have been malloced, it frees the 50 1 byte pointers one
- *      by one.
+ *      mallocs CONFIG.min_size bytes (1 by default), stores the pointer in an
+ *      array (150 times). Once 50 chunks have been malloced, it frees the 50
+ *      pointers one by one.
  */
 int test_B()
 {
@@ -85,7 +395,7 @@ int test_B()
                 int i = 0;
                 for (; i < 50; i++)
                 {
-                        arr[i] = (char *) malloc(1);
+                        arr[i] = (char *) measured_malloc(CONFIG.min_size);
                         if (arr[i] == NULL)
                         {
                                 fprintf(stderr, "TEST B: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
@@ -98,8 +408,8 @@ int test_B()
                 for (; j < 50; j++)
                 {
                         if (DEBUG) printf("TEST %d PTR: %p\n", k*50 + (j+1), arr[j]);
-                        free(arr[j]);
-                        if (arr[j][0] == '1')
+                        measured_free(arr[j]);
+                        if (!scrubbed(arr[j], CONFIG.min_size))
                         {
                                 fprintf(stderr, "TEST B: Error in free.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
                                 return -1;
@@ -113,22 +423,21 @@ int test_B()
 }
 
 /*
- *      Randomly chooses between a 1 byte malloc or freeing a 1 byte pointer until
- *      50 allocations have occurred. Then all the allocations are freed.
+ *      Randomly chooses between a CONFIG.min_size byte malloc or freeing a
+ *      pointer until 50 allocations have occurred. Then all the allocations
+ *      are freed.
  */
 int test_C()
 {
         int allocated = 0;
         char *arr[50];
-        time_t t;
-        srand((unsigned)time(&t));
         while (allocated != 50)
         {
 
-                if ((rand() % 2 == 0))
+                if ((next_random() % 2 == 0))
                 {
                         /* Allocate */
-                        arr[allocated] = (char *) malloc(1);
+                        arr[allocated] = (char *) measured_malloc(CONFIG.min_size);
                         if (arr[allocated] == NULL)
                         {
                                 fprintf(stderr,"TEST C: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
@@ -144,8 +453,8 @@ int test_C()
                         if (allocated > 0)
                         {
                                 if (DEBUG) printf("FREE TEST %d PTR: %p\n", (allocated+1), arr[allocated]);
-                                free(arr[allocated-1]);
-                                if (arr[allocated-1][0] == '1')
+                                measured_free(arr[allocated-1]);
+                                if (!scrubbed(arr[allocated-1], CONFIG.min_size))
                                 {
                                         fprintf(stderr, "TEST C: Error in free.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
                                         return -1;
@@ -160,8 +469,8 @@ int test_C()
         for (; j < 50; j++)
         {
                 if (DEBUG) printf("FREE TEST %d PTR: %p\n", (j+1), arr[j]);
-                free(arr[j]);
-                if (arr[j][0] == '1')
+                measured_free(arr[j]);
+                if (!scrubbed(arr[j], CONFIG.min_size))
                 {
                         fprintf(stderr, "TEST C: Error in free.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
                         return -1;
@@ -173,24 +482,24 @@ int test_C()
 }
 
 /*
- *      Randomly chooses between a randomly sized malloc (1-64 bytes) or freeing a pointer
- *      until 50 malloc operations have occurred. Then frees all the pointers.
+ *      Randomly chooses between a randomly sized malloc (CONFIG.min_size to
+ *      CONFIG.max_size bytes, 1-64 by default) or freeing a pointer until 50
+ *      malloc operations have occurred. Then frees all the pointers.
  */
 int test_D()
 {
         int allocated = 0;
         char *arr[50];
-        time_t t;
-        srand((unsigned)time(&t));
+        int sizes[50];
         while (allocated != 50)
         {
 
                 if (DEBUG) printf("allocated: %d\n", allocated);
-                if ((rand() % 2 == 0))
+                if ((next_random() % 2 == 0))
                 {
                         /* Allocate */
                         int size = 0;
-                        int free_space = base64_to_dec(2);
+                        int free_space = heap_available_space();
                         if (!heap_initialized())
                                 free_space = 4088;
                         if (free_space <= 4 && DEBUG)
@@ -203,13 +512,14 @@ int test_D()
                         while (size == 0)
                         {
 
-                                int temp = (rand() % 64) + 1;
+                                int temp = CONFIG.min_size + next_random() % (CONFIG.max_size - CONFIG.min_size + 1);
                                 if (DEBUG) printf("stuck in loop: temp: %d\t free space: %d\n", temp, free_space);
                                 if (temp < free_space)
                                         size = temp;
                         }
                         if (DEBUG) printf("exited\n");
-                        arr[allocated] = (char *) malloc(size);
+                        arr[allocated] = (char *) measured_malloc(size);
+                        sizes[allocated] = size;
                         if (arr[allocated] == NULL)
                         {
                                 fprintf(stderr, "TEST D: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
@@ -225,8 +535,8 @@ int test_D()
                         if (allocated > 0)
                         {
                                 if (DEBUG) printf("FREE TEST %d PTR: %p\n", (allocated+1), arr[allocated-1]);
-                                free(arr[allocated-1]);
-                                if (arr[allocated-1][0] == '1')
+                                measured_free(arr[allocated-1]);
+                                if (!scrubbed(arr[allocated-1], sizes[allocated-1]))
                                 {
                                         fprintf(stderr, "TEST D: Error in free.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
                                         return -1;
@@ -241,8 +551,8 @@ int test_D()
         for (; j < 50; j++)
         {
                 if (DEBUG) printf("FREE TEST %d PTR: %p\n", (j+1), arr[j]);
-                free(arr[j]);
-                if (arr[j][0] == '1')
+                measured_free(arr[j]);
+                if (!scrubbed(arr[j], sizes[j]))
                 {
                         fprintf(stderr, "TEST D: Error in free.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
                         return -1;
@@ -273,10 +583,10 @@ int test_E()
                 for (j = 0; j < iter-3; j++)
                 {
                         /* Allocate */
-                        if (size > base64_to_dec(2) && heap_initialized())
+                        if ((size_t) size > heap_available_space() && heap_initialized())
                                 break;
                         allocated++;
-                        arr[j] = (char *) malloc(size);
+                        arr[j] = (char *) measured_malloc(size);
                         if (arr[j] == NULL)
                         {
                                 printf("iter %d %d\n", i, allocated);
@@ -288,25 +598,36 @@ int test_E()
                 for (j = 0; j < allocated; j++)
                 {
                         /* Free */
-                        free(arr[j]);
-                        if (arr[j][0] == '1')
+                        measured_free(arr[j]);
+                        if (!scrubbed(arr[j], size))
                         {
                                 fprintf(stderr, "TEST E: Error in free.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
                                 return -1;
                         }
                         arr[j] = NULL;
                 }
-                if (heap_initialized())
-                        clean();
         }
         return 0;
 }
 
+/*
+ *      Counts the errors reported to the error handler during test_F.
+ */
+int errors_reported = 0;
+void count_error(int error, void * pointer)
+{
+        (void) error;
+        (void) pointer;
+        errors_reported++;
+}
+
 /*
  *      Error tests
  */
 int test_F()
 {
+        errors_reported = 0;
+        mymalloc_set_error_handler(count_error);
         /* Freeing addresses that are not pointers */
         int x;
         free((int *)x);
@@ -330,118 +651,1971 @@ int test_F()
         /* Freeing a NULL pointer */
         free(NULL);
 
-        /* Saturation of dynamic memory */
+        /* Requests past the original 4096 byte heap are served by new arenas */
         p = (char *) malloc(4097);
+        free(p);
 
         p = (char *) malloc(4096 - 7);
+        free(p);
 
+        /* A request no mapping can hold */
+        p = (char *) malloc(SIZE_MAX - 4096);
+
+        /* Every error must reach the handler and be left as the last error, with or without RELEASE */
+        mymalloc_set_error_handler(NULL);
+        if (p != NULL || mymalloc_last_error() != MYMALLOC_ENOMEM || errors_reported < 7)
+        {
+                fprintf(stderr, "TEST F: Errors not reported. Last error: %d. Reported: %d\tFile: %s\tLine: %d\n", mymalloc_last_error(), errors_reported, __FILE__, __LINE__);
+                return -1;
+        }
 
         return 0;
 }
 
 /*
- *      Outputs times of each benchmarking test to stdout.
+ *      Randomly allocates blocks of 65-4096 bytes and frees random ones, num_ops
+ *      times, keeping at most max_live blocks alive. Measures how fragmented the
+ *      heap is with the survivors still allocated, then frees them.
+ *
+ *      Returns the fragmentation from 0 to 1, or -1 on error.
  */
-int grind(int num_tests)
+double test_G(int max_live, int num_ops)
 {
-        double start;
-        int ret;
-        /* these values can be written to a text file for future analysis / easy graphing in python with matplotlib */
-        double A[num_tests], B[num_tests], C[num_tests], D[num_tests], E[num_tests], F[num_tests];
-        double A_avg = 0, B_avg = 0, C_avg = 0, D_avg = 0, E_avg = 0, F_avg = 0;
-        int i = 0;
-        for (; i < num_tests; i++)
+        char * arr[max_live];
+        int live = 0, i = 0;
+        for (; i < num_ops; i++)
         {
-                start = get_time();
-                ret = test_A(1, 150);
-                A[i] = get_time() - start;
-                if (ret == -1)
+                if (live < max_live && (live == 0 || next_random() % 3 != 0))
                 {
-                        fprintf(stderr, "ERROR: TEST A.\tFILE: %s\tLINE: %d\n", __FILE__, __LINE__);
-                        if (DEBUG) print_heap(150);
-                        return 1;
+                        arr[live] = (char *) measured_malloc(65 + next_random() % 4032);
+                        if (arr[live] == NULL)
+                        {
+                                fprintf(stderr, "TEST G: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                return -1;
+                        }
+                        arr[live][0] = '1';
+                        live++;
                 }
-                if (TEST_MSG) printf("TEST A PASSED SUCCESSFULLY\n");
-                A_avg += A[i];
-                if (TEST_MSG) printf("TEST A TIME: %lf\n", A[i]);
+                else
+                {
+                        int victim = next_random() % live;
+                        measured_free(arr[victim]);
+                        arr[victim] = arr[--live];
+                }
+        }
+        double fragmentation = heap_fragmentation();
+        for (i = 0; i < live; i++)
+                measured_free(arr[i]);
+        return fragmentation;
+}
 
-                start = get_time();
-                ret = test_B();
-                B[i] = get_time() - start;
-                if (ret == -1)
+/*
+ *      Holds live_blocks blocks of 520-4096 bytes on the heap, with every other
+ *      one freed to leave holes, and measures the mean and worst time of a
+ *      malloc/free pair of 520-4096 bytes made on top of them, for live_blocks
+ *      from 0 to max_live in increments of step. Blocks this large skip the
+ *      slabs and the thread cache, so every malloc searches the free lists.
+ *      Prints one line per placement policy and occupancy level.
+ */
+int occupancy_sweep(int max_live, int step, int num_ops)
+{
+        char * names[NUM_POLICIES] = {"first", "next", "best", "good", "segregated"};
+        char * live[max_live];
+        int previous = mymalloc_get_policy();
+        int policy = 0;
+        for (; policy < NUM_POLICIES; policy++)
+        {
+                mymalloc_set_policy(policy);
+                int live_blocks = 0;
+                for (; live_blocks <= max_live; live_blocks += step)
                 {
-                        fprintf(stderr, "ERROR: TEST B\n");
-                        if (DEBUG) if (DEBUG) print_heap(150);
-                        return 1;
+                        int i;
+                        for (i = 0; i < live_blocks; i++)
+                        {
+                                live[i] = (char *) malloc(520 + rand() % 3577);
+                                if (live[i] == NULL)
+                                {
+                                        fprintf(stderr, "OCCUPANCY SWEEP: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                        return -1;
+                                }
+                        }
+                        for (i = 0; i < live_blocks; i += 2)
+                                free(live[i]);
+                        if (COLLECT_DATA)
+                        {
+                                char label[32];
+                                sprintf(label, "%s-%d", names[policy], live_blocks);
+                                FILE * fp = fopen("heap_map.csv", "a");
+                                mymalloc_heap_map(fp, HEAP_MAP_CSV, label);
+                                fclose(fp);
+                        }
+                        double total = 0, worst = 0;
+                        for (i = 0; i < num_ops; i++)
+                        {
+                                double start = get_time_ns();
+                                char * p = (char *) malloc(520 + rand() % 3577);
+                                double elapsed = get_time_ns() - start;
+                                if (p == NULL)
+                                {
+                                        fprintf(stderr, "OCCUPANCY SWEEP: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                        return -1;
+                                }
+                                free(p);
+                                total += elapsed;
+                                if (elapsed > worst)
+                                        worst = elapsed;
+                        }
+                        printf("%s\t%d\t%.0lf\t%.0lf\n", names[policy], live_blocks, total / num_ops, worst);
+                        for (i = 1; i < live_blocks; i += 2)
+                                free(live[i]);
                 }
-                if (TEST_MSG) printf("TEST B PASSED SUCCESSFULLY\n");
-                B_avg += B[i];
-                if (TEST_MSG) printf("TEST B TIME: %lf\n", B[i]);
-                start = get_time();
-                ret = test_C();
-                C[i] = get_time() - start;
-                if (ret == -1)
+        }
+        mymalloc_set_policy(previous);
+        return 0;
+}
+
+/*
+ *      Orders address strides for qsort.
+ */
+int compare_strides(const void * a, const void * b)
+{
+        long x = *(const long *) a, y = *(const long *) b;
+        return (x > y) - (x < y);
+}
+
+/*
+ *      Allocates num_objects objects of each size from 1 byte to past the
+ *      largest slab class and prints, per size, how many objects fit in 4 KiB
+ *      and the average time of a malloc/free pair in nanoseconds. The space an
+ *      object takes up, metadata included, is the median distance between two
+ *      objects allocated one after the other. Sizes up to 64 bytes come from
+ *      slab pages, larger ones from data nodes.
+ */
+int slab_density(int num_objects)
+{
+        int sizes[] = {1, 8, 16, 32, 64, 65, 128};
+        char ** objects = (char **) (calloc)(num_objects, sizeof(char *));
+        long * strides = (long *) (calloc)(num_objects, sizeof(long));
+        if (objects == NULL || strides == NULL)
+        {
+                fprintf(stderr, "SLAB DENSITY: Error in calloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                return -1;
+        }
+        int k = 0;
+        for (; k < (int) (sizeof(sizes) / sizeof(sizes[0])); k++)
+        {
+                int i, num_strides = 0;
+                double start = get_time_ns();
+                for (i = 0; i < num_objects; i++)
                 {
-                        fprintf(stderr, "ERROR: TEST C\n");
-                        if (DEBUG) print_heap(150);
-                        return 1;
+                        objects[i] = (char *) malloc(sizes[k]);
+                        if (objects[i] == NULL)
+                        {
+                                fprintf(stderr, "SLAB DENSITY: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                return -1;
+                        }
+                        objects[i][0] = '1';
                 }
-                if (TEST_MSG) printf("TEST C PASSED SUCCESSFULLY\n");
-                C_avg += C[i];
-                if (TEST_MSG) printf("TEST C TIME: %lf\n", C[i]);
-                start = get_time();
-                ret = test_D();
-                D[i] = get_time() - start;
-                if (ret == -1)
+                for (i = 0; i < num_objects; i++)
+                        free(objects[i]);
+                double elapsed = get_time_ns() - start;
+                for (i = 1; i < num_objects; i++)
                 {
-                        fprintf(stderr, "ERROR: TEST D\n");
-                        if (DEBUG) print_heap(150);
-                        return 1;
+                        if (objects[i] > objects[i-1])
+                                strides[num_strides++] = objects[i] - objects[i-1];
                 }
-                if (TEST_MSG) printf("TEST D PASSED SUCCESSFULLY\n");
-                D_avg += D[i];
-                if (TEST_MSG) printf("TEST D TIME: %lf\n", D[i]);
-                start = get_time();
-                ret = test_E();
-                E[i] = get_time() - start;
-                if (ret == -1)
+                qsort(strides, num_strides, sizeof(long), compare_strides);
+                printf("%d\t%ld\t%.1lf\n", sizes[k], num_strides > 0 ? 4096 / strides[num_strides / 2] : 0, elapsed / num_objects);
+        }
+        /* these two came from the system allocator, not mymalloc */
+        (free)(strides);
+        (free)(objects);
+        return 0;
+}
+
+/*
+ *      Grows num_vectors vectors side by side, appending one 24 byte element to
+ *      each in turn until every vector holds num_appends elements, and checks
+ *      that each realloc kept the vector's contents. Prints the number of
+ *      vectors, how many reallocs grew in place and how many had to copy, and
+ *      the average time of a realloc in nanoseconds.
+ */
+int vector_append(int num_vectors, int num_appends)
+{
+        int element_size = 24;
+        char ** vectors = (char **) (calloc)(num_vectors, sizeof(char *));
+        if (vectors == NULL)
+        {
+                fprintf(stderr, "VECTOR APPEND: Error in calloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                return -1;
+        }
+        int in_place = 0, copied = 0;
+        double elapsed = 0;
+        int i, j;
+        for (i = 0; i < num_appends; i++)
+        {
+                for (j = 0; j < num_vectors; j++)
                 {
-                        fprintf(stderr, "Error: TEST E.\tFILE: %s.\tLINE %d.\n", __FILE__, __LINE__);
-                        return 1;
+                        double start = get_time_ns();
+                        char * grown = (char *) realloc(vectors[j], (i + 1) * element_size);
+                        elapsed += get_time_ns() - start;
+                        if (grown == NULL)
+                        {
+                                fprintf(stderr, "VECTOR APPEND: Error in realloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                return -1;
+                        }
+                        if (i > 0 && (grown[0] != (char) j || grown[i * element_size - 1] != (char) (i - 1)))
+                        {
+                                fprintf(stderr, "VECTOR APPEND: realloc lost the contents of vector %d.\tFile: %s\tLine: %d\n", j, __FILE__, __LINE__);
+                                return -1;
+                        }
+                        if (i > 0)
+                        {
+                                if (grown == vectors[j])
+                                        in_place++;
+                                else
+                                        copied++;
+                        }
+                        memset(&grown[i * element_size], (char) i, element_size);
+                        grown[0] = (char) j;
+                        vectors[j] = grown;
                 }
-                E_avg += E[i];
-                start = get_time();
-                ret = test_F();
-                F[i] = get_time() - start;
-                if (ret == -1)
+        }
+        for (j = 0; j < num_vectors; j++)
+                free(vectors[j]);
+        printf("%d\t%d\t%d\t%.1lf\n", num_vectors, in_place, copied, elapsed / ((double) num_vectors * num_appends));
+        /* this one came from the system allocator, not mymalloc */
+        (free)(vectors);
+        return 0;
+}
+
+/*
+ *      A double that may sit at any address, the way payloads were laid out
+ *      before they were aligned.
+ */
+typedef double unaligned_double __attribute__((aligned(1)));
+
+/*
+ *      Allocates num_objects arrays of 3 to 24 doubles and counts those that do
+ *      not start on a 16 byte boundary. Then loads and stores every double
+ *      num_passes times, once at the pointers malloc returned and once a byte
+ *      past them, and prints the misaligned count followed by the average time
+ *      of a load and store in nanoseconds at each of the two offsets.
+ */
+int typed_access(int num_objects, int num_passes)
+{
+        char ** objects = (char **) (calloc)(num_objects, sizeof(char *));
+        int * counts = (int *) (calloc)(num_objects, sizeof(int));
+        if (objects == NULL || counts == NULL)
+        {
+                fprintf(stderr, "TYPED ACCESS: Error in calloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                return -1;
+        }
+        int i, misaligned = 0;
+        long accesses = 0;
+        for (i = 0; i < num_objects; i++)
+        {
+                counts[i] = 3 + rand() % 22;
+                objects[i] = (char *) malloc(counts[i] * sizeof(double) + 1);
+                if (objects[i] == NULL)
                 {
-                        fprintf(stderr, "Error: TEST F.\tFILE: %s.\tLINE %d.\n", __FILE__, __LINE__);
-                        return 1;
+                        fprintf(stderr, "TYPED ACCESS: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        return -1;
+                }
+                if ((unsigned long) objects[i] % 16 != 0)
+                        misaligned++;
+                memset(objects[i], 0, counts[i] * sizeof(double) + 1);
+                accesses += counts[i];
+        }
+        printf("%d", misaligned);
+        int offset = 0;
+        for (; offset <= 1; offset++)
+        {
+                double sum = 0;
+                double start = get_time_ns();
+                int pass = 0;
+                for (; pass < num_passes; pass++)
+                {
+                        for (i = 0; i < num_objects; i++)
+                        {
+                                unaligned_double * values = (unaligned_double *) (objects[i] + offset);
+                                int j = 0;
+                                for (; j < counts[i]; j++)
+                                {
+                                        sum += values[j];
+                                        values[j] = sum;
+                                }
+                        }
                 }
-                F_avg += F[i];
+                printf("\t%.2lf", (get_time_ns() - start) / (accesses * num_passes));
+                if (sum != 0)
+                {
+                        fprintf(stderr, "TYPED ACCESS: Read back a value never written.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        return -1;
+                }
+        }
+        printf("\n");
+        for (i = 0; i < num_objects; i++)
+                free(objects[i]);
+        /* these two came from the system allocator, not mymalloc */
+        (free)(counts);
+        (free)(objects);
+        return 0;
+}
+
+/*
+ *      Allocates num_objects blocks of size bytes at cache line and at page
+ *      alignment with aligned_alloc and prints, for each alignment, how many
+ *      blocks came back misaligned and the average free space each block took
+ *      from the heap. Each round runs twice so the arenas it needs already exist
+ *      when it is measured.
+ */
+int aligned_overhead(int num_objects, int size)
+{
+        size_t alignments[] = {64, 4096};
+        char ** objects = (char **) (calloc)(num_objects, sizeof(char *));
+        if (objects == NULL)
+        {
+                fprintf(stderr, "ALIGNED OVERHEAD: Error in calloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                return -1;
         }
-        if (COLLECT_DATA)
+        int k = 0;
+        for (; k < (int) (sizeof(alignments) / sizeof(alignments[0])); k++)
         {
-                write_data(A, num_tests);
-                write_data(B, num_tests);
-                write_data(C, num_tests);
-                write_data(D, num_tests);
-                write_data(E, num_tests);
-                write_data(F, num_tests);
+                int round = 0, misaligned = 0;
+                size_t used = 0;
+                for (; round < 2; round++)
+                {
+                        size_t before = heap_available_space();
+                        int i = 0;
+                        for (; i < num_objects; i++)
+                        {
+                                objects[i] = (char *) aligned_alloc(alignments[k], size);
+                                if (objects[i] == NULL)
+                                {
+                                        fprintf(stderr, "ALIGNED OVERHEAD: Error in aligned_alloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                        return -1;
+                                }
+                                if ((unsigned long) objects[i] % alignments[k] != 0)
+                                        misaligned++;
+                        }
+                        used = before - heap_available_space();
+                        for (i = 0; i < num_objects; i++)
+                                free(objects[i]);
+                }
+                printf("%ld\t%d\t%d\t%ld\n", alignments[k], misaligned, size, used / num_objects);
         }
-        A_avg /= (double) num_tests;
-        B_avg /= (double) num_tests;
-        C_avg /= (double) num_tests;
-        D_avg /= (double) num_tests;
-        E_avg /= (double) num_tests;
-        F_avg /= (double) num_tests;
-        printf("%lf\n%lf\n%lf\n%lf\n%lf\n%lf\n", A_avg, B_avg, C_avg, D_avg, E_avg, F_avg);
+        /* this one came from the system allocator, not mymalloc */
+        (free)(objects);
         return 0;
 }
 
+/*
+ *      Allocates bursts of 50 equal blocks and frees them again, the way test_B
+ *      does, num_rounds times for each size: once with one malloc and free per
+ *      block and once with malloc_batch and free_batch. Prints the size and the
+ *      average nanoseconds per block of both, then the speedup of the batch.
+ */
+int batch_burst(int num_rounds)
+{
+        int sizes[] = {16, 100, 1000};
+        void * blocks[50];
+        int k = 0;
+        for (; k < (int) (sizeof(sizes) / sizeof(sizes[0])); k++)
+        {
+                double single = 0, batched = 0;
+                int round = 0;
+                for (; round < num_rounds; round++)
+                {
+                        int i;
+                        double start = get_time_ns();
+                        for (i = 0; i < 50; i++)
+                        {
+                                blocks[i] = malloc(sizes[k]);
+                                if (blocks[i] == NULL)
+                                {
+                                        fprintf(stderr, "BATCH BURST: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                        return -1;
+                                }
+                        }
+                        for (i = 0; i < 50; i++)
+                                free(blocks[i]);
+                        single += get_time_ns() - start;
 
+                        start = get_time_ns();
+                        if (malloc_batch(50, sizes[k], blocks) != 50)
+                        {
+                                fprintf(stderr, "BATCH BURST: Error in malloc_batch.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                return -1;
+                        }
+                        free_batch(blocks, 50);
+                        batched += get_time_ns() - start;
+                }
+                printf("%d\t%.1lf\t%.1lf\t%.2lf\n", sizes[k], single / (50.0 * num_rounds), batched / (50.0 * num_rounds), single / batched);
+        }
+        return 0;
+}
 
-int main(int argc, char * argv[])
+/*
+ *      Allocates num_objects blocks of each size and frees them, num_rounds
+ *      times with free and num_rounds times with free_sized. Prints the size
+ *      and the average nanoseconds of one free with each.
+ */
+int sized_free(int num_objects, int num_rounds)
 {
-        return grind(100);
+        int sizes[] = {16, 100, 400, 2000};
+        char ** objects = (char **) (calloc)(num_objects, sizeof(char *));
+        if (objects == NULL)
+        {
+                fprintf(stderr, "SIZED FREE: Error in calloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                return -1;
+        }
+        int k = 0;
+        for (; k < (int) (sizeof(sizes) / sizeof(sizes[0])); k++)
+        {
+                double elapsed[2] = {0, 0};
+                int round = 0;
+                for (; round < 2 * num_rounds; round++)
+                {
+                        int i;
+                        for (i = 0; i < num_objects; i++)
+                        {
+                                objects[i] = (char *) malloc(sizes[k]);
+                                if (objects[i] == NULL)
+                                {
+                                        fprintf(stderr, "SIZED FREE: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                        return -1;
+                                }
+                                objects[i][0] = '1';
+                        }
+                        double start = get_time_ns();
+                        for (i = 0; i < num_objects; i++)
+                        {
+                                if (round % 2)
+                                        free_sized(objects[i], sizes[k]);
+                                else
+                                        free(objects[i]);
+                        }
+                        elapsed[round % 2] += get_time_ns() - start;
+                }
+                printf("%d\t%.1lf\t%.1lf\n", sizes[k], elapsed[0] / ((double) num_objects * num_rounds), elapsed[1] / ((double) num_objects * num_rounds));
+        }
+        /* this one came from the system allocator, not mymalloc */
+        (free)(objects);
+        return 0;
+}
+
+/*
+ *      Dirties a batch of 8 blocks of size bytes, frees it and allocates a
+ *      batch of the same size again, which must come back all zero under
+ *      SCRUB_ZERO_ON_ALLOC.
+ *
+ *      Returns 0 if every block of the second batch is zeroed, -1 otherwise.
+ */
+int batch_zeroed(int size)
+{
+        char * blocks[8];
+        int i, j;
+        if (malloc_batch(8, size, (void **) blocks) != 8)
+                return -1;
+        for (i = 0; i < 8; i++)
+                memset(blocks[i], '1', size);
+        free_batch((void **) blocks, 8);
+        if (malloc_batch(8, size, (void **) blocks) != 8)
+                return -1;
+        int dirty = 0;
+        for (i = 0; i < 8; i++)
+                for (j = 0; j < size; j++)
+                        dirty |= blocks[i][j];
+        free_batch((void **) blocks, 8);
+        return dirty ? -1 : 0;
+}
+
+/*
+ *      Runs tests A-E num_tests times under each scrub mode, zeroing on free
+ *      first while the heap is still known to be clean. Prints one line per
+ *      mode with the average time of each test, then the average nanoseconds
+ *      of a malloc/free pair of 4000 bytes and of a calloc/free pair of 1000
+ *      bytes, num_pairs times each. Under SCRUB_ZERO_ON_ALLOC it also checks
+ *      that batches of slab and arena blocks come back zeroed.
+ */
+int scrub_sweep(int num_tests, int num_pairs)
+{
+        int modes[NUM_SCRUB_MODES] = {SCRUB_ZERO_ON_FREE, SCRUB_NONE, SCRUB_ZERO_ON_ALLOC, SCRUB_POISON};
+        char * names[NUM_SCRUB_MODES] = {"none", "free", "alloc", "poison"};
+        int previous = mymalloc_get_scrub();
+        int k = 0;
+        for (; k < NUM_SCRUB_MODES; k++)
+        {
+                double times[5] = {0, 0, 0, 0, 0};
+                mymalloc_set_scrub(modes[k]);
+                int i = 0;
+                for (; i < num_tests; i++)
+                {
+                        int test = 0;
+                        for (; test < 5; test++)
+                        {
+                                double start = get_time();
+                                int ret;
+                                switch (test)
+                                {
+                                        case 0: ret = test_A(1, 150); break;
+                                        case 1: ret = test_B(); break;
+                                        case 2: ret = test_C(); break;
+                                        case 3: ret = test_D(); break;
+                                        default: ret = test_E(); break;
+                                }
+                                times[test] += get_time() - start;
+                                if (ret == -1)
+                                {
+                                        fprintf(stderr, "SCRUB SWEEP: Error in test %c with scrub mode %s.\tFile: %s\tLine: %d\n", 'A' + test, names[modes[k]], __FILE__, __LINE__);
+                                        return -1;
+                                }
+                        }
+                }
+                double pairs[2] = {0, 0};
+                for (i = 0; i < num_pairs; i++)
+                {
+                        double start = get_time_ns();
+                        char * p = (char *) malloc(4000);
+                        p[0] = '1';
+                        free(p);
+                        pairs[0] += get_time_ns() - start;
+
+                        start = get_time_ns();
+                        p = (char *) calloc(10, 100);
+                        if (p == NULL || p[999] != '\0')
+                        {
+                                fprintf(stderr, "SCRUB SWEEP: calloc returned memory that is not zeroed.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                return -1;
+                        }
+                        p[999] = '1';
+                        free(p);
+                        pairs[1] += get_time_ns() - start;
+                }
+                if (modes[k] == SCRUB_ZERO_ON_ALLOC && (batch_zeroed(16) || batch_zeroed(100)))
+                {
+                        fprintf(stderr, "SCRUB SWEEP: malloc_batch returned memory that is not zeroed.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        return -1;
+                }
+                printf("%s", names[modes[k]]);
+                for (i = 0; i < 5; i++)
+                        printf("\t%lf", times[i] / num_tests);
+                printf("\t%.1lf\t%.1lf\n", pairs[0] / num_pairs, pairs[1] / num_pairs);
+        }
+        mymalloc_set_scrub(previous);
+        return 0;
+}
+
+/*
+ *      Single producer, single consumer ring of pointers used by
+ *      producer_consumer to hand blocks from one thread to another.
+ */
+struct handoff_queue
+{
+        char * slots[QUEUE_SLOTS];
+        unsigned long head;                     /* Next slot to take, only written by the consumer */
+        unsigned long tail;                     /* Next slot to fill, only written by the producer */
+};
+
+/*
+ *      Shared state of one producer_consumer run.
+ */
+struct handoff
+{
+        struct handoff_queue to_consumer;       /* Blocks allocated by the producer */
+        struct handoff_queue to_producer;       /* Blocks handed back for the producer to free */
+        int num_ops;
+        int remote;                             /* 1 if the consumer frees the blocks itself */
+        double * latencies;                     /* Time of every free in nanoseconds */
+        int freed;
+        int failed;
+};
+
+/*
+ *      Appends pointer to queue.
+ *
+ *      Returns 0 if the queue is full, 1 otherwise.
+ */
+int queue_try_put(struct handoff_queue * queue, char * pointer)
+{
+        unsigned long tail = queue->tail;
+        if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == QUEUE_SLOTS)
+                return 0;
+        queue->slots[tail % QUEUE_SLOTS] = pointer;
+        __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+        return 1;
+}
+
+/*
+ *      Takes the oldest pointer off queue into *pointer.
+ *
+ *      Returns 0 if the queue is empty, 1 otherwise.
+ */
+int queue_try_take(struct handoff_queue * queue, char ** pointer)
+{
+        unsigned long head = queue->head;
+        if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+                return 0;
+        *pointer = queue->slots[head % QUEUE_SLOTS];
+        __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+        return 1;
+}
+
+/*
+ *      Frees pointer and records how long the call took.
+ */
+void timed_free(struct handoff * handoff, char * pointer)
+{
+        OPS++;
+        double start = get_time_ns();
+        BACKEND->release(pointer);
+        handoff->latencies[handoff->freed++] = get_time_ns() - start;
+}
+
+/*
+ *      Allocates num_ops blocks of 16 to 256 bytes and hands each one to the
+ *      consumer, followed by NULL. Unless the run is remote, frees every block
+ *      the consumer hands back.
+ */
+void * producer(void * arg)
+{
+        struct handoff * handoff = (struct handoff *) arg;
+        char * p;
+        int i = 0;
+        for (; i <= handoff->num_ops; i++)
+        {
+                p = NULL;
+                if (i < handoff->num_ops)
+                {
+                        p = (char *) measured_malloc(16 + (i % 16) * 16);
+                        if (p == NULL)
+                        {
+                                handoff->failed = 1;
+                                i = handoff->num_ops;
+                        }
+                        else
+                                p[0] = '1';
+                }
+                /* Keep emptying the return queue while the consumer is behind, so neither side can block the other */
+                while (!queue_try_put(&handoff->to_consumer, p))
+                {
+                        char * returned;
+                        while (!handoff->remote && queue_try_take(&handoff->to_producer, &returned))
+                                timed_free(handoff, returned);
+                        sched_yield();
+                }
+        }
+        while (!handoff->remote)
+        {
+                if (!queue_try_take(&handoff->to_producer, &p))
+                        sched_yield();
+                else if (p == NULL)
+                        break;
+                else
+                        timed_free(handoff, p);
+        }
+        return NULL;
+}
+
+/*
+ *      Takes blocks from the producer until NULL and either frees them on this
+ *      thread, or hands them back to the producer when the run is not remote.
+ */
+void * consumer(void * arg)
+{
+        struct handoff * handoff = (struct handoff *) arg;
+        char * p;
+        while (1)
+        {
+                if (!queue_try_take(&handoff->to_consumer, &p))
+                {
+                        sched_yield();
+                        continue;
+                }
+                if (p != NULL && p[0] != '1')
+                        handoff->failed = 1;
+                if (handoff->remote && p != NULL)
+                        timed_free(handoff, p);
+                else
+                        while (!queue_try_put(&handoff->to_producer, p))
+                                sched_yield();
+                if (p == NULL)
+                        break;
+        }
+        return NULL;
+}
+
+/*
+ *      Orders latencies for qsort.
+ */
+int compare_latencies(const void * a, const void * b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+        return (x > y) - (x < y);
+}
+
+/*
+ *      Streams num_ops blocks from a producer thread to a consumer thread, once
+ *      with the consumer freeing them (remote frees into the producer's arena)
+ *      and once with the blocks handed back to the producer to free locally.
+ *      Prints the throughput in blocks per second and the median, 99th
+ *      percentile and maximum time of a free in nanoseconds for each run.
+ */
+int producer_consumer(int num_ops)
+{
+        int remote = 1;
+        for (; remote >= 0; remote--)
+        {
+                struct handoff * handoff = (struct handoff *) (calloc)(1, sizeof(struct handoff));
+                double * latencies = (double *) (calloc)(num_ops, sizeof(double));
+                if (handoff == NULL || latencies == NULL)
+                {
+                        fprintf(stderr, "PRODUCER CONSUMER: Error in calloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        return -1;
+                }
+                handoff->num_ops = num_ops;
+                handoff->remote = remote;
+                handoff->latencies = latencies;
+                pthread_t producer_tid, consumer_tid;
+                double start = get_time();
+                pthread_create(&producer_tid, NULL, producer, handoff);
+                pthread_create(&consumer_tid, NULL, consumer, handoff);
+                pthread_join(producer_tid, NULL);
+                pthread_join(consumer_tid, NULL);
+                double elapsed = get_time() - start;
+                if (handoff->failed || handoff->freed != num_ops)
+                {
+                        fprintf(stderr, "PRODUCER CONSUMER: Error with %s frees.\tFile: %s\tLine: %d\n", remote ? "remote" : "local", __FILE__, __LINE__);
+                        return -1;
+                }
+                qsort(latencies, num_ops, sizeof(double), compare_latencies);
+                printf("%s\t%.0lf\t%.0lf\t%.0lf\t%.0lf\n", remote ? "remote" : "local", num_ops / elapsed,
+                        latencies[num_ops / 2], latencies[num_ops / 100 * 99], latencies[num_ops - 1]);
+                /* these two came from the system allocator, not mymalloc */
+                (free)(latencies);
+                (free)(handoff);
+        }
+        return 0;
+}
+
+/*
+ *      Work of one thread of threaded_run: the pattern it repeats and how many
+ *      times, and the operations it made and the time it took.
+ */
+struct worker
+{
+        char pattern;                           /* 'A'-'E', 'L' for random lifetimes or 'P' for producer/consumer */
+        int rounds;
+        unsigned int seed;
+        pthread_barrier_t * start;              /* Every thread of the run starts at once */
+        struct handoff * handoff;               /* Queues of the producer/consumer pair of the thread */
+        int producing;                          /* 1 for the producer of a pair */
+        size_t ops;
+        double elapsed;
+        int failed;
+};
+
+/*
+ *      Makes num_ops random calls on an array of max_live slots: each picks a
+ *      slot, frees its block if it has one and otherwise fills it with a new
+ *      block of 16 bytes to 2 KiB, smaller sizes being more likely. Blocks
+ *      therefore live for a random number of calls, as in a real program.
+ *      Frees whatever is left at the end.
+ *
+ *      Returns 0, or -1 on error.
+ */
+int random_lifetime(int num_ops, int max_live)
+{
+        char * live[max_live];
+        memset(live, 0, sizeof(live));
+        int i = 0, ret = 0;
+        for (; i < num_ops && ret == 0; i++)
+        {
+                int slot = next_random() % max_live;
+                if (live[slot] != NULL)
+                {
+                        measured_free(live[slot]);
+                        live[slot] = NULL;
+                        continue;
+                }
+                live[slot] = (char *) measured_malloc(16 + next_random() % (16 << (next_random() % 8)));
+                if (live[slot] == NULL)
+                {
+                        fprintf(stderr, "RANDOM LIFETIME: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        ret = -1;
+                }
+                else
+                        live[slot][0] = '1';
+        }
+        for (i = 0; i < max_live; i++)
+        {
+                if (live[i] != NULL)
+                        measured_free(live[i]);
+        }
+        return ret;
+}
+
+/*
+ *      Runs the pattern of the struct worker at arg, once every thread of the
+ *      run is ready. Body of every thread started by threaded_run.
+ */
+void * worker_run(void * arg)
+{
+        struct worker * worker = (struct worker *) arg;
+        RANDOM_STATE = worker->seed;
+        pthread_barrier_wait(worker->start);
+        OPS = 0;
+        double start = get_time_ns();
+        int i = 0;
+        for (; i < worker->rounds && !worker->failed; i++)
+        {
+                switch (worker->pattern)
+                {
+                        case 'A': worker->failed = test_A(CONFIG.min_size, 150) == -1; break;
+                        case 'B': worker->failed = test_B() == -1; break;
+                        case 'C': worker->failed = test_C() == -1; break;
+                        case 'D': worker->failed = test_D() == -1; break;
+                        case 'E': worker->failed = test_E() == -1; break;
+                        case 'L': worker->failed = random_lifetime(1000, 100) == -1; break;
+                        default:
+                                /* The pair streams all of its blocks in one round */
+                                if (worker->producing)
+                                        producer(worker->handoff);
+                                else
+                                        consumer(worker->handoff);
+                                i = worker->rounds;
+                                break;
+                }
+        }
+        worker->elapsed = get_time_ns() - start;
+        worker->ops = OPS;
+        return NULL;
+}
+
+/*
+ *      Runs pattern on threads threads at once, each repeating it rounds
+ *      times. For 'P', the threads form producer/consumer pairs that stream
+ *      rounds blocks each, freed by the consumer, so threads must be even.
+ *      Writes the operations per second of all threads together, and the mean,
+ *      lowest and highest of each thread on its own, to rates.
+ *
+ *      Returns 0, or -1 on error.
+ */
+int threaded_run(char pattern, int threads, int rounds, double rates[4])
+{
+        struct worker * workers = (struct worker *) (calloc)(threads, sizeof(struct worker));
+        struct handoff * handoffs = (struct handoff *) (calloc)(threads / 2 + 1, sizeof(struct handoff));
+        double * latencies = (double *) (calloc)((threads / 2 + 1) * (size_t) rounds, sizeof(double));
+        if (workers == NULL || handoffs == NULL || latencies == NULL)
+        {
+                (free)(workers);
+                (free)(handoffs);
+                (free)(latencies);
+                return -1;
+        }
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, threads);
+        pthread_t tids[threads];
+        int i, failed = 0;
+        for (i = 0; i < threads; i++)
+        {
+                workers[i].pattern = pattern;
+                workers[i].rounds = rounds;
+                workers[i].seed = CONFIG.seed + i;
+                workers[i].start = &start;
+                workers[i].handoff = &handoffs[i / 2];
+                workers[i].producing = i % 2 == 0;
+                handoffs[i / 2].num_ops = rounds;
+                handoffs[i / 2].remote = 1;
+                handoffs[i / 2].latencies = &latencies[(i / 2) * (size_t) rounds];
+                pthread_create(&tids[i], NULL, worker_run, &workers[i]);
+        }
+        double longest = 0, total_ops = 0;
+        rates[1] = rates[3] = 0;
+        rates[2] = -1;
+        for (i = 0; i < threads; i++)
+        {
+                pthread_join(tids[i], NULL);
+                failed |= workers[i].failed || (pattern == 'P' && handoffs[i / 2].failed);
+                double rate = workers[i].ops / (workers[i].elapsed * 1e-9);
+                total_ops += workers[i].ops;
+                rates[1] += rate / threads;
+                if (rates[2] == -1 || rate < rates[2])
+                        rates[2] = rate;
+                if (rate > rates[3])
+                        rates[3] = rate;
+                if (workers[i].elapsed > longest)
+                        longest = workers[i].elapsed;
+        }
+        rates[0] = total_ops / (longest * 1e-9);
+        pthread_barrier_destroy(&start);
+        (free)(workers);
+        (free)(handoffs);
+        (free)(latencies);
+        return failed ? -1 : 0;
+}
+
+/*
+ *      Runs the patterns of tests A-E, random lifetimes and producer/consumer
+ *      pairs on 1, 2, 4, ... up to max_threads threads at once, against every
+ *      backend. Prints one line per pattern, backend and thread count: the
+ *      aggregate operations per second, the mean, lowest and highest of a
+ *      single thread, and the aggregate as a share of what the fewest threads
+ *      reached per thread, times the threads. The A and B patterns repeat
+ *      num_rounds times, C and D a quarter of that, E a hundredth, random
+ *      lifetimes 1000 calls num_rounds times and each pair streams 100 blocks
+ *      per round.
+ */
+int thread_scaling(int max_threads, int num_rounds)
+{
+        char * patterns = "ABCDELP";
+        char * names[] = {"A", "B", "C", "D", "E", "lifetime", "handoff"};
+        int rounds[] = {num_rounds, num_rounds, num_rounds / 4 + 1, num_rounds / 4 + 1, num_rounds / 100 + 1, num_rounds, num_rounds * 100};
+        int b, p;
+        SCRUB_CHECKS = 0;
+        for (b = 0; b < NUM_BACKENDS; b++)
+        {
+                BACKEND = &BACKENDS[b];
+                for (p = 0; patterns[p] != '\0'; p++)
+                {
+                        if (patterns[p] == 'E' && !BACKEND->is_mymalloc)
+                                continue;
+                        double base = 0;
+                        int threads = 1;
+                        while (threads <= max_threads)
+                        {
+                                double rates[4];
+                                if (patterns[p] != 'P' || threads % 2 == 0)
+                                {
+                                        if (threaded_run(patterns[p], threads, rounds[p], rates))
+                                        {
+                                                fprintf(stderr, "THREAD SCALING: Error in %s with %d threads.\tFile: %s\tLine: %d\n", names[p], threads, __FILE__, __LINE__);
+                                                SCRUB_CHECKS = 1;
+                                                BACKEND = &BACKENDS[0];
+                                                return -1;
+                                        }
+                                        if (base == 0)
+                                                base = rates[0] / threads;
+                                        printf("%s\t%s\t%d\t%.0lf\t%.0lf\t%.0lf\t%.0lf\t%.2lf\n", names[p], BACKEND->name, threads,
+                                                rates[0], rates[1], rates[2], rates[3], rates[0] / (base * threads));
+                                }
+                                /* Powers of two, and max_threads itself */
+                                threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2;
+                        }
+                }
+        }
+        SCRUB_CHECKS = 1;
+        BACKEND = &BACKENDS[0];
+        return 0;
+}
+
+/*
+ *      Runs every benchmarking test num_tests times under each placement
+ *      policy. Prints one line per policy with the average time of tests A-E
+ *      and G followed by the average fragmentation test_G left the heap in.
+ */
+int policy_sweep(int num_tests)
+{
+        char * names[NUM_POLICIES] = {"first", "next", "best", "good", "segregated"};
+        int previous = mymalloc_get_policy();
+        int policy = 0;
+        for (; policy < NUM_POLICIES; policy++)
+        {
+                double times[6] = {0, 0, 0, 0, 0, 0};
+                double fragmentation = 0;
+                mymalloc_set_policy(policy);
+                int i = 0;
+                for (; i < num_tests; i++)
+                {
+                        int test = 0;
+                        for (; test < 6; test++)
+                        {
+                                double start = get_time();
+                                double ret;
+                                switch (test)
+                                {
+                                        case 0: ret = test_A(1, 150); break;
+                                        case 1: ret = test_B(); break;
+                                        case 2: ret = test_C(); break;
+                                        case 3: ret = test_D(); break;
+                                        case 4: ret = test_E(); break;
+                                        default: ret = test_G(500, 5000); fragmentation += ret; break;
+                                }
+                                times[test] += get_time() - start;
+                                if (ret == -1)
+                                {
+                                        fprintf(stderr, "POLICY SWEEP: Error in test %c with %s fit.\tFile: %s\tLine: %d\n", test < 5 ? 'A' + test : 'G', names[policy], __FILE__, __LINE__);
+                                        return -1;
+                                }
+                        }
+                }
+                printf("%s", names[policy]);
+                for (i = 0; i < 6; i++)
+                        printf("\t%lf", times[i] / num_tests);
+                printf("\t%.3lf\n", fragmentation / num_tests);
+        }
+        mymalloc_set_policy(previous);
+        return 0;
+}
+
+/*
+ *      Allocates max_live blocks of 65-4096 bytes, frees every other one and
+ *      maps the heap to a temporary file in each format, printing the bytes
+ *      written and the microseconds taken, then frees the rest.
+ */
+int heap_map_cost(int max_live)
+{
+        char * names[2] = {"json", "csv"};
+        char * live[max_live];
+        int i;
+        for (i = 0; i < max_live; i++)
+        {
+                live[i] = (char *) malloc(65 + rand() % 4032);
+                if (live[i] == NULL)
+                {
+                        fprintf(stderr, "HEAP MAP: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        return -1;
+                }
+        }
+        for (i = 0; i < max_live; i += 2)
+                free(live[i]);
+        int format = HEAP_MAP_JSON;
+        for (; format <= HEAP_MAP_CSV; format++)
+        {
+                FILE * fp = tmpfile();
+                double start = get_time();
+                if (fp == NULL || mymalloc_heap_map(fp, format, names[format]))
+                {
+                        fprintf(stderr, "HEAP MAP: Error in mymalloc_heap_map.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        return -1;
+                }
+                double elapsed = get_time() - start;
+                printf("%s\t%ld\t%.0lf\n", names[format], ftell(fp), elapsed * 1e6);
+                fclose(fp);
+        }
+        for (i = 1; i < max_live; i += 2)
+                free(live[i]);
+        return 0;
+}
+
+/*
+ *      Prints the allocator counters of the test named test, counted since the
+ *      previous call: allocations, frees, failures, clean runs, free list
+ *      searches, searches skipped because no free block was large enough, the
+ *      share of the two that were skipped and the mean free blocks looked at
+ *      per search. Then the most free blocks any search has looked at so far,
+ *      and the bytes in use, free and taken by metadata and the external
+ *      fragmentation of the heap as the test left it.
+ */
+void print_stats(char * test)
+{
+        static struct mymalloc_stats last;
+        struct mymalloc_stats stats = mymalloc_stats();
+        size_t searches = stats.searches - last.searches;
+        size_t fast_fails = stats.fast_fails - last.fast_fails;
+        printf("stats\t%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%.3lf\t%.2lf\t%lu\t%lu\t%lu\t%lu\t%.3lf\n", test,
+                stats.allocs - last.allocs, stats.frees - last.frees, stats.failures - last.failures, stats.cleans - last.cleans,
+                searches, fast_fails, searches + fast_fails ? (double) fast_fails / (searches + fast_fails) : 0,
+                searches ? (double) (stats.scanned - last.scanned) / searches : 0, stats.max_scanned,
+                stats.bytes_in_use, stats.bytes_free, stats.bytes_metadata, stats.fragmentation);
+        last = stats;
+}
+
+/*
+ *      Returns the slot handle was last given in the open addressed table of
+ *      handles and slots, or -1 if it was never given one or has been freed
+ *      since. The table has capacity entries, a power of two.
+ */
+int handle_slot(uint64_t * handles, int * slots, size_t capacity, uint64_t handle)
+{
+        size_t i = (handle >> 4) & (capacity - 1);
+        for (; handles[i] != 0; i = (i + 1) & (capacity - 1))
+        {
+                if (handles[i] == handle)
+                        return slots[i];
+        }
+        return -1;
+}
+
+/*
+ *      Gives handle slot, -1 to mark it freed, in the table of handle_slot.
+ */
+void set_handle_slot(uint64_t * handles, int * slots, size_t capacity, uint64_t handle, int slot)
+{
+        size_t i = (handle >> 4) & (capacity - 1);
+        while (handles[i] != 0 && handles[i] != handle)
+                i = (i + 1) & (capacity - 1);
+        handles[i] = handle;
+        slots[i] = slot;
+}
+
+/*
+ *      Loads the trace file at path into trace, turning every handle into a
+ *      slot ahead of time. Allocations that failed when the trace was recorded
+ *      and frees of pointers it never saw allocated, such as those allocated
+ *      before it started, are dropped. The trace is held with the C library's
+ *      allocator, which leaves the heap under test alone.
+ *
+ *      Returns 0, or -1 if the file cannot be read or is not a trace.
+ */
+int load_trace(char * path, struct replay_trace * trace)
+{
+        FILE * fp = fopen(path, "rb");
+        if (fp == NULL)
+        {
+                fprintf(stderr, "memgrind: cannot open %s\n", path);
+                return -1;
+        }
+        struct trace_header header;
+        if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+                || header.version != TRACE_VERSION || header.record_size != sizeof(struct trace_record))
+        {
+                fprintf(stderr, "memgrind: %s is not a trace of this version\n", path);
+                fclose(fp);
+                return -1;
+        }
+        fseek(fp, 0, SEEK_END);
+        size_t max_ops = (ftell(fp) - sizeof(header)) / sizeof(struct trace_record);
+        fseek(fp, sizeof(header), SEEK_SET);
+
+        size_t capacity = 16;
+        while (capacity < 2 * max_ops)
+                capacity <<= 1;
+        uint64_t * handles = (uint64_t *) (calloc)(capacity, sizeof(uint64_t));
+        int * slots = (int *) (calloc)(capacity, sizeof(int));
+        memset(trace, 0, sizeof(*trace));
+        trace->ops = (struct replay_op *) (calloc)(max_ops + 1, sizeof(struct replay_op));
+        if (handles == NULL || slots == NULL || trace->ops == NULL)
+        {
+                fclose(fp);
+                (free)(handles);
+                (free)(slots);
+                (free)(trace->ops);
+                return -1;
+        }
+
+        struct trace_record record;
+        while (fread(&record, sizeof(record), 1, fp) == 1)
+        {
+                if (record.op == TRACE_FILE)
+                {
+                        fseek(fp, record.size, SEEK_CUR);
+                        continue;
+                }
+                struct replay_op * op = &trace->ops[trace->num_ops];
+                op->op = record.op;
+                op->argument = record.argument;
+                op->size = record.size;
+                op->slot = op->from = -1;
+                if (record.op == TRACE_FREE || record.op == TRACE_FREE_SIZED)
+                {
+                        op->slot = handle_slot(handles, slots, capacity, record.handle);
+                        if (op->slot == -1)
+                        {
+                                trace->skipped++;
+                                continue;
+                        }
+                        set_handle_slot(handles, slots, capacity, record.handle, -1);
+                }
+                else
+                {
+                        /* A realloc to a size of 0 frees, anything else that returned NULL failed */
+                        if (record.op == TRACE_REALLOC && record.argument != 0)
+                                op->from = handle_slot(handles, slots, capacity, record.argument);
+                        if ((record.op == TRACE_REALLOC && record.argument != 0 && op->from == -1)
+                                || (record.handle == 0 && !(record.op == TRACE_REALLOC && record.size == 0 && op->from != -1)))
+                        {
+                                trace->skipped++;
+                                continue;
+                        }
+                        op->argument = record.op == TRACE_REALLOC ? 0 : record.argument;
+                        if (op->from != -1)
+                                set_handle_slot(handles, slots, capacity, record.argument, -1);
+                        if (record.handle != 0)
+                        {
+                                op->slot = trace->num_slots++;
+                                set_handle_slot(handles, slots, capacity, record.handle, op->slot);
+                        }
+                }
+                trace->num_ops++;
+        }
+        fclose(fp);
+        (free)(handles);
+        (free)(slots);
+        return 0;
+}
+
+/*
+ *      Replays every call of REPLAY_TRACE in the order they were recorded, on
+ *      the calling thread, timing allocations into MALLOC_LATENCY and frees
+ *      into FREE_LATENCY while a workload is being timed. Blocks the trace
+ *      leaves allocated are freed at the end, untimed.
+ *
+ *      Returns 0, or -1 if an allocation that succeeded when it was recorded
+ *      fails.
+ */
+int replay()
+{
+        struct replay_trace * trace = &REPLAY_TRACE;
+        void ** live = (void **) (calloc)(trace->num_slots + 1, sizeof(void *));
+        if (live == NULL)
+                return -1;
+        int ret = 0;
+        size_t i = 0;
+        for (; i < trace->num_ops && ret == 0; i++)
+        {
+                struct replay_op * op = &trace->ops[i];
+                void * pointer = NULL;
+                double start;
+                switch (op->op)
+                {
+                        case TRACE_FREE:
+                        case TRACE_FREE_SIZED:
+                                count_live(live[op->slot], 1);
+                                start = get_time_ns();
+                                if (op->op == TRACE_FREE || BACKEND->release_sized == NULL)
+                                        BACKEND->release(live[op->slot]);
+                                else
+                                        BACKEND->release_sized(live[op->slot], op->size);
+                                if (FREE_LATENCY != NULL)
+                                        record_latency(FREE_LATENCY, get_time_ns() - start);
+                                live[op->slot] = NULL;
+                                continue;
+                        case TRACE_REALLOC:
+                                if (op->from != -1)
+                                        count_live(live[op->from], 1);
+                                start = get_time_ns();
+                                pointer = BACKEND->reallocate(op->from == -1 ? NULL : live[op->from], op->size);
+                                break;
+                        case TRACE_CALLOC:
+                                start = get_time_ns();
+                                pointer = BACKEND->allocate_zeroed(op->argument, op->size);
+                                break;
+                        case TRACE_ALIGNED_ALLOC:
+                                start = get_time_ns();
+                                pointer = BACKEND->allocate_aligned(op->argument, op->size);
+                                break;
+                        default:
+                                start = get_time_ns();
+                                pointer = BACKEND->allocate(op->size);
+                                break;
+                }
+                if (MALLOC_LATENCY != NULL)
+                        record_latency(MALLOC_LATENCY, get_time_ns() - start);
+                if (op->slot != -1 && pointer == NULL)
+                {
+                        fprintf(stderr, "REPLAY: Error in call %lu of the trace. Size: %lu\tFile: %s\tLine: %d\n", i, op->size, __FILE__, __LINE__);
+                        ret = -1;
+                        break;
+                }
+                if (op->from != -1)
+                        live[op->from] = NULL;
+                if (op->slot == -1)
+                        continue;
+                live[op->slot] = pointer;
+                count_live(pointer, 0);
+        }
+        int slot = 0;
+        for (; slot < trace->num_slots; slot++)
+        {
+                if (live[slot] != NULL)
+                        BACKEND->release(live[slot]);
+        }
+        (free)(live);
+        return ret;
+}
+
+/*
+ *      Returns whether name is in the comma separated CONFIG.workloads, or
+ *      CONFIG.workloads is "all".
+ */
+int selected(char * name)
+{
+        if (strcmp(CONFIG.workloads, "all") == 0)
+                return 1;
+        size_t length = strlen(name);
+        char * item = CONFIG.workloads;
+        while (*item != '\0')
+        {
+                char * end = strchr(item, ',');
+                size_t item_length = end == NULL ? strlen(item) : (size_t) (end - item);
+                if (item_length == length && strncmp(item, name, length) == 0)
+                        return 1;
+                if (end == NULL)
+                        break;
+                item = end + 1;
+        }
+        return 0;
+}
+
+/*
+ *      The functions of the mymalloc backend, which reach mymalloc through the
+ *      macros of mymalloc.h.
+ */
+void * backend_malloc(size_t size)
+{
+        return malloc(size);
+}
+void backend_free(void * pointer)
+{
+        free(pointer);
+}
+void * backend_calloc(size_t count, size_t size)
+{
+        return calloc(count, size);
+}
+void * backend_realloc(void * pointer, size_t size)
+{
+        return realloc(pointer, size);
+}
+void * backend_aligned_alloc(size_t alignment, size_t size)
+{
+        return aligned_alloc(alignment, size);
+}
+void backend_free_sized(void * pointer, size_t size)
+{
+        free_sized(pointer, size);
+}
+
+/*
+ *      Sets up backend as the allocator called name: "mymalloc", "system" for
+ *      the C library, or else the path of a shared library exporting the
+ *      standard functions, which is loaded without replacing them for the rest
+ *      of the process. Returns 0, or -1 if the library cannot be loaded or
+ *      lacks one of malloc, free, calloc, realloc and aligned_alloc.
+ */
+int load_backend(char * name, struct backend * backend)
+{
+        memset(backend, 0, sizeof(*backend));
+        backend->name = name;
+        if (strcmp(name, "mymalloc") == 0)
+        {
+                struct backend mine = {name, 1, backend_malloc, backend_free, backend_calloc, backend_realloc,
+                        backend_aligned_alloc, backend_free_sized, mymalloc_usable_size};
+                *backend = mine;
+                return 0;
+        }
+        if (strcmp(name, "system") == 0)
+        {
+                struct backend system = {name, 0, malloc, free, calloc, realloc, aligned_alloc, NULL, malloc_usable_size};
+                *backend = system;
+                return 0;
+        }
+        void * library = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+        if (library == NULL)
+        {
+                fprintf(stderr, "memgrind: cannot load %s: %s\n", name, dlerror());
+                return -1;
+        }
+        *(void **) &backend->allocate = dlsym(library, "malloc");
+        *(void **) &backend->release = dlsym(library, "free");
+        *(void **) &backend->allocate_zeroed = dlsym(library, "calloc");
+        *(void **) &backend->reallocate = dlsym(library, "realloc");
+        *(void **) &backend->allocate_aligned = dlsym(library, "aligned_alloc");
+        *(void **) &backend->usable_size = dlsym(library, "malloc_usable_size");
+        if (backend->allocate == NULL || backend->release == NULL || backend->allocate_zeroed == NULL
+                || backend->reallocate == NULL || backend->allocate_aligned == NULL)
+        {
+                fprintf(stderr, "memgrind: %s does not export malloc, free, calloc, realloc and aligned_alloc\n", name);
+                return -1;
+        }
+        char * base = strrchr(name, '/');
+        backend->name = base == NULL ? name : base + 1;
+        return 0;
+}
+
+/*
+ *      Sets up every backend named in CONFIG.backends. Returns 0, or -1 if one
+ *      cannot be set up or there are more than MAX_BACKENDS.
+ */
+int load_backends()
+{
+        char * names = strdup(CONFIG.backends);
+        char * name = strtok(names, ",");
+        for (; name != NULL; name = strtok(NULL, ","))
+        {
+                if (NUM_BACKENDS == MAX_BACKENDS)
+                {
+                        fprintf(stderr, "memgrind: at most %d backends\n", MAX_BACKENDS);
+                        return -1;
+                }
+                if (load_backend(name, &BACKENDS[NUM_BACKENDS]))
+                        return -1;
+                NUM_BACKENDS++;
+        }
+        BACKEND = &BACKENDS[0];
+        return NUM_BACKENDS > 0 ? 0 : -1;
+}
+
+/*
+ *      Returns the bytes of the process resident in memory now, or 0 if they
+ *      cannot be read.
+ */
+size_t resident_bytes()
+{
+        long pages = 0, resident = 0;
+        FILE * fp = fopen("/proc/self/statm", "r");
+        if (fp == NULL)
+                return 0;
+        if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+                resident = 0;
+        fclose(fp);
+        return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ *      Returns the most bytes the process has had resident in memory.
+ */
+size_t peak_resident_bytes()
+{
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss * 1024;
+}
+
+/*
+ *      Allocates max_live blocks of 1-16 KiB and frees all but every sixteenth,
+ *      leaving large free blocks between them. Then trims the heap in calls of
+ *      budget blocks until a whole pass is done, and once more in a single
+ *      call. Prints, for each, the calls made, the longest call in
+ *      microseconds, the bytes mymalloc_trim reported released and the drop of
+ *      the resident set, then frees the rest.
+ */
+int trim_cost(int max_live, int budget)
+{
+        char * live[max_live];
+        int i;
+        for (i = 0; i < max_live; i++)
+        {
+                live[i] = (char *) malloc(1024 + rand() % 15360);
+                if (live[i] == NULL)
+                {
+                        fprintf(stderr, "TRIM: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                        return -1;
+                }
+                memset(live[i], '1', 1024);
+        }
+        for (i = 0; i < max_live; i++)
+        {
+                if (i % 16 != 0)
+                        free(live[i]);
+        }
+        /* Start the budgeted calls from the first arena */
+        mymalloc_trim(0);
+        int pass = 0;
+        for (; pass < 2; pass++)
+        {
+                /* Dirty the free pages again, so both passes have the same to release */
+                for (i = 0; i < max_live; i++)
+                {
+                        if (i % 16 != 0)
+                        {
+                                live[i] = (char *) malloc(1024 + rand() % 15360);
+                                if (live[i] == NULL)
+                                {
+                                        fprintf(stderr, "TRIM: Error in malloc.\tFile: %s\tLine: %d\n", __FILE__, __LINE__);
+                                        return -1;
+                                }
+                                memset(live[i], '1', 1024);
+                        }
+                }
+                for (i = 0; i < max_live; i++)
+                {
+                        if (i % 16 != 0)
+                                free(live[i]);
+                }
+                size_t resident = resident_bytes(), released = 0;
+                double longest = 0;
+                /* Free blocks alternate with used ones, so twice max_live blocks walked cover those of this test */
+                int calls = pass == 0 ? 2 * max_live / budget + 1 : 1;
+                for (i = 0; i < calls; i++)
+                {
+                        double start = get_time();
+                        released += mymalloc_trim(pass == 0 ? budget : 0);
+                        double elapsed = get_time() - start;
+                        if (elapsed > longest)
+                                longest = elapsed;
+                }
+                size_t after = resident_bytes();
+                printf("%s\t%d\t%.0lf\t%lu\t%lu\n", pass == 0 ? "budgeted" : "whole", calls, longest * 1e6, released,
+                        resident > after ? resident - after : 0);
+        }
+        for (i = 0; i < max_live; i += 16)
+                free(live[i]);
+        return 0;
+}
+
+/*
+ *      Runs workload (A-G, or replay) once. Returns 0, or -1 on error.
+ */
+int run_once(char * workload)
+{
+        switch (workload[0])
+        {
+                case 'A': return test_A(CONFIG.min_size, 150);
+                case 'B': return test_B();
+                case 'C': return test_C();
+                case 'D': return test_D();
+                case 'E': return test_E();
+                case 'F': return test_F();
+                case 'G': return test_G(2000, 1000) < 0 ? -1 : 0;
+                default: return replay();
+        }
+}
+
+/*
+ *      Runs workload CONFIG.warmup times untimed, then CONFIG.iterations times
+ *      recording the latency of each malloc and free and the time of each run
+ *      into result. Returns 0, or -1 on error.
+ */
+int run_workload(char * workload, struct result * result)
+{
+        size_t resident = resident_bytes();
+        result->workload = workload;
+        result->backend = BACKEND->name;
+        RANDOM_STATE = CONFIG.seed;
+        int i;
+        for (i = 0; i < CONFIG.warmup; i++)
+        {
+                if (run_once(workload) == -1)
+                        return -1;
+        }
+        result->run_times = (double *) (calloc)(CONFIG.iterations, sizeof(double));
+        if (result->run_times == NULL)
+                return -1;
+        for (i = 0; i < CONFIG.iterations; i++)
+        {
+                MALLOC_LATENCY = &result->malloc_latency;
+                FREE_LATENCY = &result->free_latency;
+                LIVE_BYTES = PEAK_BYTES = 0;
+                double start = get_time_ns();
+                int ret = run_once(workload);
+                result->run_times[i] = get_time_ns() - start;
+                MALLOC_LATENCY = FREE_LATENCY = NULL;
+                if (PEAK_BYTES > result->peak_bytes)
+                        result->peak_bytes = PEAK_BYTES;
+                if (ret == -1)
+                {
+                        fprintf(stderr, "ERROR: TEST %s.\tFILE: %s\tLINE: %d\n", workload, __FILE__, __LINE__);
+                        if (DEBUG) print_heap(150);
+                        return -1;
+                }
+                if (TEST_MSG) printf("TEST %s PASSED SUCCESSFULLY\n", workload);
+                result->runs++;
+        }
+        size_t peak = peak_resident_bytes();
+        result->rss_bytes = peak > resident ? peak - resident : 0;
+        return 0;
+}
+
+/*
+ *      Runs workload like run_workload, but in a child process, so that it
+ *      starts from a heap no other backend or workload has touched and the
+ *      growth of the resident set is its own. Returns 0, or -1 on error.
+ */
+int run_isolated(char * workload, struct result * result)
+{
+        int channel[2];
+        if (pipe(channel))
+                return -1;
+        fflush(NULL);
+        pid_t child = fork();
+        if (child == -1)
+                return -1;
+        if (child == 0)
+        {
+                close(channel[0]);
+                int ret = run_workload(workload, result);
+                if (ret == 0)
+                        ret = write(channel[1], result, sizeof(*result)) != sizeof(*result)
+                                || write(channel[1], result->run_times, result->runs * sizeof(double)) != (ssize_t) (result->runs * sizeof(double));
+                _exit(ret ? 1 : 0);
+        }
+        close(channel[1]);
+        int status = 0;
+        size_t received = 0;
+        ssize_t got = 1;
+        while (received < sizeof(*result) && got > 0)
+        {
+                got = read(channel[0], (char *) result + received, sizeof(*result) - received);
+                received += got > 0 ? got : 0;
+        }
+        result->run_times = received == sizeof(*result) ? (double *) (calloc)(result->runs + 1, sizeof(double)) : NULL;
+        received = 0;
+        got = 1;
+        while (result->run_times != NULL && received < result->runs * sizeof(double) && got > 0)
+        {
+                got = read(channel[0], (char *) result->run_times + received, result->runs * sizeof(double) - received);
+                received += got > 0 ? got : 0;
+        }
+        close(channel[0]);
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || result->run_times == NULL)
+                return -1;
+        return 0;
+}
+
+/*
+ *      Writes the mean run time of result in nanoseconds, its standard
+ *      deviation and the half width of its 95% confidence interval to mean, sd
+ *      and ci.
+ */
+void run_summary(struct result * result, double * mean, double * sd, double * ci)
+{
+        double total = 0, squares = 0;
+        int i;
+        for (i = 0; i < result->runs; i++)
+                total += result->run_times[i];
+        *mean = result->runs ? total / result->runs : 0;
+        for (i = 0; i < result->runs; i++)
+                squares += (result->run_times[i] - *mean) * (result->run_times[i] - *mean);
+        *sd = result->runs > 1 ? sqrt(squares / (result->runs - 1)) : 0;
+        *ci = result->runs > 1 ? 1.96 * *sd / sqrt(result->runs) : 0;
+}
+
+/*
+ *      Returns the mallocs and frees of result per second of run time.
+ */
+double result_throughput(struct result * result)
+{
+        double total = 0;
+        int i;
+        for (i = 0; i < result->runs; i++)
+                total += result->run_times[i];
+        return total > 0 ? (result->malloc_latency.samples + result->free_latency.samples) / (total * 1e-9) : 0;
+}
+
+/*
+ *      Returns a / b, or 0 if b is 0.
+ */
+double ratio(double a, double b)
+{
+        return b != 0 ? a / b : 0;
+}
+
+/*
+ *      Writes a table comparing each result of a backend other than the first
+ *      to the result of the first backend on the same workload: throughput,
+ *      50th and 99th percentile malloc and free latency, peak live bytes and
+ *      growth of the resident set, each as a ratio to the first backend's.
+ *      Above 1 means more: faster for throughput, slower for latency and
+ *      larger for space.
+ */
+void write_comparison(FILE * out, struct result * results, int num_results)
+{
+        fprintf(out, "compare\tworkload\tbackend\tvs\tops/s\tmalloc p50\tmalloc p99\tfree p50\tfree p99\tpeak\trss\n");
+        int i, j;
+        for (i = 0; i < num_results; i++)
+        {
+                struct result * result = &results[i];
+                struct result * base = NULL;
+                for (j = 0; j < num_results && base == NULL; j++)
+                {
+                        if (results[j].backend == BACKENDS[0].name && strcmp(results[j].workload, result->workload) == 0)
+                                base = &results[j];
+                }
+                if (base == NULL || base == result)
+                        continue;
+                fprintf(out, "compare\t%s\t%s\t%s\t%.2lf\t%.2lf\t%.2lf\t%.2lf\t%.2lf\t%.2lf\t%.2lf\n", result->workload, result->backend, base->backend,
+                        ratio(result_throughput(result), result_throughput(base)),
+                        ratio(latency_percentile(&result->malloc_latency, 0.5), latency_percentile(&base->malloc_latency, 0.5)),
+                        ratio(latency_percentile(&result->malloc_latency, 0.99), latency_percentile(&base->malloc_latency, 0.99)),
+                        ratio(latency_percentile(&result->free_latency, 0.5), latency_percentile(&base->free_latency, 0.5)),
+                        ratio(latency_percentile(&result->free_latency, 0.99), latency_percentile(&base->free_latency, 0.99)),
+                        ratio(result->peak_bytes, base->peak_bytes), ratio(result->rss_bytes, base->rss_bytes));
+        }
+}
+
+/*
+ *      Writes the results of num_results workloads to out as CONFIG.format
+ *      asks: a tab separated table, a JSON array or CSV rows. Times of runs are
+ *      in nanoseconds, as are the mean, 50th, 99th and 99.9th percentile and
+ *      worst latency of the mallocs and frees of each workload. Throughput
+ *      counts both per second of run time, the peak is the most usable bytes
+ *      any run had live at once and rss is how much the resident set grew.
+ *      With more than one backend, the text format ends with a comparison of
+ *      every backend to the first one on the same workload.
+ */
+void write_results(FILE * out, struct result * results, int num_results)
+{
+        char * fields = "workload,backend,runs,mean_ns,sd_ns,ci95_ns,ops_per_sec,peak_bytes,rss_bytes,malloc_samples,malloc_mean_ns,malloc_p50_ns,malloc_p99_ns,malloc_p999_ns,malloc_max_ns,"
+                "free_samples,free_mean_ns,free_p50_ns,free_p99_ns,free_p999_ns,free_max_ns";
+        if (CONFIG.format == OUTPUT_JSON)
+                fprintf(out, "{\"seed\": %u, \"iterations\": %d, \"warmup\": %d, \"min_size\": %d, \"max_size\": %d, \"results\": [",
+                        CONFIG.seed, CONFIG.iterations, CONFIG.warmup, CONFIG.min_size, CONFIG.max_size);
+        else if (CONFIG.format == OUTPUT_CSV)
+                fprintf(out, "%s\n", fields);
+        else
+        {
+                fprintf(out, "workload\tbackend\truns\tmean_ns\tsd_ns\tci95_ns\tops/s\tpeak\trss\tmalloc:\tsamples\tmean\tp50\tp99\tp999\tmax\tfree:\tsamples\tmean\tp50\tp99\tp999\tmax\n");
+        }
+        int i;
+        for (i = 0; i < num_results; i++)
+        {
+                struct result * result = &results[i];
+                struct latency_histogram * histograms[2] = {&result->malloc_latency, &result->free_latency};
+                double mean, sd, ci;
+                run_summary(result, &mean, &sd, &ci);
+                double ops_per_sec = result_throughput(result);
+                if (CONFIG.format == OUTPUT_JSON)
+                        fprintf(out, "%s\n  {\"workload\": \"%s\", \"backend\": \"%s\", \"runs\": %d, \"mean_ns\": %.1lf, \"sd_ns\": %.1lf, \"ci95_ns\": %.1lf, \"ops_per_sec\": %.0lf, \"peak_bytes\": %lu, \"rss_bytes\": %lu",
+                                i ? "," : "", result->workload, result->backend, result->runs, mean, sd, ci, ops_per_sec, result->peak_bytes, result->rss_bytes);
+                else if (CONFIG.format == OUTPUT_CSV)
+                        fprintf(out, "%s,%s,%d,%.1lf,%.1lf,%.1lf,%.0lf,%lu,%lu", result->workload, result->backend, result->runs, mean, sd, ci, ops_per_sec, result->peak_bytes, result->rss_bytes);
+                else
+                        fprintf(out, "%s\t%s\t%d\t%.1lf\t%.1lf\t%.1lf\t%.0lf\t%lu\t%lu", result->workload, result->backend, result->runs, mean, sd, ci, ops_per_sec, result->peak_bytes, result->rss_bytes);
+                int h;
+                for (h = 0; h < 2; h++)
+                {
+                        struct latency_histogram * histogram = histograms[h];
+                        double latency_mean = histogram->samples ? histogram->total / histogram->samples : 0;
+                        double p50 = latency_percentile(histogram, 0.5);
+                        double p99 = latency_percentile(histogram, 0.99);
+                        double p999 = latency_percentile(histogram, 0.999);
+                        if (CONFIG.format == OUTPUT_JSON)
+                                fprintf(out, ", \"%s\": {\"samples\": %lu, \"mean_ns\": %.1lf, \"p50_ns\": %.0lf, \"p99_ns\": %.0lf, \"p999_ns\": %.0lf, \"max_ns\": %.0lf}",
+                                        h ? "free" : "malloc", histogram->samples, latency_mean, p50, p99, p999, histogram->max);
+                        else if (CONFIG.format == OUTPUT_CSV)
+                                fprintf(out, ",%lu,%.1lf,%.0lf,%.0lf,%.0lf,%.0lf", histogram->samples, latency_mean, p50, p99, p999, histogram->max);
+                        else
+                                fprintf(out, "\t\t%lu\t%.1lf\t%.0lf\t%.0lf\t%.0lf\t%.0lf", histogram->samples, latency_mean, p50, p99, p999, histogram->max);
+                }
+                fprintf(out, CONFIG.format == OUTPUT_JSON ? "}" : "\n");
+        }
+        if (CONFIG.format == OUTPUT_JSON)
+                fprintf(out, "\n]}\n");
+        if (CONFIG.format == OUTPUT_TEXT && NUM_BACKENDS > 1)
+                write_comparison(out, results, num_results);
+}
+
+/*
+ *      Runs the selected workloads A-G, and the replay of CONFIG.replay if
+ *      one is given, against every backend, each workload in a process of
+ *      its own when there is more than one backend. Then writes their results
+ *      to
+ *      CONFIG.output, or stdout, through a buffer so that writing them does not
+ *      land in the middle of a run. Returns 0, or 1 on error.
+ */
+int grind()
+{
+        static char * workloads[] = {"A", "B", "C", "D", "E", "F", "G", "replay"};
+        int num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+        if (CONFIG.replay == NULL)
+                num_workloads--;
+        else if (load_trace(CONFIG.replay, &REPLAY_TRACE))
+                return 1;
+        struct result * results = (struct result *) (calloc)(NUM_BACKENDS * num_workloads, sizeof(struct result));
+        if (results == NULL)
+                return 1;
+        int num_results = 0, ret = 0, i, b;
+        for (b = 0; b < NUM_BACKENDS && ret == 0; b++)
+        {
+                BACKEND = &BACKENDS[b];
+                for (i = 0; i < num_workloads && ret == 0; i++)
+                {
+                        /* E and F test mymalloc's own heap and errors */
+                        if (!selected(workloads[i]) || (!BACKEND->is_mymalloc && (workloads[i][0] == 'E' || workloads[i][0] == 'F')))
+                                continue;
+                        if (NUM_BACKENDS > 1 ? run_isolated(workloads[i], &results[num_results]) : run_workload(workloads[i], &results[num_results]))
+                        {
+                                fprintf(stderr, "ERROR: TEST %s against %s.\tFILE: %s\tLINE: %d\n", workloads[i], BACKEND->name, __FILE__, __LINE__);
+                                ret = 1;
+                        }
+                        num_results++;
+                }
+        }
+        BACKEND = &BACKENDS[0];
+        if (ret == 0)
+        {
+                FILE * out = CONFIG.output == NULL ? stdout : fopen(CONFIG.output, "w");
+                if (out == NULL)
+                {
+                        fprintf(stderr, "memgrind: cannot open %s\n", CONFIG.output);
+                        ret = 1;
+                }
+                else
+                {
+                        static char buffer[OUTPUT_BUFFER_SIZE];
+                        if (out != stdout)
+                                setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+                        write_results(out, results, num_results);
+                        if (out == stdout)
+                                fflush(out);
+                        else
+                                fclose(out);
+                }
+        }
+        for (i = 0; i < num_results; i++)
+        {
+                if (COLLECT_DATA && ret == 0)
+                {
+                        char label[64];
+                        snprintf(label, sizeof(label), NUM_BACKENDS > 1 ? "%s-%s" : "%s", results[i].workload, results[i].backend);
+                        write_data(label, results[i].run_times, results[i].runs);
+                }
+                (free)(results[i].run_times);
+        }
+        (free)(results);
+        return ret;
+}
+
+/*
+ *      Prints how memgrind is run.
+ */
+void usage(char * program)
+{
+        fprintf(stderr, "usage: %s [-w workloads] [-n iterations] [-W warmup] [-s min-max] [-r seed] [-f text|json|csv] [-o file]\n"
+                "       [-T trace] [-t trace] [-b backends] [-j threads]\n"
+                "  -w  comma separated workloads: A-G, replay and occupancy, threads, producer, slab, policy,\n"
+                "      vector, typed, batch, sized, scrub, map, trim (default all)\n"
+                "  -n  timed runs of each of A-G (default 100)\n"
+                "  -W  untimed runs of each of A-G before the timed ones (default 1)\n"
+                "  -s  size of A-C, and range of sizes of D, in bytes (default 1-64)\n"
+                "  -r  seed of rand() (default 1)\n"
+                "  -f  format of the results of A-G (default text)\n"
+                "  -o  file the results of A-G are written to (default stdout)\n"
+                "  -T  record every call memgrind makes to a trace file\n"
+                "  -t  replay a trace file, as the workload replay\n"
+                "  -b  comma separated allocators A-G and replay run against: mymalloc, system or\n"
+                "      the path of a shared library (default mymalloc)\n"
+                "  -j  most threads of the threads section (default 8)\n", program);
+}
+
+/*
+ *      Reads the options of argc and argv into CONFIG. Returns 0, or -1 if they
+ *      are not valid.
+ */
+int parse_options(int argc, char * argv[])
+{
+        int option;
+        while ((option = getopt(argc, argv, "w:n:W:s:r:f:o:T:t:b:j:h")) != -1)
+        {
+                switch (option)
+                {
+                        case 'w': CONFIG.workloads = optarg; break;
+                        case 'n': CONFIG.iterations = atoi(optarg); break;
+                        case 'W': CONFIG.warmup = atoi(optarg); break;
+                        case 's':
+                                if (sscanf(optarg, "%d-%d", &CONFIG.min_size, &CONFIG.max_size) == 1)
+                                        CONFIG.max_size = CONFIG.min_size;
+                                break;
+                        case 'r': CONFIG.seed = (unsigned int) strtoul(optarg, NULL, 10); break;
+                        case 'f':
+                                if (strcmp(optarg, "json") == 0)
+                                        CONFIG.format = OUTPUT_JSON;
+                                else if (strcmp(optarg, "csv") == 0)
+                                        CONFIG.format = OUTPUT_CSV;
+                                else if (strcmp(optarg, "text") == 0)
+                                        CONFIG.format = OUTPUT_TEXT;
+                                else
+                                        return -1;
+                                break;
+                        case 'o': CONFIG.output = optarg; break;
+                        case 'T': CONFIG.record = optarg; break;
+                        case 't': CONFIG.replay = optarg; break;
+                        case 'b': CONFIG.backends = optarg; break;
+                        case 'j': CONFIG.threads = atoi(optarg); break;
+                        default: return -1;
+                }
+        }
+        if (optind < argc || CONFIG.iterations < 1 || CONFIG.warmup < 0 || CONFIG.min_size < 1 || CONFIG.max_size < CONFIG.min_size || CONFIG.threads < 1)
+                return -1;
+        return 0;
+}
+
+int main(int argc, char * argv[])
+{
+        if (parse_options(argc, argv))
+        {
+                usage(argv[0]);
+                return 2;
+        }
+        srand(CONFIG.seed);
+        if (load_backends())
+                return 2;
+        if (CONFIG.record != NULL)
+        {
+                mymalloc_set_trace(CONFIG.record);
+                if (!mymalloc_get_trace())
+                        return 1;
+        }
+        if (grind())
+                return 1;
+        print_stats("workloads");
+        if (OCCUPANCY_SWEEP && selected("occupancy"))
+        {
+                if (occupancy_sweep(2000, 500, 1000))
+                        return 1;
+                print_stats("occupancy");
+        }
+        if (THREAD_SCALING && selected("threads"))
+        {
+                if (thread_scaling(CONFIG.threads, 200))
+                        return 1;
+                print_stats("threads");
+        }
+        if (PRODUCER_CONSUMER && selected("producer"))
+        {
+                if (producer_consumer(200000))
+                        return 1;
+                print_stats("producer");
+        }
+        if (SLAB_DENSITY && selected("slab"))
+        {
+                if (slab_density(10000))
+                        return 1;
+                print_stats("slab");
+        }
+        if (POLICY_SWEEP && selected("policy"))
+        {
+                if (policy_sweep(10))
+                        return 1;
+                print_stats("policy");
+        }
+        if (VECTOR_APPEND && selected("vector"))
+        {
+                if (vector_append(1, 1000) || vector_append(16, 1000))
+                        return 1;
+                print_stats("vector");
+        }
+        if (TYPED_ACCESS && selected("typed"))
+        {
+                if (typed_access(10000, 20) || aligned_overhead(50, 1000))
+                        return 1;
+                print_stats("typed");
+        }
+        if (BATCH_BURST && selected("batch"))
+        {
+                if (batch_burst(1000))
+                        return 1;
+                print_stats("batch");
+        }
+        if (SIZED_FREE && selected("sized"))
+        {
+                if (sized_free(50, 400))
+                        return 1;
+                print_stats("sized");
+        }
+        if (SCRUB_SWEEP && selected("scrub"))
+        {
+                if (scrub_sweep(10, 1000))
+                        return 1;
+                print_stats("scrub");
+        }
+        if (HEAP_MAP && selected("map"))
+        {
+                if (heap_map_cost(2000))
+                        return 1;
+                print_stats("map");
+        }
+        if (TRIM && selected("trim"))
+        {
+                if (trim_cost(4096, 256))
+                        return 1;
+                print_stats("trim");
+        }
+        if (CONFIG.record != NULL)
+                mymalloc_set_trace(NULL);
+        return 0;
 }
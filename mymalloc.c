@@ -3,400 +3,3610 @@
  *      Authors:  Seth Karten, Yash Shah        *
  *      2019                                    *
  ************************************************/
+#define _GNU_SOURCE
 #include "mymalloc.h"
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
 
 #define IN_USE 'Y'
 #define NOT_IN_USE 'N'
-#define HEAP_SIZE 4096
-#define METADATA_SIZE 3
+#define CACHED 'C'
+#define MAPPED 'M'
+#define BASE64_DIGITS 4
+#define HEADER_SIZE (1 + BASE64_DIGITS)
+#define FOOTER_SIZE BASE64_DIGITS
+#define METADATA_SIZE (HEADER_SIZE + FOOTER_SIZE)
 #define METADATA_FLAG_SIZE 1
-#define FIRST_NODE_INDEX 4
-#define MAX_FREE_SPACE 4088
-#define SUPERBLOCK_SPACE_INDEX 2
+#define ALIGNMENT 16
+#define FIRST_NODE_INDEX ((((int) sizeof(struct superblock) + HEADER_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) - HEADER_SIZE)
+#define MIN_BLOCK_SIZE 16
+#define LINK_SIZE BASE64_DIGITS
+#define NULL_INDEX 0
+#define TREE_LEFT 0
+#define TREE_RIGHT 1
+
+#define ARENA_SHIFT 20
+#define ARENA_SIZE ((size_t) 1 << ARENA_SHIFT)
+#define MAX_ARENA_SIZE ((size_t) 1 << (6 * BASE64_DIGITS))
+#define MAX_BLOCK_SIZE (((MAX_ARENA_SIZE - FIRST_NODE_INDEX) & ~(size_t) (ALIGNMENT - 1)) - METADATA_SIZE)
+#define ARENA_TABLE_SIZE 16384
+#define HEAP_MAP_REGION_SIZE ((size_t) 1 << 16)
+#define HEAP_MAP_REGIONS ((int) (MAX_ARENA_SIZE / HEAP_MAP_REGION_SIZE))
+#define TRACE_BUFFER_SIZE ((size_t) 1 << 16)
+#define TRACE_FILES_SIZE 1024
+#define TRIM_STEP 64
+#define SYSTEM_PAGE_SIZE 4096
+#define MAPPED_HEADER_SIZE 32
+#define MAPPED_TABLE_SIZE 16384
+#define MAX_MAPPED_SIZE ((size_t) -1 - 2 * SYSTEM_PAGE_SIZE)
+#define TRIM_CHUNK_PAGES 256
+
+#define GRANULE ALIGNMENT
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BINS (TCACHE_MAX_SIZE / GRANULE - 1)
+#define TCACHE_MAX_COUNT 64
+#define TCACHE_BATCH 32
+#define TCACHE_LINK_OFFSET sizeof(char *)
+#define TCACHE_LINK_SIZE sizeof(void *)
+
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_HEADER_SIZE 128
+#define SLAB_STEP ALIGNMENT
+#define SLAB_MAX_SIZE 64
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_STEP)
+#define SLAB_WORD_BITS (8 * (int) sizeof(unsigned long))
+#define SLAB_RELIST_DIVISOR 4
+#define SLAB_OWNED 1
+#define SLAB_LISTED 2
+#define SLAB_DETACHED 3
+
+
+#define HEAP(arena) ((char *) (arena))
+
+/*
+ *      Adds n to counter field of the calling thread, registering the thread
+ *      first so the counter is seen by mymalloc_stats.
+ */
+#define COUNT(field, n) do \
+        { \
+                if (!TCACHE.registered) \
+                        tcache_register(); \
+                __atomic_store_n(&THREAD_STATS.field, THREAD_STATS.field + (n), __ATOMIC_RELAXED); \
+        } while (0)
+
+/*
+ *      Takes n off counter field of the calling thread. The counter wraps
+ *      around below 0, which the sum over every thread undoes.
+ */
+#define UNCOUNT(field, n) COUNT(field, -(size_t) (n))
+
+/*
+ *      Hands an error to report_error. Debug builds also print the message and
+ *      the location of the call to stderr; release builds compile the message
+ *      out and leave reporting to return codes and the error handler.
+ */
+#if RELEASE
+#define REPORT_ERROR(error, pointer, ...) report_error(error, pointer)
+#else
+#define REPORT_ERROR(error, pointer, ...) (fprintf(stderr, __VA_ARGS__), report_error(error, pointer))
+#endif
+
+/*
+ *      True if the call in progress is to be recorded: tracing is on and the
+ *      call was not made by another traced call, which records it as a whole.
+ */
+#define TRACING() (__atomic_load_n(&TRACE_STATE, __ATOMIC_RELAXED) != 0 && TRACE_DEPTH == 0 && mymalloc_get_trace())
+
+/*
+ *      All arenas of the heap, most recently mapped first. Arenas are only ever
+ *      added, under HEAP_LOCK, so the list can be walked without it.
+ */
+static struct superblock * ARENA_LIST = NULL;
+static pthread_mutex_t HEAP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *      Arena the next trim step resumes in, at the offset kept in its
+ *      trim_cursor, or NULL to start over from the first arena. TRIM_LOCK
+ *      serializes walks and is taken before any arena's lock.
+ */
+static struct superblock * TRIM_ARENA = NULL;
+static pthread_mutex_t TRIM_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *      Start of every block mapped on its own, in an open addressed table
+ *      keyed by page so that free never reads memory it did not map, and the
+ *      bytes requested and mapped for them. MAPPED_LOCK guards all of them.
+ *      Requests of MMAP_THRESHOLD bytes or more are mapped, 0 until it is set
+ *      or read from the environment.
+ */
+static uintptr_t MAPPED_TABLE[MAPPED_TABLE_SIZE];
+static int MAPPED_TABLE_USED = 0;
+static size_t MAPPED_REQUESTED = 0;
+static size_t MAPPED_LENGTH = 0;
+static pthread_mutex_t MAPPED_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static size_t MMAP_THRESHOLD = 0;
+
+/*
+ *      Slab arenas are kept apart from ARENA_LIST so the block allocator never
+ *      searches them. Pages are carved from SLAB_NEXT_PAGE up to SLAB_END_PAGE
+ *      of the newest slab arena. A page stops being owned when its thread
+ *      finds it full, and goes back on the partial list of its class once
+ *      1/SLAB_RELIST_DIVISOR of its slots are free again. SLAB_LOCK guards the
+ *      partial lists and the carving position and is taken before HEAP_LOCK.
+ */
+static struct superblock * SLAB_LIST = NULL;
+static struct slab_page * SLAB_PARTIAL[SLAB_CLASSES];
+static char * SLAB_NEXT_PAGE = NULL;
+static char * SLAB_END_PAGE = NULL;
+static pthread_mutex_t SLAB_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *      Placement policy used by fetch_optimal_location, -1 until it is set or
+ *      read from the environment.
+ */
+static int PLACEMENT_POLICY = -1;
+
+/*
+ *      Scrub mode applied to freed and allocated data space, -1 until it is set
+ *      or read from the environment. SCRUB_DIRTY is set for good once a mode
+ *      other than SCRUB_ZERO_ON_FREE has been left with blocks in the heap,
+ *      since free space may no longer be zeroed after that.
+ */
+static int SCRUB_MODE = -1;
+static int SCRUB_DIRTY = 0;
+
+/*
+ *      Handler called with every error, NULL until one is set, and the last
+ *      error of each thread, MYMALLOC_OK until it first runs into one.
+ */
+static mymalloc_error_handler ERROR_HANDLER = NULL;
+static __thread int LAST_ERROR = MYMALLOC_OK;
+
+/*
+ *      Trace of every call, 1 while calls are recorded to TRACE_FD, 0 while
+ *      they are not and -1 until it is set or read from the environment.
+ *      Records are gathered in TRACE_BUFFER and written out when it fills, so
+ *      most calls cost a copy, not a system call. TRACE_FILES gives each
+ *      source file seen an index, written out the first time it is used.
+ *      TRACE_LOCK guards all of them. TRACE_DEPTH counts the traced calls in
+ *      progress on a thread, so the calls they make in turn are not recorded.
+ */
+static int TRACE_STATE = -1;
+static int TRACE_FD = -1;
+static double TRACE_START = 0;
+static char TRACE_BUFFER[TRACE_BUFFER_SIZE];
+static size_t TRACE_USED = 0;
+static char * TRACE_FILES[TRACE_FILES_SIZE];
+static int TRACE_THREADS = 0;
+static pthread_mutex_t TRACE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static __thread int TRACE_DEPTH;
+static __thread int TRACE_THREAD;
+
+/*
+ *      Counters of each thread. Only the thread itself writes them, so they
+ *      are bumped with a plain add and a relaxed store, without a locked
+ *      instruction or a shared cache line. mymalloc_stats sums the counters of
+ *      every thread in THREAD_STATS_LIST, plus those of exited threads in
+ *      RETIRED_STATS, under STATS_LOCK. SEARCH_SCANNED counts the free blocks
+ *      looked at by the search in progress. The byte counters go up in the
+ *      thread that hands a block out or caches it and down in the one that
+ *      takes it back, which may be another, so only their sum is meaningful.
+ */
+struct thread_stats
+{
+        size_t allocs;
+        size_t frees;
+        size_t failures;
+        size_t cleans;
+        size_t searches;
+        size_t fast_fails;
+        size_t scanned;
+        size_t max_scanned;
+        size_t bytes_in_use;                    /* Data space of arena blocks and slab slots handed out */
+        size_t bytes_cached;                    /* Data space of blocks in thread caches and remote free lists */
+        struct thread_stats * next;             /* Next thread in THREAD_STATS_LIST */
+        int linked;                             /* 1 while the counters are in THREAD_STATS_LIST */
+};
+static __thread struct thread_stats THREAD_STATS;
+static __thread int SEARCH_SCANNED;
+static struct thread_stats * THREAD_STATS_LIST = NULL;
+static struct thread_stats RETIRED_STATS;
+static pthread_mutex_t STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *      Per-thread cache of recently freed blocks with one LIFO bin per GRANULE
+ *      of block span, metadata included, up to TCACHE_MAX_SIZE. Cached blocks
+ *      stay off their arena's free lists and carry the CACHED flag, so a cache
+ *      hit takes no lock at all. The link to the next cached block is stored
+ *      TCACHE_LINK_OFFSET bytes into the data space, leaving the first bytes
+ *      of a freed block zeroed.
+ */
+struct thread_cache
+{
+        char * bins[TCACHE_BINS];
+        int counts[TCACHE_BINS];
+        struct slab_page * slabs[SLAB_CLASSES]; /* Slab page the thread allocates each class from */
+        struct superblock * home;               /* Arena the thread allocates from first */
+        int registered;                         /* Set once tcache_exit will run for the thread */
+};
+static __thread struct thread_cache TCACHE;
+static pthread_key_t TCACHE_KEY;
+static pthread_once_t TCACHE_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+/*
+ *      Open addressed table from every ARENA_SIZE window of mapped memory to
+ *      the arena covering it. An arena larger than ARENA_SIZE registers one
+ *      entry per window, so any address inside it can be resolved. An empty
+ *      slot has a window of 0.
+ */
+static struct
+{
+        uintptr_t window;
+        struct superblock * arena;
+} ARENA_TABLE[ARENA_TABLE_SIZE];
+static int ARENA_TABLE_USED = 0;
+
+/*
+ *      Converts x from an integer to BASE64_DIGITS psuedo-base 64 characters
+ *      stored at address[0] to address[BASE64_DIGITS-1]. The four byte
+ *      representation can store values 0-16777215.
+ */
+void dec_to_base64(int x, char * address)
+{
+        int i;
+        for (i = BASE64_DIGITS - 1; i >= 0; i--)
+        {
+                address[i] = (char) (x % 64);
+                x /= 64;
+        }
+}
+
+/*
+ *      Converts the BASE64_DIGITS psuedo-base 64 characters stored at address
+ *      to an integer and returns the integer.
+ */
+int base64_to_dec(char * address)
+{
+        int i, out = 0;
+        for (i = 0; i < BASE64_DIGITS; i++)
+        {
+                out = out * 64 + (int) address[i];
+        }
+        return out;
+}
+
+/*
+ *      Returns 1 if heap is initialized, 0 otherwise.
+ */
+int heap_initialized()
+{
+        struct superblock * arena = __atomic_load_n(&ARENA_LIST, __ATOMIC_ACQUIRE);
+        if (arena == NULL)
+                arena = __atomic_load_n(&SLAB_LIST, __ATOMIC_ACQUIRE);
+        if (arena != NULL && arena->initialized[0] == IN_USE && arena->initialized[1] == IN_USE)
+                return 1;
+        else
+                return 0;
+}
+
+/*
+ *      Returns the sum of the available space of every arena in the heap,
+ *      slab arenas included.
+ */
+size_t heap_available_space()
+{
+        size_t available_space = 0;
+        struct superblock * arena = __atomic_load_n(&ARENA_LIST, __ATOMIC_ACQUIRE);
+        for (; arena != NULL; arena = arena->next)
+                available_space += __atomic_load_n(&arena->available_space, __ATOMIC_RELAXED);
+        arena = __atomic_load_n(&SLAB_LIST, __ATOMIC_ACQUIRE);
+        for (; arena != NULL; arena = arena->next)
+                available_space += __atomic_load_n(&arena->available_space, __ATOMIC_RELAXED);
+        return available_space;
+}
+
+/*
+ *      Prints indices of the first arena for debugging
+ */
+void print_heap(int max)
+{
+        int i = 0;
+        for (; i < max && ARENA_LIST != NULL; i++)
+        {
+                if (DEBUG) printf("Index: %d\tValue: %d, %c\n", i, HEAP(ARENA_LIST)[i], HEAP(ARENA_LIST)[i]);
+        }
+}
+
+/*
+ *      Returns the segregated free list a block of the given size belongs to:
+ *      floor(log2(size)) as the first level, split into SL_CLASSES second level
+ *      classes by the bits that follow the highest set bit. Classes are ordered
+ *      by the sizes they hold, so every block of a class is smaller than any
+ *      block of a higher class.
+ */
+int size_class(int size)
+{
+        if (size < 1)
+                return 0;
+        int fl = 31 - __builtin_clz((unsigned int) size);
+        if (fl >= FL_CLASSES)
+                return NUM_SIZE_CLASSES - 1;
+        int sl = fl < SL_SHIFT ? 0 : (size >> (fl - SL_SHIFT)) & (SL_CLASSES - 1);
+        return fl * SL_CLASSES + sl;
+}
+
+/*
+ *      Returns the first non-empty size class of arena at or above class, found
+ *      with one count trailing zeros on each level of the class bitmaps, or -1
+ *      if every such class is empty.
+ */
+int find_nonempty_class(struct superblock * arena, int class)
+{
+        if (class >= NUM_SIZE_CLASSES)
+                return -1;
+        int fl = class / SL_CLASSES;
+        unsigned int sl_map = arena->sl_bitmaps[fl] & (~0U << (class % SL_CLASSES));
+        if (sl_map == 0)
+        {
+                unsigned int fl_map = arena->fl_bitmap & (~0U << fl << 1);
+                if (fl_map == 0)
+                        return -1;
+                fl = __builtin_ctz(fl_map);
+                sl_map = arena->sl_bitmaps[fl];
+        }
+        return fl * SL_CLASSES + __builtin_ctz(sl_map);
+}
+
+/*
+ *      Returns the size of the data space of the block at index in arena.
+ */
+int get_block_size(struct superblock * arena, int index)
+{
+        return base64_to_dec(&HEAP(arena)[index+METADATA_FLAG_SIZE]);
+}
+
+/*
+ *      Returns the index in arena of the next link stored in the free block at
+ *      index. The prev link directly follows it.
+ */
+int link_index(struct superblock * arena, int index)
+{
+        return index + HEADER_SIZE + get_block_size(arena, index) - 2 * LINK_SIZE;
+}
+
+/*
+ *      Writes size into both the header and the footer (boundary tag) of the
+ *      block at index.
+ */
+void set_block_size(struct superblock * arena, int index, int size)
+{
+        dec_to_base64(size, &HEAP(arena)[index+METADATA_FLAG_SIZE]);
+        dec_to_base64(size, &HEAP(arena)[index+HEADER_SIZE+size]);
+}
+
+/*
+ *      Merges the free block at index with its free neighbours, using the
+ *      footer of the previous block to find its start in constant time. The
+ *      neighbours are taken off their free lists and the metadata reclaimed by
+ *      each merge is returned to the superblock. A neighbour may be a CACHED
+ *      block whose flag its thread flips without the lock, which is why the
+ *      flags are read atomically; neither value counts as free.
+ *
+ *      Returns the index of the merged block, which is not on any free list.
+ */
+int coalesce(struct superblock * arena, int index)
+{
+        char * heap = HEAP(arena);
+        int size = get_block_size(arena, index);
+        int next = index + METADATA_SIZE + size;
+
+        /* Absorb the following block */
+        if ((size_t) next < arena->size && __atomic_load_n(&heap[next], __ATOMIC_RELAXED) == NOT_IN_USE)
+        {
+                int next_size = get_block_size(arena, next);
+                free_list_remove(arena, next);
+                memset(&heap[next-FOOTER_SIZE], '\0', METADATA_SIZE);
+                size += next_size + METADATA_SIZE;
+                set_block_size(arena, index, size);
+                mark_free_space(arena, METADATA_SIZE);
+                if (arena->trim_cursor == next)
+                        arena->trim_cursor = index;
+        }
+
+        /* Let the preceding block absorb this one */
+        if (index > FIRST_NODE_INDEX)
+        {
+                int prev = index - METADATA_SIZE - base64_to_dec(&heap[index-FOOTER_SIZE]);
+                if (__atomic_load_n(&heap[prev], __ATOMIC_RELAXED) == NOT_IN_USE)
+                {
+                        int prev_size = get_block_size(arena, prev);
+                        free_list_remove(arena, prev);
+                        memset(&heap[index-FOOTER_SIZE], '\0', METADATA_SIZE);
+                        set_block_size(arena, prev, prev_size + size + METADATA_SIZE);
+                        mark_free_space(arena, METADATA_SIZE);
+                        if (arena->trim_cursor == index)
+                                arena->trim_cursor = prev;
+                        index = prev;
+                }
+        }
+        return index;
+}
+
+/*
+ *      Pushes the free block at index onto the head of its size class list,
+ *      marks the class as non-empty and inserts the block into the size tree.
+ *      The tree is only kept up to date while best fit is in use, under any
+ *      other policy it is dropped and rebuilt when best fit next needs it.
+ */
+void free_list_insert(struct superblock * arena, int index)
+{
+        char * heap = HEAP(arena);
+        int class = size_class(get_block_size(arena, index));
+        int head = arena->free_lists[class];
+        int links = link_index(arena, index);
+
+        dec_to_base64(head, &heap[links]);
+        dec_to_base64(NULL_INDEX, &heap[links+LINK_SIZE]);
+        if (head != NULL_INDEX)
+                dec_to_base64(index, &heap[link_index(arena, head)+LINK_SIZE]);
+        arena->free_lists[class] = index;
+        arena->sl_bitmaps[class / SL_CLASSES] |= 1U << (class % SL_CLASSES);
+        arena->fl_bitmap |= 1U << (class / SL_CLASSES);
+        int largest = arena->largest_free;
+        if (largest != -1 && get_block_size(arena, index) > largest)
+                __atomic_store_n(&arena->largest_free, get_block_size(arena, index), __ATOMIC_RELAXED);
+        if (arena->tree_built && mymalloc_get_policy() == BEST_FIT)
+                arena->tree_root = tree_insert(arena, arena->tree_root, index);
+        else
+                arena->tree_built = 0;
+}
+
+/*
+ *      Unlinks the free block at index from its size class list and the size
+ *      tree, marking the class as empty if it was the last one. Must be called
+ *      before the block's size field is modified.
+ */
+void free_list_remove(struct superblock * arena, int index)
+{
+        char * heap = HEAP(arena);
+        int links = link_index(arena, index);
+        int next = base64_to_dec(&heap[links]);
+        int prev = base64_to_dec(&heap[links+LINK_SIZE]);
+
+        int class = size_class(get_block_size(arena, index));
+        /* Losing the largest block leaves the next largest unknown until it is needed */
+        if (get_block_size(arena, index) == arena->largest_free)
+                __atomic_store_n(&arena->largest_free, -1, __ATOMIC_RELAXED);
+
+        if (prev != NULL_INDEX)
+                dec_to_base64(next, &heap[link_index(arena, prev)]);
+        else
+                arena->free_lists[class] = next;
+        if (arena->free_lists[class] == NULL_INDEX)
+        {
+                arena->sl_bitmaps[class / SL_CLASSES] &= ~(1U << (class % SL_CLASSES));
+                if (arena->sl_bitmaps[class / SL_CLASSES] == 0)
+                        arena->fl_bitmap &= ~(1U << (class / SL_CLASSES));
+        }
+        /* Next fit must never resume at a block that left its list */
+        if (arena->rovers[class] == index)
+                arena->rovers[class] = next;
+        if (next != NULL_INDEX)
+                dec_to_base64(prev, &heap[link_index(arena, next)+LINK_SIZE]);
+        if (arena->tree_built && mymalloc_get_policy() == BEST_FIT)
+                arena->tree_root = tree_remove(arena, arena->tree_root, index);
+        else
+                arena->tree_built = 0;
+        /* Leave no links behind in what becomes data space again */
+        memset(&heap[tree_index(arena, index)], '\0', 4 * LINK_SIZE);
+}
+
+/*
+ *      Returns the index in arena of the tree links stored in the free block at
+ *      index, the left child directly followed by the right child. They sit
+ *      right before the free list links, so a free block of MIN_BLOCK_SIZE
+ *      bytes holds all four.
+ */
+int tree_index(struct superblock * arena, int index)
+{
+        return link_index(arena, index) - 2 * LINK_SIZE;
+}
+
+/*
+ *      Returns the left (side 0) or right (side 1) child of the tree node at
+ *      index, or NULL_INDEX.
+ */
+int tree_child(struct superblock * arena, int index, int side)
+{
+        return base64_to_dec(&HEAP(arena)[tree_index(arena, index) + side * LINK_SIZE]);
+}
+
+/*
+ *      Sets the left (side 0) or right (side 1) child of the tree node at index.
+ */
+void set_tree_child(struct superblock * arena, int index, int side, int child)
+{
+        dec_to_base64(child, &HEAP(arena)[tree_index(arena, index) + side * LINK_SIZE]);
+}
+
+/*
+ *      Returns 1 if the free block at a orders before the free block at b in
+ *      the size tree, by size and then by index, 0 otherwise.
+ */
+int tree_less(struct superblock * arena, int a, int b)
+{
+        int size_a = get_block_size(arena, a), size_b = get_block_size(arena, b);
+        return size_a < size_b || (size_a == size_b && a < b);
+}
+
+/*
+ *      Returns the heap priority of the tree node at index. The tree is a treap:
+ *      a hash of the block's index stands in for a random priority, so nothing
+ *      has to be stored for it and the tree stays balanced on expectation.
+ */
+unsigned int tree_priority(int index)
+{
+        return (unsigned int) index * 2654435761u;
+}
+
+/*
+ *      Inserts the free block at index into the subtree rooted at root, then
+ *      rotates it up while its priority beats its parent's.
+ *
+ *      Returns the new root of the subtree.
+ */
+int tree_insert(struct superblock * arena, int root, int index)
+{
+        if (root == NULL_INDEX)
+        {
+                set_tree_child(arena, index, TREE_LEFT, NULL_INDEX);
+                set_tree_child(arena, index, TREE_RIGHT, NULL_INDEX);
+                return index;
+        }
+        int side = tree_less(arena, index, root) ? TREE_LEFT : TREE_RIGHT;
+        int child = tree_insert(arena, tree_child(arena, root, side), index);
+        set_tree_child(arena, root, side, child);
+        if (tree_priority(child) > tree_priority(root))
+        {
+                /* Rotate child above root */
+                set_tree_child(arena, root, side, tree_child(arena, child, !side));
+                set_tree_child(arena, child, !side, root);
+                return child;
+        }
+        return root;
+}
+
+/*
+ *      Joins the subtrees a and b, every node of a ordering before every node
+ *      of b, keeping the node with the higher priority on top at each level.
+ *
+ *      Returns the root of the joined tree.
+ */
+int tree_merge(struct superblock * arena, int a, int b)
+{
+        if (a == NULL_INDEX)
+                return b;
+        if (b == NULL_INDEX)
+                return a;
+        if (tree_priority(a) > tree_priority(b))
+        {
+                set_tree_child(arena, a, TREE_RIGHT, tree_merge(arena, tree_child(arena, a, TREE_RIGHT), b));
+                return a;
+        }
+        set_tree_child(arena, b, TREE_LEFT, tree_merge(arena, a, tree_child(arena, b, TREE_LEFT)));
+        return b;
+}
+
+/*
+ *      Removes the free block at index from the subtree rooted at root by
+ *      merging its children in its place.
+ *
+ *      Returns the new root of the subtree.
+ */
+int tree_remove(struct superblock * arena, int root, int index)
+{
+        if (root == NULL_INDEX)
+                return NULL_INDEX;
+        if (root == index)
+                return tree_merge(arena, tree_child(arena, root, TREE_LEFT), tree_child(arena, root, TREE_RIGHT));
+        int side = tree_less(arena, index, root) ? TREE_LEFT : TREE_RIGHT;
+        set_tree_child(arena, root, side, tree_remove(arena, tree_child(arena, root, side), index));
+        return root;
+}
+
+/*
+ *      Returns the index of the smallest free block of arena with at least size
+ *      bytes of data space, the lowest one among equals, or -1 if there is none.
+ */
+int tree_lower_bound(struct superblock * arena, size_t size)
+{
+        int best = -1;
+        int ptr = arena->tree_root;
+        while (ptr != NULL_INDEX)
+        {
+                SEARCH_SCANNED++;
+                if ((size_t) get_block_size(arena, ptr) >= size)
+                {
+                        best = ptr;
+                        ptr = tree_child(arena, ptr, TREE_LEFT);
+                }
+                else
+                        ptr = tree_child(arena, ptr, TREE_RIGHT);
+        }
+        return best;
+}
+
+/*
+ *      Inserts every free block of arena into an empty size tree.
+ */
+void tree_build(struct superblock * arena)
+{
+        arena->tree_root = NULL_INDEX;
+        int class = find_nonempty_class(arena, 0);
+        for (; class != -1; class = find_nonempty_class(arena, class + 1))
+        {
+                int ptr = arena->free_lists[class];
+                for (; ptr != NULL_INDEX; ptr = base64_to_dec(&HEAP(arena)[link_index(arena, ptr)]))
+                        arena->tree_root = tree_insert(arena, arena->tree_root, ptr);
+        }
+        arena->tree_built = 1;
+}
+
+/*
+ *      Marks the IN_USE block with data space at pointer as NOT_IN_USE, merges
+ *      it with its free neighbours and links the result into its free list.
+ *      The caller must hold the arena's lock.
+ */
+void release_block(struct superblock * arena, char * pointer)
+{
+        int block_size = base64_to_dec(&pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+        pointer[-HEADER_SIZE] = NOT_IN_USE;
+        mark_free_space(arena, block_size);
+        free_list_insert(arena, coalesce(arena, pointer - HEAP(arena) - HEADER_SIZE));
+}
+
+/*
+ *      Pushes the block with data space at pointer onto the remote free list of
+ *      arena with a compare-and-swap loop, so threads freeing blocks of an
+ *      arena they do not allocate from never wait on its lock. The block is
+ *      flagged as CACHED until it is released and is linked through the same
+ *      TCACHE_LINK_OFFSET bytes as the thread cache.
+ */
+void remote_free_push(struct superblock * arena, char * pointer)
+{
+        char * head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+        COUNT(bytes_cached, base64_to_dec(&pointer[METADATA_FLAG_SIZE-HEADER_SIZE]));
+        __atomic_store_n(&pointer[-HEADER_SIZE], CACHED, __ATOMIC_RELAXED);
+        do
+        {
+                memcpy(pointer + TCACHE_LINK_OFFSET, &head, TCACHE_LINK_SIZE);
+        } while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, pointer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ *      Detaches the whole remote free list of arena in one atomic exchange and
+ *      releases every block on it. The caller must hold the arena's lock.
+ */
+void drain_remote_frees(struct superblock * arena)
+{
+        if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+                return;
+        char * pointer = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+        while (pointer != NULL)
+        {
+                char * next;
+                memcpy(&next, pointer + TCACHE_LINK_OFFSET, TCACHE_LINK_SIZE);
+                memset(pointer + TCACHE_LINK_OFFSET, '\0', TCACHE_LINK_SIZE);
+                UNCOUNT(bytes_cached, base64_to_dec(&pointer[METADATA_FLAG_SIZE-HEADER_SIZE]));
+                release_block(arena, pointer);
+                pointer = next;
+        }
+}
+
+/*
+ *      Returns the slab class serving requests of size bytes.
+ */
+int slab_class(size_t size)
+{
+        return (int) ((size - 1) / SLAB_STEP);
+}
+
+/*
+ *      Carves the next unused page of the slab arenas into slots for class,
+ *      mapping a new slab arena when every page is in use. Bits past the last
+ *      slot are set so they are never handed out. The caller must hold the
+ *      slab lock.
+ *
+ *      Returns the page, or NULL if no memory could be mapped.
+ */
+struct slab_page * slab_carve_page(int class)
+{
+        if (SLAB_NEXT_PAGE == SLAB_END_PAGE)
+        {
+                pthread_mutex_lock(&HEAP_LOCK);
+                struct superblock * arena = create_slab_arena();
+                pthread_mutex_unlock(&HEAP_LOCK);
+                if (arena == NULL)
+                        return NULL;
+                /* The first page holds the superblock */
+                SLAB_NEXT_PAGE = HEAP(arena) + SLAB_PAGE_SIZE;
+                SLAB_END_PAGE = HEAP(arena) + arena->size;
+        }
+        struct slab_page * page = (struct slab_page *) SLAB_NEXT_PAGE;
+        SLAB_NEXT_PAGE += SLAB_PAGE_SIZE;
+
+        page->object_size = (class + 1) * SLAB_STEP;
+        page->capacity = (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / page->object_size;
+        page->free_slots = page->capacity;
+        page->state = SLAB_OWNED;
+        int slot = page->capacity;
+        for (; slot < SLAB_BITMAP_WORDS * SLAB_WORD_BITS; slot++)
+                page->bitmap[slot / SLAB_WORD_BITS] |= 1UL << (slot % SLAB_WORD_BITS);
+
+        /* Space lost at the end of the page is no longer available */
+        struct superblock * arena = find_arena(page);
+        __atomic_fetch_sub(&arena->available_space, SLAB_PAGE_SIZE - SLAB_HEADER_SIZE - page->capacity * page->object_size, __ATOMIC_RELAXED);
+        if (DEBUG) printf("[slab] carved page %p into %d slots of %d bytes\n", (void *) page, page->capacity, page->object_size);
+        return page;
+}
+
+/*
+ *      Gives up the calling thread's ownership of page, putting it on its
+ *      partial list right away if enough of its slots are free. Otherwise the
+ *      free that brings it to that point lists it, see slab_free. The state is
+ *      written before free_slots is read, and slab_free does the opposite, so
+ *      one of the two always sees the other. The caller must hold the slab
+ *      lock.
+ */
+void slab_release_page(struct slab_page * page)
+{
+        __atomic_store_n(&page->state, SLAB_DETACHED, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&page->free_slots, __ATOMIC_SEQ_CST) >= page->capacity / SLAB_RELIST_DIVISOR)
+        {
+                int class = slab_class(page->object_size);
+                __atomic_store_n(&page->state, SLAB_LISTED, __ATOMIC_RELAXED);
+                page->next = SLAB_PARTIAL[class];
+                SLAB_PARTIAL[class] = page;
+        }
+}
+
+/*
+ *      Replaces the calling thread's page for class, which is full or missing,
+ *      with a partially free page or a newly carved one.
+ *
+ *      Returns the page, or NULL if no memory could be mapped.
+ */
+struct slab_page * slab_acquire_page(int class)
+{
+        if (!TCACHE.registered)
+                tcache_register();
+
+        pthread_mutex_lock(&SLAB_LOCK);
+        if (TCACHE.slabs[class] != NULL)
+                slab_release_page(TCACHE.slabs[class]);
+        struct slab_page * page = SLAB_PARTIAL[class];
+        if (page != NULL)
+        {
+                SLAB_PARTIAL[class] = page->next;
+                page->next = NULL;
+                __atomic_store_n(&page->state, SLAB_OWNED, __ATOMIC_SEQ_CST);
+        }
+        else
+                page = slab_carve_page(class);
+        TCACHE.slabs[class] = page;
+        pthread_mutex_unlock(&SLAB_LOCK);
+        return page;
+}
+
+/*
+ *      Takes a free slot of the calling thread's slab page for size bytes. Only
+ *      the owning thread takes slots from a page, so the free count can be
+ *      checked before it is decremented, and the first clear bit found stays
+ *      clear until it is set.
+ *
+ *      Returns a pointer to the slot, or NULL if no memory could be mapped.
+ */
+void * slab_allocate(size_t size)
+{
+        int class = slab_class(size);
+        struct slab_page * page = TCACHE.slabs[class];
+        if (page == NULL || __atomic_load_n(&page->free_slots, __ATOMIC_RELAXED) == 0)
+        {
+                page = slab_acquire_page(class);
+                if (page == NULL)
+                        return NULL;
+        }
+        __atomic_sub_fetch(&page->free_slots, 1, __ATOMIC_ACQ_REL);
+
+        /* A slot counted as free always has its bit cleared already */
+        int word = 0;
+        unsigned long bits;
+        while ((bits = __atomic_load_n(&page->bitmap[word], __ATOMIC_ACQUIRE)) == ~0UL)
+                word++;
+        int bit = __builtin_ctzl(~bits);
+        __atomic_fetch_or(&page->bitmap[word], 1UL << bit, __ATOMIC_RELAXED);
+
+        __atomic_fetch_sub(&find_arena(page)->available_space, page->object_size, __ATOMIC_RELAXED);
+        COUNT(bytes_in_use, page->object_size);
+        int slot = word * SLAB_WORD_BITS + bit;
+        return (char *) page + SLAB_HEADER_SIZE + slot * page->object_size;
+}
+
+/*
+ *      Zeroes the slot at pointer in slab arena arena and clears its bit,
+ *      reporting an error instead if pointer is not the start of a
+ *      slot in use. The free that brings a detached page up to
+ *      1/SLAB_RELIST_DIVISOR free slots puts it back on its partial list.
+ */
+void slab_free(struct superblock * arena, char * pointer, char * file, int line)
+{
+        /* Only the error reports use the location, and RELEASE compiles them out */
+        (void) file;
+        (void) line;
+        struct slab_page * page = (struct slab_page *) ((uintptr_t) pointer & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+        long offset = pointer - (char *) page - SLAB_HEADER_SIZE;
+        if ((char *) page == HEAP(arena) || offset < 0 || page->object_size == 0
+                || offset % page->object_size != 0 || offset / page->object_size >= page->capacity)
+        {
+                REPORT_ERROR(MYMALLOC_EPOINTER, pointer, "[free] Error in free: Invalid pointer passed. Not the start of a slab slot. Pointer: %p FILE: %s\tLINE: %d\n", (void *) pointer, file, line);
+                return;
+        }
+        int slot = (int) (offset / page->object_size);
+        unsigned long mask = 1UL << (slot % SLAB_WORD_BITS);
+        unsigned long * word = &page->bitmap[slot / SLAB_WORD_BITS];
+        if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & mask))
+        {
+                REPORT_ERROR(MYMALLOC_ENOTINUSE, pointer, "[free] Error in free: Slab slot is not in use. Pointer: %p FILE: %s\tLINE: %d\n", (void *) pointer, file, line);
+                return;
+        }
+
+        scrub(pointer, page->object_size);
+        __atomic_fetch_and(word, ~mask, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&arena->available_space, page->object_size, __ATOMIC_RELAXED);
+        int free_slots = __atomic_add_fetch(&page->free_slots, 1, __ATOMIC_SEQ_CST);
+        COUNT(frees, 1);
+        UNCOUNT(bytes_in_use, page->object_size);
+
+        if (free_slots == page->capacity / SLAB_RELIST_DIVISOR && __atomic_load_n(&page->state, __ATOMIC_SEQ_CST) == SLAB_DETACHED)
+        {
+                pthread_mutex_lock(&SLAB_LOCK);
+                if (__atomic_load_n(&page->state, __ATOMIC_RELAXED) == SLAB_DETACHED)
+                {
+                        int class = slab_class(page->object_size);
+                        __atomic_store_n(&page->state, SLAB_LISTED, __ATOMIC_RELAXED);
+                        page->next = SLAB_PARTIAL[class];
+                        SLAB_PARTIAL[class] = page;
+                }
+                pthread_mutex_unlock(&SLAB_LOCK);
+        }
+}
+
+/*
+ *      Creates the key whose destructor flushes a thread's cache when it exits.
+ */
+void tcache_create_key()
+{
+        pthread_key_create(&TCACHE_KEY, tcache_exit);
+}
+
+/*
+ *      Makes sure tcache_exit runs when the calling thread exits.
+ */
+void tcache_register()
+{
+        pthread_once(&TCACHE_KEY_ONCE, tcache_create_key);
+        pthread_setspecific(TCACHE_KEY, &TCACHE);
+        TCACHE.registered = 1;
+        stats_register();
+}
+
+/*
+ *      Pushes the block with data space at pointer onto cache bin and flags it
+ *      as CACHED.
+ */
+void tcache_push(int bin, char * pointer)
+{
+        COUNT(bytes_cached, base64_to_dec(&pointer[METADATA_FLAG_SIZE-HEADER_SIZE]));
+        __atomic_store_n(&pointer[-HEADER_SIZE], CACHED, __ATOMIC_RELAXED);
+        memcpy(pointer + TCACHE_LINK_OFFSET, &TCACHE.bins[bin], TCACHE_LINK_SIZE);
+        TCACHE.bins[bin] = pointer;
+        TCACHE.counts[bin]++;
+}
+
+/*
+ *      Pops the most recently cached block of bin, which must not be empty, and
+ *      flags it as IN_USE again.
+ *
+ *      Returns a pointer to the data space of the block.
+ */
+char * tcache_pop(int bin)
+{
+        char * pointer = TCACHE.bins[bin];
+        memcpy(&TCACHE.bins[bin], pointer + TCACHE_LINK_OFFSET, TCACHE_LINK_SIZE);
+        memset(pointer + TCACHE_LINK_OFFSET, '\0', TCACHE_LINK_SIZE);
+        __atomic_store_n(&pointer[-HEADER_SIZE], IN_USE, __ATOMIC_RELAXED);
+        TCACHE.counts[bin]--;
+        int block_size = base64_to_dec(&pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+        UNCOUNT(bytes_cached, block_size);
+        COUNT(bytes_in_use, block_size);
+        return pointer;
+}
+
+/*
+ *      Returns the arena the calling thread allocates from first, picking an
+ *      arena no other thread uses or mapping a new one on the thread's first
+ *      call.
+ */
+struct superblock * home_arena()
+{
+        if (TCACHE.home != NULL)
+                return TCACHE.home;
+        if (!TCACHE.registered)
+                tcache_register();
+
+        pthread_mutex_lock(&HEAP_LOCK);
+        struct superblock * arena = ARENA_LIST;
+        for (; arena != NULL; arena = arena->next)
+        {
+                if (arena->threads == 0 && arena->size == ARENA_SIZE)
+                        break;
+        }
+        if (arena == NULL)
+                arena = create_arena(0);
+        if (arena != NULL)
+                __atomic_add_fetch(&arena->threads, 1, __ATOMIC_RELAXED);
+        TCACHE.home = arena;
+        pthread_mutex_unlock(&HEAP_LOCK);
+        return arena;
+}
+
+/*
+ *      Serves size bytes from the shared arenas: the calling thread's home
+ *      arena first, then every other arena, then a newly mapped arena.
+ *
+ *      Returns NULL if no memory could be mapped.
+ */
+void * heap_allocate(size_t size)
+{
+        struct superblock * home = home_arena();
+        struct superblock * arena;
+        void * pointer = NULL;
+        int block_index;
+
+        /* Try the calling thread's home arena first, after taking back what other threads freed into it */
+        if (home != NULL)
+        {
+                pthread_mutex_lock(&home->lock);
+                drain_remote_frees(home);
+                block_index = fetch_optimal_location(home, size);
+                if (block_index != -1)
+                        pointer = allocate_block(home, block_index, size);
+                pthread_mutex_unlock(&home->lock);
+                if (pointer != NULL)
+                        return pointer;
+        }
+
+        /*      Then every other arena with enough space available to allocate. An
+                arena whose cached largest free block is too small is skipped
+                without taking its lock.
+        */
+        for (arena = __atomic_load_n(&ARENA_LIST, __ATOMIC_ACQUIRE); arena != NULL; arena = arena->next)
+        {
+                if (arena == home || __atomic_load_n(&arena->available_space, __ATOMIC_RELAXED) < size)
+                        continue;
+                int largest = __atomic_load_n(&arena->largest_free, __ATOMIC_RELAXED);
+                if (largest != -1 && (size_t) largest < size)
+                {
+                        COUNT(fast_fails, 1);
+                        continue;
+                }
+                pthread_mutex_lock(&arena->lock);
+                drain_remote_frees(arena);
+                block_index = fetch_optimal_location(arena, size);
+                if (block_index != -1)
+                        pointer = allocate_block(arena, block_index, size);
+                pthread_mutex_unlock(&arena->lock);
+                if (pointer != NULL)
+                        return pointer;
+        }
+
+        /*      if no arena has a large enough block, grow the heap by another
+                arena instead of failing
+        */
+        pthread_mutex_lock(&HEAP_LOCK);
+        arena = create_arena(size);
+        if (arena != NULL)
+        {
+                /* A new regular arena becomes the thread's home so it stops searching its full one */
+                if (arena->size == ARENA_SIZE)
+                {
+                        if (home != NULL)
+                                __atomic_sub_fetch(&home->threads, 1, __ATOMIC_RELAXED);
+                        __atomic_add_fetch(&arena->threads, 1, __ATOMIC_RELAXED);
+                        TCACHE.home = arena;
+                }
+                pthread_mutex_lock(&arena->lock);
+                pointer = allocate_block(arena, FIRST_NODE_INDEX, size);
+                pthread_mutex_unlock(&arena->lock);
+        }
+        pthread_mutex_unlock(&HEAP_LOCK);
+        return pointer;
+}
+
+/*
+ *      Moves up to TCACHE_BATCH blocks for cache bin from the calling thread's
+ *      home arena into its thread cache, taking the arena's lock only once.
+ */
+void tcache_refill(int bin)
+{
+        size_t size = tcache_bin_size(bin);
+        struct superblock * home = home_arena();
+        if (home == NULL)
+                return;
+
+        pthread_mutex_lock(&home->lock);
+        drain_remote_frees(home);
+        int i = 0;
+        for (; i < TCACHE_BATCH; i++)
+        {
+                int block_index = fetch_optimal_location(home, size);
+                if (block_index == -1)
+                        break;
+                tcache_push(bin, allocate_block(home, block_index, size));
+        }
+        pthread_mutex_unlock(&home->lock);
+}
+
+/*
+ *      Returns the count least recently cached blocks of bin to their arenas,
+ *      taking each arena's lock once per run of blocks from the same arena.
+ */
+void tcache_flush(int bin, int count)
+{
+        int keep = TCACHE.counts[bin] - count;
+        char * pointer;
+
+        /* Detach the oldest blocks, which sit at the end of the bin */
+        if (keep <= 0)
+        {
+                pointer = TCACHE.bins[bin];
+                TCACHE.bins[bin] = NULL;
+                TCACHE.counts[bin] = 0;
+        }
+        else
+        {
+                char * last = TCACHE.bins[bin];
+                int i = 1;
+                for (; i < keep; i++)
+                        memcpy(&last, last + TCACHE_LINK_OFFSET, TCACHE_LINK_SIZE);
+                memcpy(&pointer, last + TCACHE_LINK_OFFSET, TCACHE_LINK_SIZE);
+                memset(last + TCACHE_LINK_OFFSET, '\0', TCACHE_LINK_SIZE);
+                TCACHE.counts[bin] = keep;
+        }
+
+        struct superblock * locked = NULL;
+        while (pointer != NULL)
+        {
+                char * next;
+                memcpy(&next, pointer + TCACHE_LINK_OFFSET, TCACHE_LINK_SIZE);
+                memset(pointer + TCACHE_LINK_OFFSET, '\0', TCACHE_LINK_SIZE);
+
+                struct superblock * arena = find_arena(pointer);
+                if (arena != locked)
+                {
+                        if (locked != NULL)
+                                pthread_mutex_unlock(&locked->lock);
+                        pthread_mutex_lock(&arena->lock);
+                        locked = arena;
+                }
+                UNCOUNT(bytes_cached, base64_to_dec(&pointer[METADATA_FLAG_SIZE-HEADER_SIZE]));
+                release_block(arena, pointer);
+                pointer = next;
+        }
+        if (locked != NULL)
+                pthread_mutex_unlock(&locked->lock);
+}
+
+/*
+ *      Flushes every bin of the exiting thread's cache and gives up its slab
+ *      pages and home arena. Registered as the destructor of the thread cache
+ *      key, which is set again if the thread uses the heap afterwards, so the
+ *      cache is emptied once more on the next round of destructors.
+ */
+void tcache_exit(void * unused)
+{
+        (void) unused;
+        int bin = 0;
+        for (; bin < TCACHE_BINS; bin++)
+                tcache_flush(bin, TCACHE.counts[bin]);
+
+        pthread_mutex_lock(&SLAB_LOCK);
+        int class = 0;
+        for (; class < SLAB_CLASSES; class++)
+        {
+                if (TCACHE.slabs[class] != NULL)
+                        slab_release_page(TCACHE.slabs[class]);
+                TCACHE.slabs[class] = NULL;
+        }
+        pthread_mutex_unlock(&SLAB_LOCK);
+
+        pthread_mutex_lock(&HEAP_LOCK);
+        if (TCACHE.home != NULL)
+                __atomic_sub_fetch(&TCACHE.home->threads, 1, __ATOMIC_RELAXED);
+        TCACHE.home = NULL;
+        pthread_mutex_unlock(&HEAP_LOCK);
+
+        stats_unregister();
+        /* A later destructor that allocates or frees registers the cache again */
+        TCACHE.registered = 0;
+}
+
+/*
+ *      Takes every lock of the allocator ahead of a fork, in the order they
+ *      nest everywhere else: TRACE_LOCK, TRIM_LOCK, STATS_LOCK, SLAB_LOCK,
+ *      HEAP_LOCK, the lock of each arena and MAPPED_LOCK. The child then
+ *      starts with no lock held by a thread it does not have.
+ */
+void mymalloc_fork_prepare()
+{
+        pthread_mutex_lock(&TRACE_LOCK);
+        pthread_mutex_lock(&TRIM_LOCK);
+        pthread_mutex_lock(&STATS_LOCK);
+        pthread_mutex_lock(&SLAB_LOCK);
+        pthread_mutex_lock(&HEAP_LOCK);
+        struct superblock * arena = ARENA_LIST;
+        for (; arena != NULL; arena = arena->next)
+                pthread_mutex_lock(&arena->lock);
+        pthread_mutex_lock(&MAPPED_LOCK);
+}
+
+/*
+ *      Releases the locks mymalloc_fork_prepare took, in the parent.
+ */
+void mymalloc_fork_parent()
+{
+        pthread_mutex_unlock(&MAPPED_LOCK);
+        struct superblock * arena = ARENA_LIST;
+        for (; arena != NULL; arena = arena->next)
+                pthread_mutex_unlock(&arena->lock);
+        pthread_mutex_unlock(&HEAP_LOCK);
+        pthread_mutex_unlock(&SLAB_LOCK);
+        pthread_mutex_unlock(&STATS_LOCK);
+        pthread_mutex_unlock(&TRIM_LOCK);
+        pthread_mutex_unlock(&TRACE_LOCK);
+}
+
+/*
+ *      Sets up the locks mymalloc_fork_prepare took again in the child, whose
+ *      only thread is the one that forked. The other threads of the parent
+ *      are gone, so no arena is the home of any thread but this one, and the
+ *      blocks they freed to other arenas are released right away.
+ */
+void mymalloc_fork_child()
+{
+        pthread_mutex_init(&MAPPED_LOCK, NULL);
+        pthread_mutex_init(&HEAP_LOCK, NULL);
+        pthread_mutex_init(&SLAB_LOCK, NULL);
+        pthread_mutex_init(&STATS_LOCK, NULL);
+        pthread_mutex_init(&TRIM_LOCK, NULL);
+        pthread_mutex_init(&TRACE_LOCK, NULL);
+        /* Draining counts the bytes taken off the remote lists, which can take STATS_LOCK, so every lock is set up first */
+        struct superblock * arena = ARENA_LIST;
+        for (; arena != NULL; arena = arena->next)
+        {
+                pthread_mutex_init(&arena->lock, NULL);
+                pthread_mutex_lock(&arena->lock);
+                drain_remote_frees(arena);
+                arena->threads = arena == TCACHE.home ? 1 : 0;
+                pthread_mutex_unlock(&arena->lock);
+        }
+}
+
+/*
+ *      Maps arena_size bytes aligned to ARENA_SIZE and registers each of its
+ *      windows in the arena table. The caller must hold the heap lock.
+ *
+ *      Returns the start of the mapping, or NULL if no memory could be mapped.
+ */
+char * map_arena(size_t arena_size)
+{
+        int windows = (int) (arena_size >> ARENA_SHIFT);
+        if (arena_size > MAX_ARENA_SIZE || 2 * (ARENA_TABLE_USED + windows) > ARENA_TABLE_SIZE)
+                return NULL;
+
+        /* Over-map by one window so the arena can be aligned to ARENA_SIZE, then give back the slack */
+        char * mapping = mmap(NULL, arena_size + ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+                return NULL;
+        char * start = (char *) (((uintptr_t) mapping + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1));
+        if (start > mapping)
+                munmap(mapping, start - mapping);
+        if (start + arena_size < mapping + arena_size + ARENA_SIZE)
+                munmap(start + arena_size, mapping + ARENA_SIZE - start);
+
+        /* Register every window of the arena */
+        struct superblock * arena = (struct superblock *) start;
+        int i;
+        for (i = 0; i < windows; i++)
+        {
+                uintptr_t window = (uintptr_t) start + ((uintptr_t) i << ARENA_SHIFT);
+                int slot = (int) ((window >> ARENA_SHIFT) & (ARENA_TABLE_SIZE - 1));
+                while (ARENA_TABLE[slot].window != 0)
+                        slot = (slot + 1) & (ARENA_TABLE_SIZE - 1);
+                ARENA_TABLE[slot].arena = arena;
+                __atomic_store_n(&ARENA_TABLE[slot].window, window, __ATOMIC_RELEASE);
+        }
+        ARENA_TABLE_USED += windows;
+        return start;
+}
+
+/*
+ *      Maps a new arena large enough to hold a data node of size bytes, sets up
+ *      its superblock and first data node and links it into the heap. The
+ *      caller must hold the heap lock.
+ *
+ *      Returns the new arena, or NULL if no memory could be mapped.
+ */
+struct superblock * create_arena(size_t size)
+{
+        /* Round the arena up to a whole number of windows */
+        size_t arena_size = ARENA_SIZE;
+        if (size + FIRST_NODE_INDEX + METADATA_SIZE > arena_size)
+                arena_size = (size + FIRST_NODE_INDEX + METADATA_SIZE + ARENA_SIZE - 1) & ~(ARENA_SIZE - 1);
+        struct superblock * arena = (struct superblock *) map_arena(arena_size);
+        if (arena == NULL)
+                return NULL;
+
+        /* Set up the superblock. The mapping is zero filled, so every size class and the remote free list start out empty. */
+        arena->initialized[0] = IN_USE;
+        arena->initialized[1] = IN_USE;
+        arena->size = arena_size;
+        arena->available_space = arena_size - FIRST_NODE_INDEX - METADATA_SIZE;
+        arena->trim_cursor = FIRST_NODE_INDEX;
+        pthread_mutex_init(&arena->lock, NULL);
+        create_data_node(arena, FIRST_NODE_INDEX, arena->available_space);
+
+        arena->next = ARENA_LIST;
+        __atomic_store_n(&ARENA_LIST, arena, __ATOMIC_RELEASE);
+        if (DEBUG) printf("[arena] mapped arena %p of %ld bytes\n", (void *) arena, arena_size);
+        return arena;
+}
+
+/*
+ *      Maps a new slab arena and links it into the list of slab arenas. Every
+ *      page but the first, which holds the superblock, is handed out by
+ *      slab_carve_page. The caller must hold the heap lock.
+ *
+ *      Returns the new arena, or NULL if no memory could be mapped.
+ */
+struct superblock * create_slab_arena()
+{
+        struct superblock * arena = (struct superblock *) map_arena(ARENA_SIZE);
+        if (arena == NULL)
+                return NULL;
+
+        arena->initialized[0] = IN_USE;
+        arena->initialized[1] = IN_USE;
+        arena->size = ARENA_SIZE;
+        arena->slab = 1;
+        arena->available_space = (ARENA_SIZE / SLAB_PAGE_SIZE - 1) * (SLAB_PAGE_SIZE - SLAB_HEADER_SIZE);
+        pthread_mutex_init(&arena->lock, NULL);
+
+        arena->next = SLAB_LIST;
+        __atomic_store_n(&SLAB_LIST, arena, __ATOMIC_RELEASE);
+        if (DEBUG) printf("[slab] mapped slab arena %p\n", (void *) arena);
+        return arena;
+}
+
+/*
+ *      Returns the arena that pointer lies in, or NULL if pointer does not
+ *      belong to any arena of the heap.
+ */
+struct superblock * find_arena(void * pointer)
+{
+        uintptr_t window = (uintptr_t) pointer & ~(ARENA_SIZE - 1);
+        int slot = (int) ((window >> ARENA_SHIFT) & (ARENA_TABLE_SIZE - 1));
+        uintptr_t entry;
+        while ((entry = __atomic_load_n(&ARENA_TABLE[slot].window, __ATOMIC_ACQUIRE)) != 0)
+        {
+                if (entry == window)
+                        return ARENA_TABLE[slot].arena;
+                slot = (slot + 1) & (ARENA_TABLE_SIZE - 1);
+        }
+        return NULL;
+}
+
+/*
+ *      Returns 1 if a request of size bytes is served by a mapping of its own:
+ *      when it is at least the mmap threshold, or too large for any arena.
+ */
+int mapped_size(size_t size)
+{
+        return size >= mymalloc_get_mmap_threshold() || size > MAX_BLOCK_SIZE;
+}
+
+/*
+ *      Adds start to MAPPED_TABLE, or removes it if remove is set. Removal
+ *      shifts back the entries that follow it in its probe run instead of
+ *      leaving a marker behind, so the table never fills up with them. The
+ *      table is kept at most half full. The caller must hold MAPPED_LOCK.
+ *
+ *      Returns 0, or -1 if the table is full or start is not in it.
+ */
+int mapped_table_update(uintptr_t start, int remove)
+{
+        int mask = MAPPED_TABLE_SIZE - 1;
+        int slot = (int) (start / SYSTEM_PAGE_SIZE) & mask;
+        if (!remove)
+        {
+                if (2 * (MAPPED_TABLE_USED + 1) > MAPPED_TABLE_SIZE)
+                        return -1;
+                while (MAPPED_TABLE[slot] != 0)
+                        slot = (slot + 1) & mask;
+                MAPPED_TABLE[slot] = start;
+                MAPPED_TABLE_USED++;
+                return 0;
+        }
+
+        while (MAPPED_TABLE[slot] != start)
+        {
+                if (MAPPED_TABLE[slot] == 0)
+                        return -1;
+                slot = (slot + 1) & mask;
+        }
+        int next = slot;
+        while (1)
+        {
+                MAPPED_TABLE[slot] = 0;
+                do
+                {
+                        next = (next + 1) & mask;
+                        if (MAPPED_TABLE[next] == 0)
+                        {
+                                MAPPED_TABLE_USED--;
+                                return 0;
+                        }
+                /* Entries whose home slot lies after the hole, up to next, stay where they are */
+                } while (((next - ((int) (MAPPED_TABLE[next] / SYSTEM_PAGE_SIZE) & mask)) & mask) < ((next - slot) & mask));
+                MAPPED_TABLE[slot] = MAPPED_TABLE[next];
+                slot = next;
+        }
+}
+
+/*
+ *      Maps a block of size bytes of data space aligned to alignment, a power
+ *      of two, on pages of its own. The data space starts MAPPED_HEADER_SIZE
+ *      bytes in, or alignment bytes in for larger alignments, up to a page.
+ *      Alignments beyond a page over-map by the difference and give back the
+ *      slack on both ends, as map_arena does.
+ *
+ *      Returns a pointer to the data space, or NULL if it could not be mapped
+ *      or MAPPED_TABLE is full.
+ */
+void * map_block(size_t size, size_t alignment)
+{
+        size_t offset = alignment < MAPPED_HEADER_SIZE ? MAPPED_HEADER_SIZE : alignment;
+        if (offset > SYSTEM_PAGE_SIZE)
+                offset = SYSTEM_PAGE_SIZE;
+        size_t length = (offset + size + SYSTEM_PAGE_SIZE - 1) & ~(size_t) (SYSTEM_PAGE_SIZE - 1);
+        size_t slack = alignment > SYSTEM_PAGE_SIZE ? alignment - SYSTEM_PAGE_SIZE : 0;
+        char * mapping = mmap(NULL, length + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+                return NULL;
+        char * start = (char *) ((((uintptr_t) mapping + offset + alignment - 1) & ~(uintptr_t) (alignment - 1)) - offset);
+        if (start > mapping)
+                munmap(mapping, start - mapping);
+        if (start + length < mapping + length + slack)
+                munmap(start + length, mapping + slack - start);
+
+        pthread_mutex_lock(&MAPPED_LOCK);
+        int full = mapped_table_update((uintptr_t) start, 0);
+        if (!full)
+        {
+                MAPPED_REQUESTED += size;
+                MAPPED_LENGTH += length;
+        }
+        pthread_mutex_unlock(&MAPPED_LOCK);
+        if (full)
+        {
+                munmap(start, length);
+                return NULL;
+        }
+
+        struct mapped_block * block = (struct mapped_block *) start;
+        block->length = length;
+        block->offset = offset;
+        block->size = size;
+        start[offset-HEADER_SIZE] = MAPPED;
+        if (DEBUG) printf("[malloc] mapped block %p of %ld bytes\n", (void *) (start + offset), length);
+        return start + offset;
+}
+
+/*
+ *      Returns the header of the mapped block whose data space starts at
+ *      pointer, or NULL if there is none. The header is only read once the
+ *      page it would sit on is found in MAPPED_TABLE, so any pointer at all
+ *      can be passed.
+ */
+struct mapped_block * find_mapped(void * pointer)
+{
+        uintptr_t start = ((uintptr_t) pointer - 1) & ~(uintptr_t) (SYSTEM_PAGE_SIZE - 1);
+        int slot = (int) (start / SYSTEM_PAGE_SIZE) & (MAPPED_TABLE_SIZE - 1);
+        int found = 0;
+        if (pointer == NULL)
+                return NULL;
+        pthread_mutex_lock(&MAPPED_LOCK);
+        for (; MAPPED_TABLE[slot] != 0 && !found; slot = (slot + 1) & (MAPPED_TABLE_SIZE - 1))
+                found = MAPPED_TABLE[slot] == start;
+        pthread_mutex_unlock(&MAPPED_LOCK);
+        struct mapped_block * block = (struct mapped_block *) start;
+        if (!found || (char *) start + block->offset != (char *) pointer)
+                return NULL;
+        return block;
+}
+
+/*
+ *      Unmaps the mapped block whose data space starts at pointer, giving its
+ *      memory straight back to the system.
+ *
+ *      Returns 1 if pointer was a mapped block, 0 otherwise.
+ */
+int unmap_block(void * pointer)
+{
+        struct mapped_block * block = find_mapped(pointer);
+        if (block == NULL)
+                return 0;
+        size_t length = block->length;
+        pthread_mutex_lock(&MAPPED_LOCK);
+        mapped_table_update((uintptr_t) block, 1);
+        MAPPED_REQUESTED -= block->size;
+        MAPPED_LENGTH -= length;
+        pthread_mutex_unlock(&MAPPED_LOCK);
+        munmap(block, length);
+        if (DEBUG) printf("[free] unmapped block %p of %ld bytes\n", pointer, length);
+        return 1;
+}
+
+/*
+ *      Resizes mapped block block to size bytes of data space with mremap,
+ *      which moves the pages rather than copying them if the mapping cannot
+ *      grow in place. A moved block keeps its offset, but an alignment beyond
+ *      a page is not kept. MAPPED_LOCK is held across the mremap, so no other
+ *      mapping can take the old pages before the table forgets them.
+ *
+ *      Returns a pointer to the data space, or NULL if it could not be resized.
+ */
+void * remap_block(struct mapped_block * block, size_t size)
+{
+        size_t length = (block->offset + size + SYSTEM_PAGE_SIZE - 1) & ~(size_t) (SYSTEM_PAGE_SIZE - 1);
+        pthread_mutex_lock(&MAPPED_LOCK);
+        struct mapped_block * moved = block;
+        if (length != block->length)
+                moved = (struct mapped_block *) mremap(block, block->length, length, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED)
+        {
+                pthread_mutex_unlock(&MAPPED_LOCK);
+                return NULL;
+        }
+        if (moved != block)
+        {
+                mapped_table_update((uintptr_t) block, 1);
+                mapped_table_update((uintptr_t) moved, 0);
+        }
+        MAPPED_REQUESTED += size - moved->size;
+        MAPPED_LENGTH += length - moved->length;
+        moved->size = size;
+        moved->length = length;
+        pthread_mutex_unlock(&MAPPED_LOCK);
+        return (char *) moved + moved->offset;
+}
+
+/*
+ *      Given a valid size, mymalloc will return a pointer to the beginning of a
+ *      mapping of its own for requests of at least the mmap threshold, of a
+ *      slot of a slab page for requests of up to 64 bytes, or else of a block
+ *      from the calling thread's cache or, when the cache has none, from the
+ *      first arena with enough contiguous memory, mapping a new arena when none
+ *      has. Safe to call from any number of threads.
+ *      Otherwise, mymalloc will return NULL and report an error.
+ */
+void * mymalloc(size_t size, char * file, int line)
+{
+        if (TRACING())
+                return traced_malloc(size, file, line);
+        /* Check if requested size is greater than 0 */
+        if (size == 0)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in malloc: Invalid size requested. FILE: %s\tLINE:%d\n", file, line);
+                return NULL;
+        }
+        if (size > MAX_MAPPED_SIZE)
+        {
+                REPORT_ERROR(MYMALLOC_ENOMEM, NULL, "[malloc] Error in malloc: Requested size is larger than the largest mapping. Requested: %lu. Maximum: %lu FILE: %s\tLINE: %d\n", size, MAX_MAPPED_SIZE, file, line);
+                return NULL;
+        }
+        /* Large requests get pages of their own, fresh from the system and so already zero */
+        if (mapped_size(size))
+        {
+                void * mapped = map_block(size, ALIGNMENT);
+                if (mapped != NULL)
+                {
+                        COUNT(allocs, 1);
+                        return mapped;
+                }
+                /* The size field of a data node can only describe blocks that fit in the largest arena */
+                if (size > MAX_BLOCK_SIZE)
+                {
+                        REPORT_ERROR(MYMALLOC_ENOMEM, NULL, "[malloc] Error in malloc: Could not map a block larger than the largest arena. Requested: %ld. FILE: %s\tLINE: %d\n", size, file, line);
+                        return NULL;
+                }
+        }
+        size_t requested = size;
+        void * pointer = NULL;
+        /* Tiny requests are packed into slab pages without any per-object metadata */
+        if (size <= SLAB_MAX_SIZE)
+                pointer = slab_allocate(size);
+
+        /* Keep every payload aligned and every block able to hold its free list links once it is freed */
+        size = align_size(size);
+
+        if (DEBUG) printf("[malloc] received valid size request of %ld bytes\n", size);
+
+        /* Small requests are served by the thread cache whenever it has a block of their bin */
+        if (pointer == NULL && size + METADATA_SIZE <= TCACHE_MAX_SIZE)
+        {
+                int bin = tcache_bin(size);
+                if (TCACHE.bins[bin] == NULL)
+                        tcache_refill(bin);
+                if (TCACHE.bins[bin] != NULL)
+                        pointer = tcache_pop(bin);
+        }
+
+        if (pointer == NULL)
+        {
+                pointer = heap_allocate(size);
+                if (pointer != NULL)
+                        COUNT(bytes_in_use, base64_to_dec(&((char *) pointer)[METADATA_FLAG_SIZE-HEADER_SIZE]));
+        }
+        if (pointer == NULL)
+        {
+                REPORT_ERROR(MYMALLOC_ENOMEM, NULL, "[malloc] Error in malloc: Could not map a new arena. Requested: %ld. FILE: %s\tLINE: %d\n", size, file, line);
+                return NULL;
+        }
+        COUNT(allocs, 1);
+        if (mymalloc_get_scrub() == SCRUB_ZERO_ON_ALLOC)
+                memset(pointer, '\0', requested);
+        return pointer;
+}
+
+/*
+ *      Allocates count objects of size bytes each, all set to zero. Under
+ *      SCRUB_ZERO_ON_FREE every block handed out is still zero from when it was
+ *      last freed, as long as the heap has never run in another mode, and
+ *      under SCRUB_ZERO_ON_ALLOC mymalloc zeroes it already, so only the other
+ *      modes zero the block again. Mapped blocks are fresh pages, which are
+ *      never zeroed again.
+ *
+ *      Returns a pointer to the data space, or NULL if count * size overflows
+ *      or no memory could be found.
+ */
+void * mycalloc(size_t count, size_t size, char * file, int line)
+{
+        if (TRACING())
+                return traced_calloc(count, size, file, line);
+        if (count != 0 && size > (size_t) -1 / count)
+        {
+                REPORT_ERROR(MYMALLOC_ENOMEM, NULL, "[calloc] Error in calloc: Requested size overflows. Count: %ld. Size: %ld FILE: %s\tLINE: %d\n", count, size, file, line);
+                return NULL;
+        }
+        int mode = mymalloc_get_scrub();
+        void * pointer = mymalloc(count * size, file, line);
+        /* Mapped blocks lie outside every arena and are always fresh pages */
+        if (pointer != NULL && mode != SCRUB_ZERO_ON_ALLOC && (mode != SCRUB_ZERO_ON_FREE || __atomic_load_n(&SCRUB_DIRTY, __ATOMIC_RELAXED))
+                && find_arena(pointer) != NULL)
+                memset(pointer, '\0', count * size);
+        return pointer;
+}
+
+/*
+ *      Scrubs size bytes of freed data space at pointer as the scrub mode asks:
+ *      zeroes them under SCRUB_ZERO_ON_FREE, fills them with SCRUB_POISON_BYTE
+ *      under SCRUB_POISON and leaves them as they are otherwise. memset stores
+ *      whole words or vectors at a time rather than single bytes.
+ */
+void scrub(char * pointer, size_t size)
+{
+        int mode = mymalloc_get_scrub();
+        if (mode == SCRUB_ZERO_ON_FREE)
+                memset(pointer, '\0', size);
+        else if (mode == SCRUB_POISON)
+                memset(pointer, SCRUB_POISON_BYTE, size);
+}
+
+/*
+ *      Selects what is done with data space on free and on allocation from now
+ *      on: SCRUB_NONE, SCRUB_ZERO_ON_FREE, SCRUB_ZERO_ON_ALLOC or SCRUB_POISON.
+ */
+void mymalloc_set_scrub(int mode)
+{
+        if (mode < 0 || mode >= NUM_SCRUB_MODES)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in mymalloc_set_scrub: Unknown scrub mode: %d\n", mode);
+                return;
+        }
+        if (mymalloc_get_scrub() != SCRUB_ZERO_ON_FREE && heap_initialized())
+                __atomic_store_n(&SCRUB_DIRTY, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&SCRUB_MODE, mode, __ATOMIC_RELAXED);
+}
+
+/*
+ *      Returns the scrub mode in effect. Until mymalloc_set_scrub is called it
+ *      is read from the MYMALLOC_SCRUB environment variable ("none", "free",
+ *      "alloc" or "poison"), defaulting to SCRUB_ZERO_ON_FREE.
+ */
+int mymalloc_get_scrub()
+{
+        int mode = __atomic_load_n(&SCRUB_MODE, __ATOMIC_RELAXED);
+        if (mode != -1)
+                return mode;
+
+        char * name = getenv("MYMALLOC_SCRUB");
+        if (name == NULL || strcmp(name, "free") == 0)
+                mode = SCRUB_ZERO_ON_FREE;
+        else if (strcmp(name, "none") == 0)
+                mode = SCRUB_NONE;
+        else if (strcmp(name, "alloc") == 0)
+                mode = SCRUB_ZERO_ON_ALLOC;
+        else if (strcmp(name, "poison") == 0)
+                mode = SCRUB_POISON;
+        else
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in MYMALLOC_SCRUB: Unknown scrub mode: %s. Zeroing on free.\n", name);
+                mode = SCRUB_ZERO_ON_FREE;
+        }
+        /* Keep a mode set by another thread in the meantime */
+        int unset = -1;
+        __atomic_compare_exchange_n(&SCRUB_MODE, &unset, mode, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return __atomic_load_n(&SCRUB_MODE, __ATOMIC_RELAXED);
+}
+
+/*
+ *      Serves requests of threshold bytes or more, from now on, with mappings
+ *      of their own instead of blocks of the arenas. Blocks already handed out
+ *      are freed the way they were allocated.
+ */
+void mymalloc_set_mmap_threshold(size_t threshold)
+{
+        if (threshold == 0)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in mymalloc_set_mmap_threshold: Threshold must be at least 1 byte\n");
+                return;
+        }
+        __atomic_store_n(&MMAP_THRESHOLD, threshold, __ATOMIC_RELAXED);
+}
+
+/*
+ *      Returns the mmap threshold in effect. Until mymalloc_set_mmap_threshold
+ *      is called it is read from the MYMALLOC_MMAP_THRESHOLD environment
+ *      variable, in bytes, defaulting to DEFAULT_MMAP_THRESHOLD.
+ */
+size_t mymalloc_get_mmap_threshold()
+{
+        size_t threshold = __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED);
+        if (threshold != 0)
+                return threshold;
+
+        char * value = getenv("MYMALLOC_MMAP_THRESHOLD");
+        char * end = NULL;
+        threshold = DEFAULT_MMAP_THRESHOLD;
+        if (value != NULL)
+        {
+                threshold = strtoul(value, &end, 10);
+                if (threshold == 0 || *end != '\0')
+                {
+                        REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in MYMALLOC_MMAP_THRESHOLD: Invalid threshold: %s. Using %ld.\n", value, DEFAULT_MMAP_THRESHOLD);
+                        threshold = DEFAULT_MMAP_THRESHOLD;
+                }
+        }
+        /* Keep a threshold set by another thread in the meantime */
+        size_t unset = 0;
+        __atomic_compare_exchange_n(&MMAP_THRESHOLD, &unset, threshold, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return __atomic_load_n(&MMAP_THRESHOLD, __ATOMIC_RELAXED);
+}
+
+/*
+ *      Records error as the calling thread's last error and passes it, along
+ *      with the pointer involved or NULL, to the error handler if one is set.
+ */
+void report_error(int error, void * pointer)
+{
+        LAST_ERROR = error;
+        COUNT(failures, 1);
+        mymalloc_error_handler handler = __atomic_load_n(&ERROR_HANDLER, __ATOMIC_ACQUIRE);
+        if (handler != NULL)
+                handler(error, pointer);
+}
+
+/*
+ *      Sets the function called with every error from now on, or none if
+ *      handler is NULL. The handler runs on the thread that ran into the error,
+ *      possibly with an arena's lock held, so it must not call back into
+ *      mymalloc.
+ */
+void mymalloc_set_error_handler(mymalloc_error_handler handler)
+{
+        __atomic_store_n(&ERROR_HANDLER, handler, __ATOMIC_RELEASE);
+}
+
+/*
+ *      Returns the last error the calling thread ran into, one of the
+ *      MYMALLOC_E codes, or MYMALLOC_OK if it has not run into any. Like errno,
+ *      it is not cleared by calls that succeed.
+ */
+int mymalloc_last_error()
+{
+        return LAST_ERROR;
+}
+
+/*
+ *      Returns a monotonic time in nanoseconds.
+ */
+double trace_time()
+{
+        struct timespec t_spec;
+        clock_gettime(CLOCK_MONOTONIC, &t_spec);
+        return t_spec.tv_sec * 1e9 + t_spec.tv_nsec;
+}
+
+/*
+ *      Writes the buffered records out to the trace file. The caller must hold
+ *      TRACE_LOCK.
+ */
+void trace_drain()
+{
+        size_t written = 0;
+        while (TRACE_FD != -1 && written < TRACE_USED)
+        {
+                ssize_t ret = write(TRACE_FD, &TRACE_BUFFER[written], TRACE_USED - written);
+                if (ret < 0 && errno == EINTR)
+                        continue;
+                if (ret <= 0)
+                        break;
+                written += ret;
+        }
+        TRACE_USED = 0;
+}
+
+/*
+ *      Appends size bytes at data to the trace, draining the buffer first if
+ *      they do not fit. The caller must hold TRACE_LOCK.
+ */
+void trace_write(void * data, size_t size)
+{
+        if (TRACE_USED + size > TRACE_BUFFER_SIZE)
+                trace_drain();
+        if (size > TRACE_BUFFER_SIZE)
+                size = TRACE_BUFFER_SIZE;
+        memcpy(&TRACE_BUFFER[TRACE_USED], data, size);
+        TRACE_USED += size;
+}
+
+/*
+ *      Returns the index of file in the trace, writing a TRACE_FILE record with
+ *      its name the first time it is seen. Files are told apart by the address
+ *      of their name, which __FILE__ keeps the same for every call from a file.
+ *      Returns 0 for NULL, or once TRACE_FILES is full. The caller must hold
+ *      TRACE_LOCK.
+ */
+int trace_file_index(char * file)
+{
+        if (file == NULL)
+                return 0;
+        int slot = ((uintptr_t) file >> 3) % TRACE_FILES_SIZE;
+        int probes = 0;
+        for (; probes < TRACE_FILES_SIZE; probes++, slot = (slot + 1) % TRACE_FILES_SIZE)
+        {
+                if (TRACE_FILES[slot] == file)
+                        return slot + 1;
+                if (TRACE_FILES[slot] == NULL)
+                        break;
+        }
+        if (probes == TRACE_FILES_SIZE)
+                return 0;
+        TRACE_FILES[slot] = file;
+        struct trace_record record = {0};
+        record.op = TRACE_FILE;
+        record.file = slot + 1;
+        record.size = strlen(file);
+        trace_write(&record, sizeof(record));
+        trace_write(file, record.size);
+        return slot + 1;
+}
+
+/*
+ *      Records a call of operation op made at line of file to the trace, with
+ *      the pointer it returned or freed as its handle.
+ */
+void trace_event(int op, void * handle, size_t argument, size_t size, char * file, int line)
+{
+        struct trace_record record;
+        record.time = 0;
+        record.handle = (uintptr_t) handle;
+        record.argument = argument;
+        record.size = size;
+        record.line = line;
+        record.op = op;
+        pthread_mutex_lock(&TRACE_LOCK);
+        if (TRACE_FD != -1)
+        {
+                if (TRACE_THREAD == 0)
+                        TRACE_THREAD = ++TRACE_THREADS;
+                record.thread = TRACE_THREAD;
+                record.file = trace_file_index(file);
+                record.time = trace_time() - TRACE_START;
+                trace_write(&record, sizeof(record));
+        }
+        pthread_mutex_unlock(&TRACE_LOCK);
+}
+
+/*
+ *      Writes out the records still buffered when the process exits.
+ */
+void trace_exit()
+{
+        pthread_mutex_lock(&TRACE_LOCK);
+        trace_drain();
+        pthread_mutex_unlock(&TRACE_LOCK);
+}
+
+/*
+ *      Starts recording every call to a new trace file at path, or stops
+ *      recording if path is NULL. A trace already being recorded is written out
+ *      and closed first. The caller must hold TRACE_LOCK.
+ */
+void trace_open(char * path)
+{
+        static int registered = 0;
+        /* Opening the file, registering trace_exit and reporting an error may allocate, which must not be traced */
+        TRACE_DEPTH++;
+        if (TRACE_FD != -1)
+        {
+                trace_drain();
+                close(TRACE_FD);
+                TRACE_FD = -1;
+        }
+        memset(TRACE_FILES, 0, sizeof(TRACE_FILES));
+        if (path != NULL)
+        {
+                TRACE_FD = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (TRACE_FD != -1 && !registered)
+                        registered = atexit(trace_exit) == 0;
+                if (TRACE_FD == -1)
+                        REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in trace: Could not open %s\n", path);
+        }
+        if (TRACE_FD != -1)
+        {
+                struct trace_header header = {TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_record)};
+                TRACE_START = trace_time();
+                trace_write(&header, sizeof(header));
+        }
+        __atomic_store_n(&TRACE_STATE, TRACE_FD != -1, __ATOMIC_RELAXED);
+        TRACE_DEPTH--;
+}
+
+/*
+ *      Records every call made from now on to a trace file at path, replacing
+ *      it, or stops recording if path is NULL.
+ */
+void mymalloc_set_trace(char * path)
+{
+        pthread_mutex_lock(&TRACE_LOCK);
+        trace_open(path);
+        pthread_mutex_unlock(&TRACE_LOCK);
+}
+
+/*
+ *      Returns 1 if calls are being recorded to a trace file, 0 otherwise. Until
+ *      mymalloc_set_trace is called, the trace is recorded to the file named by
+ *      the MYMALLOC_TRACE environment variable, if it is set.
+ */
+int mymalloc_get_trace()
+{
+        int state = __atomic_load_n(&TRACE_STATE, __ATOMIC_RELAXED);
+        if (state != -1)
+                return state;
+
+        pthread_mutex_lock(&TRACE_LOCK);
+        /* Keep a trace set by another thread in the meantime */
+        if (__atomic_load_n(&TRACE_STATE, __ATOMIC_RELAXED) == -1)
+                trace_open(getenv("MYMALLOC_TRACE"));
+        pthread_mutex_unlock(&TRACE_LOCK);
+        return __atomic_load_n(&TRACE_STATE, __ATOMIC_RELAXED);
+}
+
+/*
+ *      Records mymalloc(size) and the pointer it returned.
+ */
+void * traced_malloc(size_t size, char * file, int line)
+{
+        TRACE_DEPTH++;
+        void * pointer = mymalloc(size, file, line);
+        TRACE_DEPTH--;
+        trace_event(TRACE_MALLOC, pointer, 0, size, file, line);
+        return pointer;
+}
+
+/*
+ *      Records mycalloc(count, size) and the pointer it returned.
+ */
+void * traced_calloc(size_t count, size_t size, char * file, int line)
+{
+        TRACE_DEPTH++;
+        void * pointer = mycalloc(count, size, file, line);
+        TRACE_DEPTH--;
+        trace_event(TRACE_CALLOC, pointer, count, size, file, line);
+        return pointer;
+}
+
+/*
+ *      Records myrealloc(pointer, size) and the pointer it returned.
+ */
+void * traced_realloc(void * pointer, size_t size, char * file, int line)
+{
+        TRACE_DEPTH++;
+        void * resized = myrealloc(pointer, size, file, line);
+        TRACE_DEPTH--;
+        trace_event(TRACE_REALLOC, resized, (uintptr_t) pointer, size, file, line);
+        return resized;
+}
+
+/*
+ *      Records myaligned_alloc(alignment, size) and the pointer it returned.
+ */
+void * traced_aligned_alloc(size_t alignment, size_t size, char * file, int line)
+{
+        TRACE_DEPTH++;
+        void * pointer = myaligned_alloc(alignment, size, file, line);
+        TRACE_DEPTH--;
+        trace_event(TRACE_ALIGNED_ALLOC, pointer, alignment, size, file, line);
+        return pointer;
+}
+
+/*
+ *      Records each block mymalloc_batch allocates as a mymalloc of its own.
+ */
+size_t traced_malloc_batch(size_t count, size_t size, void ** pointers, char * file, int line)
+{
+        TRACE_DEPTH++;
+        size_t allocated = mymalloc_batch(count, size, pointers, file, line);
+        TRACE_DEPTH--;
+        size_t i = 0;
+        for (; i < allocated; i++)
+                trace_event(TRACE_MALLOC, pointers[i], 0, size, file, line);
+        return allocated;
+}
+
+/*
+ *      Records the myfree of pointer before freeing it, so that no other thread
+ *      can record the block being handed out again before it is freed.
+ */
+void traced_free(void * pointer, char * file, int line)
+{
+        trace_event(TRACE_FREE, pointer, 0, 0, file, line);
+        TRACE_DEPTH++;
+        myfree(pointer, file, line);
+        TRACE_DEPTH--;
+}
+
+/*
+ *      Records each pointer of a myfree_batch as a myfree of its own, before
+ *      freeing them.
+ */
+void traced_free_batch(void ** pointers, size_t count, char * file, int line)
+{
+        size_t i = 0;
+        for (; i < count; i++)
+                trace_event(TRACE_FREE, pointers[i], 0, 0, file, line);
+        TRACE_DEPTH++;
+        myfree_batch(pointers, count, file, line);
+        TRACE_DEPTH--;
+}
+
+/*
+ *      Records the myfree_sized of pointer before freeing it.
+ */
+void traced_free_sized(void * pointer, size_t size, char * file, int line)
+{
+        trace_event(TRACE_FREE_SIZED, pointer, 0, size, file, line);
+        TRACE_DEPTH++;
+        myfree_sized(pointer, size, file, line);
+        TRACE_DEPTH--;
+}
+
+/*
+ *      Rounds a request of size bytes up to the data space of a block that can
+ *      hold its free list links once it is freed and whose data node, metadata
+ *      included, spans a whole number of ALIGNMENT bytes. As long as every data
+ *      node but the last one of an arena spans a multiple of ALIGNMENT, every
+ *      payload starts on an ALIGNMENT boundary like the first one.
+ */
+size_t align_size(size_t size)
+{
+        if (size < MIN_BLOCK_SIZE)
+                size = MIN_BLOCK_SIZE;
+        return ((size + METADATA_SIZE + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1)) - METADATA_SIZE;
+}
+
+/*
+ *      Returns the thread cache bin of blocks with size bytes of data space.
+ *      Every block of a bin has at least tcache_bin_size(bin) bytes.
+ */
+int tcache_bin(size_t size)
+{
+        return (int) ((size + METADATA_SIZE) / GRANULE) - 2;
+}
+
+/*
+ *      Returns the data space requests served from cache bin are rounded up to.
+ */
+size_t tcache_bin_size(int bin)
+{
+        return (bin + 2) * GRANULE - METADATA_SIZE;
+}
+
+/*
+ *      Takes the free block at block_index off its free list, splits off any
+ *      remainder large enough to form a new data node and marks the block as
+ *      IN_USE.
+ *
+ *      Returns a pointer to the data space of the block.
+ */
+void * allocate_block(struct superblock * arena, int block_index, size_t size)
+{
+        char * heap = HEAP(arena);
+        int block_size = get_block_size(arena, block_index);
+
+        /* The block is about to be handed out, take it off its free list */
+        free_list_remove(arena, block_index);
+        heap[block_index] = IN_USE;
+
+        /* Keep track of remainder bytes */
+        int remainder_bytes = block_size - size;
+
+        /* create a new data node on the remainder bytes if there's enough space */
+        if (remainder_bytes >= METADATA_SIZE + MIN_BLOCK_SIZE)
+        {
+                if (DEBUG) printf("[malloc] creating new data node at index %ld, with size %d end\n", block_index+METADATA_SIZE+size, remainder_bytes-METADATA_SIZE);
+                set_block_size(arena, block_index, size);
+                create_data_node(arena, block_index + METADATA_SIZE + size, remainder_bytes - METADATA_SIZE);
+                update_available_space(arena, size + METADATA_SIZE);
+        }
+        else
+        {
+                /* if enough space wasn't available to allocate a new block, mark the entire block as used space */
+                if (DEBUG) printf("Adding extra space to prev block\n");
+                update_available_space(arena, block_size);
+        }
+
+        if (DEBUG) printf("[malloc] returning pointer to index %d, pointer: %p end\n", block_index+HEADER_SIZE, &heap[block_index+HEADER_SIZE]);
+        return &heap[block_index + HEADER_SIZE];
+}
+
+/*
+ *      Carves up to count blocks of size bytes of data space, one right after
+ *      the other, from the front of the free block at block_index and splits
+ *      off what is left as a new data node if it is large enough to form one.
+ *      The superblock's available space is updated once for the whole run. The
+ *      caller must hold the arena's lock.
+ *
+ *      Returns the number of blocks carved, stored in pointers.
+ */
+int carve_blocks(struct superblock * arena, int block_index, size_t size, int count, void ** pointers)
+{
+        char * heap = HEAP(arena);
+        int block_size = get_block_size(arena, block_index);
+        int span = size + METADATA_SIZE;
+        int carved = (block_size + METADATA_SIZE) / span;
+        if (carved > count)
+                carved = count;
+        int leftover = block_size + METADATA_SIZE - carved * span;
+        /* Too little left to form a data node stays with the last block */
+        int split = leftover >= METADATA_SIZE + MIN_BLOCK_SIZE;
+
+        free_list_remove(arena, block_index);
+        int i = 0;
+        for (; i < carved; i++)
+        {
+                int index = block_index + i * span;
+                heap[index] = IN_USE;
+                set_block_size(arena, index, i == carved - 1 && !split ? size + leftover : size);
+                pointers[i] = &heap[index+HEADER_SIZE];
+        }
+        if (split)
+        {
+                create_data_node(arena, block_index + carved * span, leftover - METADATA_SIZE);
+                update_available_space(arena, block_size - leftover + METADATA_SIZE);
+                COUNT(bytes_in_use, carved * size);
+        }
+        else
+        {
+                update_available_space(arena, block_size);
+                COUNT(bytes_in_use, carved * size + leftover);
+        }
+        return carved;
+}
+
+/*
+ *      Allocates count blocks of size bytes and stores pointers to them in
+ *      pointers. Tiny requests come from slab pages as in mymalloc. Larger ones
+ *      are carved one after the other from a single free block of the calling
+ *      thread's home arena, found with one search under one acquisition of its
+ *      lock. When no block can hold the whole batch, each search asks for as
+ *      many blocks as the largest free block holds, and whatever the home arena
+ *      cannot hold is left to mymalloc. Under SCRUB_ZERO_ON_ALLOC every block
+ *      is zeroed like a block from mymalloc.
+ *
+ *      Returns the number of blocks allocated. Pointers past them are NULL.
+ */
+size_t mymalloc_batch(size_t count, size_t size, void ** pointers, char * file, int line)
+{
+        if (TRACING())
+                return traced_malloc_batch(count, size, pointers, file, line);
+        if (size == 0)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in malloc_batch: Invalid size requested. FILE: %s\tLINE:%d\n", file, line);
+                return 0;
+        }
+        if (size > MAX_MAPPED_SIZE)
+        {
+                REPORT_ERROR(MYMALLOC_ENOMEM, NULL, "[malloc] Error in malloc_batch: Requested size is larger than the largest mapping. Requested: %lu. Maximum: %lu FILE: %s\tLINE: %d\n", size, MAX_MAPPED_SIZE, file, line);
+                return 0;
+        }
+        size_t allocated = 0;
+        if (size <= SLAB_MAX_SIZE)
+        {
+                for (; allocated < count; allocated++)
+                {
+                        pointers[allocated] = slab_allocate(size);
+                        if (pointers[allocated] == NULL)
+                                break;
+                }
+        }
+
+        size_t block_size = align_size(size);
+        size_t span = block_size + METADATA_SIZE;
+        /* Blocks to be mapped are left to mymalloc, one mapping each */
+        struct superblock * home = allocated < count && !mapped_size(size) ? home_arena() : NULL;
+        if (home != NULL)
+        {
+                pthread_mutex_lock(&home->lock);
+                drain_remote_frees(home);
+                while (allocated < count)
+                {
+                        /* Ask for room for the whole rest of the batch, or as much of it as the largest free block holds */
+                        size_t largest = largest_free_block(home);
+                        if (largest < block_size)
+                                break;
+                        size_t wanted = count - allocated;
+                        if (wanted > (largest + METADATA_SIZE) / span)
+                                wanted = (largest + METADATA_SIZE) / span;
+                        int block_index = fetch_optimal_location(home, wanted * span - METADATA_SIZE);
+                        if (block_index == -1)
+                                break;
+                        allocated += carve_blocks(home, block_index, block_size, wanted, &pointers[allocated]);
+                }
+                pthread_mutex_unlock(&home->lock);
+        }
+        if (DEBUG) printf("[malloc] carved %ld of %ld blocks of %ld bytes in the home arena\n", allocated, count, size);
+        COUNT(allocs, allocated);
+        /* The blocks mymalloc hands out below are zeroed by mymalloc itself */
+        if (mymalloc_get_scrub() == SCRUB_ZERO_ON_ALLOC)
+        {
+                size_t i = 0;
+                for (; i < allocated; i++)
+                        memset(pointers[i], '\0', size);
+        }
+
+        for (; allocated < count; allocated++)
+        {
+                pointers[allocated] = mymalloc(size, file, line);
+                if (pointers[allocated] == NULL)
+                        break;
+        }
+        size_t i = allocated;
+        for (; i < count; i++)
+                pointers[i] = NULL;
+        return allocated;
+}
+
+/*
+ *      Frees count blocks, checking each one like myfree. Blocks of the calling
+ *      thread's arenas that lie one right after the other, as mymalloc_batch
+ *      hands them out, are zeroed and joined into a single extent under one
+ *      acquisition of the arena's lock, then released with one coalesce and
+ *      one free list insert. Any other pointer is passed to myfree.
+ */
+void myfree_batch(void ** pointers, size_t count, char * file, int line)
+{
+        if (TRACING())
+        {
+                traced_free_batch(pointers, count, file, line);
+                return;
+        }
+        struct superblock * locked = NULL;
+        int start = -1;
+        int extent = 0;
+        size_t joined = 0;
+        size_t i = 0;
+        for (; i <= count; i++)
+        {
+                char * heap_pointer = i < count ? (char *) pointers[i] : NULL;
+                struct superblock * arena = heap_pointer != NULL ? find_arena(heap_pointer) : NULL;
+
+                /* A block right behind the pending extent joins it, metadata and all */
+                if (start != -1 && arena == locked && heap_pointer == &HEAP(arena)[start+METADATA_SIZE+extent+HEADER_SIZE]
+                        && heap_pointer[-HEADER_SIZE] == IN_USE && valid_block(arena, heap_pointer))
+                {
+                        int block_size = base64_to_dec(&heap_pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+                        memset(heap_pointer - METADATA_SIZE, '\0', METADATA_SIZE);
+                        scrub(heap_pointer, block_size);
+                        UNCOUNT(bytes_in_use, block_size);
+                        extent += METADATA_SIZE + block_size;
+                        joined++;
+                        continue;
+                }
+                if (start != -1)
+                {
+                        set_block_size(locked, start, extent);
+                        release_block(locked, &HEAP(locked)[start+HEADER_SIZE]);
+                        start = -1;
+                }
+                if (locked != NULL && locked != arena)
+                {
+                        pthread_mutex_unlock(&locked->lock);
+                        locked = NULL;
+                }
+                if (i == count)
+                        break;
+
+                /* Start a new extent at a valid block of an arena the calling thread may lock */
+                if (arena != NULL && !arena->slab && heap_pointer >= &HEAP(arena)[FIRST_NODE_INDEX+HEADER_SIZE]
+                        && heap_pointer[-HEADER_SIZE] == IN_USE && valid_block(arena, heap_pointer)
+                        && (arena == TCACHE.home || __atomic_load_n(&arena->threads, __ATOMIC_RELAXED) == 0))
+                {
+                        if (locked == NULL)
+                        {
+                                pthread_mutex_lock(&arena->lock);
+                                locked = arena;
+                        }
+                        start = heap_pointer - HEAP(arena) - HEADER_SIZE;
+                        extent = base64_to_dec(&heap_pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+                        scrub(heap_pointer, extent);
+                        UNCOUNT(bytes_in_use, extent);
+                        joined++;
+                }
+                /* Slab slots, blocks of other threads' arenas and invalid pointers take the usual path */
+                else
+                {
+                        if (locked != NULL)
+                        {
+                                pthread_mutex_unlock(&locked->lock);
+                                locked = NULL;
+                        }
+                        myfree(heap_pointer, file, line);
+                }
+        }
+        COUNT(frees, joined);
+        if (DEBUG) printf("[free] freed a batch of %ld blocks\n", count);
+}
+
+/*
+ *      Cuts the IN_USE block at index in arena down to size bytes of data space
+ *      and frees the rest as a new data node, merged with a free block that
+ *      follows it. The rest must be large enough to form a data node. The
+ *      caller must hold the arena's lock.
+ */
+void split_block(struct superblock * arena, int index, size_t size)
+{
+        char * heap = HEAP(arena);
+        int remainder_bytes = get_block_size(arena, index) - size;
+        int tail = index + METADATA_SIZE + size;
+
+        set_block_size(arena, index, size);
+        heap[tail] = IN_USE;
+        set_block_size(arena, tail, remainder_bytes - METADATA_SIZE);
+        release_block(arena, &heap[tail+HEADER_SIZE]);
+}
+
+/*
+ *      Grows the IN_USE block at index in arena to at least size bytes of data
+ *      space by absorbing the free block that follows it, splitting off what is
+ *      not needed. Free blocks are always fully coalesced, so there is never
+ *      more than one free block to absorb. The caller must hold the arena's
+ *      lock.
+ *
+ *      Returns 1 if the block was grown, 0 if the following block is not free
+ *      or too small.
+ */
+int grow_block(struct superblock * arena, int index, size_t size)
+{
+        char * heap = HEAP(arena);
+        int block_size = get_block_size(arena, index);
+        int next = index + METADATA_SIZE + block_size;
+        if ((size_t) next >= arena->size || __atomic_load_n(&heap[next], __ATOMIC_RELAXED) != NOT_IN_USE)
+                return 0;
+        int next_size = get_block_size(arena, next);
+        size_t merged_size = block_size + METADATA_SIZE + next_size;
+        if (merged_size < size)
+                return 0;
+
+        /* The whole following block, metadata included, becomes data space */
+        free_list_remove(arena, next);
+        update_available_space(arena, next_size);
+        memset(&heap[next-FOOTER_SIZE], '\0', METADATA_SIZE);
+        set_block_size(arena, index, merged_size);
+        if (arena->trim_cursor == next)
+                arena->trim_cursor = index;
+
+        if (merged_size - size >= METADATA_SIZE + MIN_BLOCK_SIZE)
+                split_block(arena, index, size);
+        return 1;
+}
+
+/*
+ *      Given a valid pointer from mymalloc, myrealloc will resize its block to
+ *      size bytes, keeping its contents up to the smaller of the two sizes. It
+ *      shrinks the block in place, splitting off the tail when it is large
+ *      enough to form a data node, or grows it in place into a free block that
+ *      follows it, and only moves it to a new block when neither is possible.
+ *      Slab slots stay in place while the new size fits in the slot, and
+ *      mapped blocks that stay at or above the mmap threshold are remapped.
+ *      A NULL pointer is passed to mymalloc and a size of 0 to myfree.
+ *
+ *      Returns a pointer to the resized block, or NULL, leaving the block as it
+ *      was, if no memory could be found.
+ */
+void * myrealloc(void * pointer, size_t size, char * file, int line)
+{
+        if (TRACING())
+                return traced_realloc(pointer, size, file, line);
+        if (pointer == NULL)
+                return mymalloc(size, file, line);
+        if (size == 0)
+        {
+                myfree(pointer, file, line);
+                return NULL;
+        }
+        if (size > MAX_MAPPED_SIZE)
+        {
+                REPORT_ERROR(MYMALLOC_ENOMEM, pointer, "[realloc] Error in realloc: Requested size is larger than the largest mapping. Requested: %lu. Maximum: %lu FILE: %s\tLINE: %d\n", size, MAX_MAPPED_SIZE, file, line);
+                return NULL;
+        }
+        char * heap_pointer = (char *) pointer;
+        struct superblock * arena = find_arena(pointer);
+        struct mapped_block * block = arena == NULL ? find_mapped(pointer) : NULL;
+        if (block == NULL && (arena == NULL || heap_pointer < &HEAP(arena)[FIRST_NODE_INDEX+HEADER_SIZE]))
+        {
+                REPORT_ERROR(MYMALLOC_EPOINTER, pointer, "[realloc] Error in realloc: Invalid pointer passed. Outside of heap?: %d FILE: %s\tLINE: %d\n", (int)(arena == NULL), file, line);
+                return NULL;
+        }
+
+        size_t old_size;
+        if (block != NULL)
+        {
+                /* A block that stays large is remapped, without copying its pages */
+                old_size = block->length - block->offset;
+                if (mapped_size(size))
+                {
+                        void * resized = remap_block(block, size);
+                        if (resized != NULL)
+                                return resized;
+                }
+        }
+        else if (arena->slab)
+        {
+                struct slab_page * page = (struct slab_page *) ((uintptr_t) pointer & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+                old_size = page->object_size;
+                if (size <= old_size)
+                        return pointer;
+        }
+        else
+        {
+                if (heap_pointer[-HEADER_SIZE] != IN_USE)
+                {
+                        REPORT_ERROR(MYMALLOC_ENOTINUSE, pointer, "[realloc] Error in realloc: Found: %c. Expected: Y. Pointer: %p FILE: %s\tLINE: %d\n", heap_pointer[-HEADER_SIZE], pointer, file, line);
+                        return NULL;
+                }
+                if (!valid_block(arena, heap_pointer))
+                {
+                        REPORT_ERROR(MYMALLOC_EPOINTER, pointer, "[realloc] Error in realloc: Not the start of a data node. Pointer: %p FILE: %s\tLINE: %d\n", pointer, file, line);
+                        return NULL;
+                }
+                old_size = base64_to_dec(&heap_pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+                int index = heap_pointer - HEAP(arena) - HEADER_SIZE;
+                size_t new_size = align_size(size);
+                int resized = 0;
+
+                pthread_mutex_lock(&arena->lock);
+                if (new_size <= old_size)
+                {
+                        /* Shrink, giving back the tail if it can form a data node of its own */
+                        scrub(&heap_pointer[size], old_size - size);
+                        if (old_size - new_size >= METADATA_SIZE + MIN_BLOCK_SIZE)
+                                split_block(arena, index, new_size);
+                        resized = 1;
+                }
+                /* A block growing past the mmap threshold moves to a mapping rather than taking more of the arena */
+                else if (!mapped_size(size))
+                        resized = grow_block(arena, index, new_size);
+                if (resized)
+                        COUNT(bytes_in_use, get_block_size(arena, index) - old_size);
+                pthread_mutex_unlock(&arena->lock);
+
+                if (resized)
+                {
+                        if (DEBUG) printf("[realloc] resized %p in place to %ld bytes\n", pointer, size);
+                        return pointer;
+                }
+        }
+
+        /* Neither fits in place, move the contents to a new block */
+        void * moved = mymalloc(size, file, line);
+        if (moved == NULL)
+                return NULL;
+        memcpy(moved, pointer, old_size < size ? old_size : size);
+        myfree(pointer, file, line);
+        if (DEBUG) printf("[realloc] moved %p to %p\n", pointer, moved);
+        return moved;
+}
+
+/*
+ *      Allocates size bytes whose address is a multiple of alignment, which must
+ *      be a power of two. Alignments up to ALIGNMENT are met by every block, so
+ *      they are passed to mymalloc. Larger ones take a block with room for the
+ *      payload at any offset and give back both ends: the padding in front of
+ *      the aligned payload becomes a data node of its own, which is why the
+ *      payload is moved on until the padding can hold one, and the tail is
+ *      split off as usual. Requests that large would be mapped are mapped at
+ *      the alignment instead.
+ *
+ *      Returns a pointer to the aligned data space, or NULL if the alignment is
+ *      invalid or no memory could be found.
+ */
+void * myaligned_alloc(size_t alignment, size_t size, char * file, int line)
+{
+        if (TRACING())
+                return traced_aligned_alloc(alignment, size, file, line);
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[aligned_alloc] Error in aligned_alloc: Alignment is not a power of two. Alignment: %ld FILE: %s\tLINE: %d\n", alignment, file, line);
+                return NULL;
+        }
+        if (alignment <= ALIGNMENT || size < 1)
+                return mymalloc(size, file, line);
+        if (size > MAX_MAPPED_SIZE || alignment > MAX_MAPPED_SIZE - size)
+        {
+                REPORT_ERROR(MYMALLOC_ENOMEM, NULL, "[aligned_alloc] Error in aligned_alloc: Requested size is larger than the largest mapping. Requested: %lu. Alignment: %lu FILE: %s\tLINE: %d\n", size, alignment, file, line);
+                return NULL;
+        }
+
+        /* Room for the payload behind padding of up to alignment plus a whole data node, never from a slab */
+        size = align_size(size);
+        size_t request = size + alignment + METADATA_SIZE + MIN_BLOCK_SIZE;
+        if (request <= SLAB_MAX_SIZE)
+                request = SLAB_MAX_SIZE + 1;
+        /* A request that would be mapped anyway is mapped at the alignment, with no padding to give back */
+        if (mapped_size(request))
+        {
+                void * mapped = map_block(size, alignment);
+                if (mapped == NULL)
+                {
+                        REPORT_ERROR(MYMALLOC_ENOMEM, NULL, "[aligned_alloc] Error in aligned_alloc: Could not map a block. Requested: %ld. Alignment: %ld FILE: %s\tLINE: %d\n", size, alignment, file, line);
+                        return NULL;
+                }
+                COUNT(allocs, 1);
+                return mapped;
+        }
+        char * pointer = (char *) mymalloc(request, file, line);
+        if (pointer == NULL)
+                return NULL;
+
+        char * aligned = (char *) (((uintptr_t) pointer + alignment - 1) & ~(uintptr_t) (alignment - 1));
+        if (aligned != pointer && aligned - pointer < METADATA_SIZE + MIN_BLOCK_SIZE)
+                aligned += alignment;
+
+        struct superblock * arena = find_arena(pointer);
+        char * heap = HEAP(arena);
+        int index = pointer - heap - HEADER_SIZE;
+        int lead = aligned - pointer;
+        int block_size = get_block_size(arena, index);
+
+        pthread_mutex_lock(&arena->lock);
+        /* The payload keeps the back of the block, the padding in front becomes a free data node */
+        if (lead > 0)
+        {
+                heap[index+lead] = IN_USE;
+                set_block_size(arena, index + lead, block_size - lead);
+                set_block_size(arena, index, lead - METADATA_SIZE);
+                release_block(arena, pointer);
+        }
+        if (block_size - lead - size >= METADATA_SIZE + MIN_BLOCK_SIZE)
+                split_block(arena, index + lead, size);
+        pthread_mutex_unlock(&arena->lock);
+        /* Only the aligned payload stays in use */
+        UNCOUNT(bytes_in_use, block_size - get_block_size(arena, index + lead));
+
+        if (DEBUG) printf("[aligned_alloc] moved %p to %p for an alignment of %ld bytes\n", pointer, aligned, alignment);
+        return aligned;
+}
+
+/*
+ *      Stores in *pointer the address of size bytes aligned to alignment, which
+ *      must be a power of two and a multiple of sizeof(void *). A size of 0
+ *      stores NULL.
+ *
+ *      Returns 0 on success, EINVAL for an invalid alignment or ENOMEM if no
+ *      memory could be found, leaving *pointer unchanged on failure.
+ */
+int myposix_memalign(void ** pointer, size_t alignment, size_t size, char * file, int line)
+{
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[posix_memalign] Error in posix_memalign: Alignment is not a power of two multiple of %ld. Alignment: %ld FILE: %s\tLINE: %d\n", sizeof(void *), alignment, file, line);
+                return EINVAL;
+        }
+        if (size == 0)
+        {
+                *pointer = NULL;
+                return 0;
+        }
+        void * aligned = myaligned_alloc(alignment, size, file, line);
+        if (aligned == NULL)
+                return ENOMEM;
+        *pointer = aligned;
+        return 0;
+}
+
+/*
+ *      Combines contiguous free blocks in every arena and updates superblock
+ *      metadata to reclaim space taken up by block metadata. myfree already
+ *      coalesces on every call, so this full sweep is only needed to recover or
+ *      verify the heap while debugging. It is one pass of trim_heap, so other
+ *      threads never wait on more than TRIM_STEP blocks of it.
+ */
+void clean()
+{
+        COUNT(cleans, 1);
+        trim_heap(0, 0);
+}
+
+/*
+ *      Hands the whole pages inside the data space of the free block at index
+ *      back to the system, leaving its header and the links at its end alone.
+ *      Released pages read as zero when next touched, which is what every scrub
+ *      mode but SCRUB_POISON leaves in free space, so nothing is released
+ *      under it. The pages are looked at TRIM_CHUNK_PAGES at a time with
+ *      mincore, and only chunks with resident pages are released, so pages
+ *      released before and not touched since cost no madvise and are not
+ *      counted again.
+ *
+ *      Returns the number of resident bytes released.
+ */
+size_t release_pages(struct superblock * arena, int index)
+{
+        uintptr_t start = ((uintptr_t) &HEAP(arena)[index+HEADER_SIZE] + SYSTEM_PAGE_SIZE - 1) & ~(uintptr_t) (SYSTEM_PAGE_SIZE - 1);
+        uintptr_t end = (uintptr_t) &HEAP(arena)[tree_index(arena, index)] & ~(uintptr_t) (SYSTEM_PAGE_SIZE - 1);
+        size_t released = 0;
+        if (mymalloc_get_scrub() == SCRUB_POISON)
+                return 0;
+        for (; start < end; start += TRIM_CHUNK_PAGES * SYSTEM_PAGE_SIZE)
+        {
+                unsigned char pages[TRIM_CHUNK_PAGES];
+                size_t length = end - start < TRIM_CHUNK_PAGES * SYSTEM_PAGE_SIZE ? end - start : TRIM_CHUNK_PAGES * SYSTEM_PAGE_SIZE;
+                if (mincore((void *) start, length, pages) != 0)
+                        return released;
+                size_t resident = 0, i = 0;
+                for (; i < length / SYSTEM_PAGE_SIZE; i++)
+                        resident += pages[i] & 1;
+                if (resident > 0 && madvise((void *) start, length, MADV_DONTNEED) == 0)
+                        released += resident * SYSTEM_PAGE_SIZE;
+        }
+        return released;
+}
+
+/*
+ *      Walks at most *budget blocks of arena from its trim cursor, merging any
+ *      free blocks that sit next to each other and, if release is set, handing
+ *      the pages inside every free block back to the system and adding their
+ *      bytes to released. Takes the blocks walked off *budget and leaves the
+ *      cursor at the first block not walked. coalesce and grow_block move the
+ *      cursor back when they merge away the block it points to, so it stays on
+ *      a block between walks. The caller must hold the arena's lock.
+ *
+ *      Returns 1 if the walk reached the end of the arena, rewinding the cursor
+ *      to its first block, 0 if the budget ran out first.
+ */
+int trim_arena(struct superblock * arena, int * budget, int release, size_t * released)
+{
+        char * heap = HEAP(arena);
+        size_t end = arena->size - METADATA_SIZE;
+        int ptr = arena->trim_cursor;
+        for (; *budget > 0 && (size_t) ptr < end; (*budget)--)
+        {
+                int next = ptr + get_block_size(arena, ptr) + METADATA_SIZE;
+                if (__atomic_load_n(&heap[ptr], __ATOMIC_RELAXED) != NOT_IN_USE)
+                {
+                        ptr = next;
+                        continue;
+                }
+                /* Walk the merged block again, in case more free blocks follow it */
+                if ((size_t) next < end && __atomic_load_n(&heap[next], __ATOMIC_RELAXED) == NOT_IN_USE)
+                {
+                        free_list_remove(arena, ptr);
+                        ptr = coalesce(arena, ptr);
+                        free_list_insert(arena, ptr);
+                        continue;
+                }
+                if (release)
+                        *released += release_pages(arena, ptr);
+                ptr = next;
+        }
+        if ((size_t) ptr < end)
+        {
+                arena->trim_cursor = ptr;
+                return 0;
+        }
+        arena->trim_cursor = FIRST_NODE_INDEX;
+        return 1;
+}
 
 /*
- *      Converts x from an integer to a psuedo-base 64 character stored at
- *      HEAP[address] and HEAP[address+1]. The two byte representation can store
- *      values 0-4095.
+ *      Runs trim_arena over the arenas of the heap, resuming where the last
+ *      walk stopped, until budget blocks have been walked or the last arena
+ *      has been walked to its end. A budget of 0 walks the whole heap once from
+ *      the first arena. Each arena's lock is taken for at most TRIM_STEP blocks
+ *      at a time, along with draining its remote frees, so no allocation waits
+ *      on more than one step.
+ *
+ *      Returns the bytes handed back to the system.
  */
-void dec_to_base64(int x, int address)
+size_t trim_heap(int budget, int release)
 {
-        int y;
-        int i = 0;
-
-        /* before writing the HEX value to the address, zero out the values stored in the bytes first. */
-        HEAP[address++] = '\0';
-        HEAP[address] = '\0';
-
-        while (x != 0 && i < 2)
+        size_t released = 0;
+        pthread_mutex_lock(&TRIM_LOCK);
+        if (budget == 0)
         {
-                y = x % 64;
-                HEAP[address--] = (char) y;
-                x /= 64;
-                i++;
+                TRIM_ARENA = NULL;
+                budget = INT_MAX;
+        }
+        struct superblock * arena = TRIM_ARENA;
+        int resume = arena != NULL;
+        if (arena == NULL)
+                arena = __atomic_load_n(&ARENA_LIST, __ATOMIC_ACQUIRE);
+        while (arena != NULL && budget > 0)
+        {
+                int step = budget < TRIM_STEP ? budget : TRIM_STEP;
+                budget -= step;
+                pthread_mutex_lock(&arena->lock);
+                /* Only the arena the last walk stopped in is resumed mid-way */
+                if (!resume)
+                        arena->trim_cursor = FIRST_NODE_INDEX;
+                resume = 1;
+                drain_remote_frees(arena);
+                int done = trim_arena(arena, &step, release, &released);
+                pthread_mutex_unlock(&arena->lock);
+                budget += step;
+                if (done)
+                {
+                        arena = arena->next;
+                        resume = 0;
+                }
         }
+        TRIM_ARENA = arena;
+        pthread_mutex_unlock(&TRIM_LOCK);
+        return released;
 }
 
 /*
- *      Converts the psuedo-base 64 characters stored and HEAP[address] and
- *      HEAP[address+1] to an integer and returns the integer.
+ *      Walks at most budget blocks of the heap, resuming where the last call
+ *      stopped, or the whole heap if budget is 0. Free blocks left next to each
+ *      other are merged and the whole pages inside every free block are handed
+ *      back to the system, as glibc's malloc_trim does. Meant to be called when
+ *      the program is idle, in small budgets if it must stay responsive.
+ *
+ *      Returns the bytes released, or 0 if budget is negative.
  */
-int base64_to_dec(int address)
+size_t mymalloc_trim(int budget)
 {
-        int i, out = 0, multiplier = 1;
-        for (i = 1; i >= 0; i--)
+        if (budget < 0)
         {
-                int y = (int) HEAP[address + i];
-                out += y * multiplier;
-                multiplier *= 64;
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in mymalloc_trim: Negative budget: %d\n", budget);
+                return 0;
         }
-        return out;
+        return trim_heap(budget, 1);
 }
 
 /*
- *      Converts the psuedo-base 64 characters stored and address[0] and
- *      adresss[1] to an integer and returns the integer.
+ *      Returns the size of the largest free block of arena. free_list_insert
+ *      raises the cached value and free_list_remove forgets it when the largest
+ *      block leaves its list, in which case only the list of the highest
+ *      non-empty class is walked to find it again. The caller must hold the
+ *      arena's lock.
  */
-int base64_to_dec_pointer(char * address)
+int largest_free_block(struct superblock * arena)
 {
-        int i, out = 0, multiplier = 1;
-        for (i = 1; i >= 0; i--)
+        int largest = arena->largest_free;
+        if (largest != -1)
+                return largest;
+
+        largest = 0;
+        if (arena->fl_bitmap != 0)
         {
-                int y = (int) address[i];
-                out += y * multiplier;
-                multiplier *= 64;
+                int fl = 31 - __builtin_clz(arena->fl_bitmap);
+                int ptr = arena->free_lists[fl * SL_CLASSES + 31 - __builtin_clz(arena->sl_bitmaps[fl])];
+                for (; ptr != NULL_INDEX; ptr = base64_to_dec(&HEAP(arena)[link_index(arena, ptr)]))
+                {
+                        if (get_block_size(arena, ptr) > largest)
+                                largest = get_block_size(arena, ptr);
+                }
         }
-        return out;
+        __atomic_store_n(&arena->largest_free, largest, __ATOMIC_RELAXED);
+        return largest;
 }
 
 /*
- *      Returns 1 if heap is initialized, 0 otherwise.
+ *      Links the calling thread's counters into THREAD_STATS_LIST. Called once
+ *      per thread, by tcache_register.
  */
-int heap_initialized()
+void stats_register()
 {
-        if (HEAP[0] == IN_USE && HEAP[1] == IN_USE)
-                return 1;
-        else
-                return 0;
+        pthread_mutex_lock(&STATS_LOCK);
+        THREAD_STATS.next = THREAD_STATS_LIST;
+        THREAD_STATS_LIST = &THREAD_STATS;
+        THREAD_STATS.linked = 1;
+        pthread_mutex_unlock(&STATS_LOCK);
 }
 
 /*
- *      Prints indices of the heap for debugging
+ *      Adds the calling thread's counters to RETIRED_STATS and unlinks them
+ *      from THREAD_STATS_LIST, before the thread's storage goes away.
  */
-void print_heap(int max)
+void stats_unregister()
 {
-        int i = 0;
-        for (; i < max; i++)
+        pthread_mutex_lock(&STATS_LOCK);
+        if (THREAD_STATS.linked)
         {
-                if (DEBUG) printf("Index: %d\tValue: %d, %c\n", i, HEAP[i], HEAP[i]);
+                struct thread_stats ** link = &THREAD_STATS_LIST;
+                while (*link != &THREAD_STATS)
+                        link = &(*link)->next;
+                *link = THREAD_STATS.next;
+                THREAD_STATS.linked = 0;
+
+                RETIRED_STATS.allocs += THREAD_STATS.allocs;
+                RETIRED_STATS.frees += THREAD_STATS.frees;
+                RETIRED_STATS.failures += THREAD_STATS.failures;
+                RETIRED_STATS.cleans += THREAD_STATS.cleans;
+                RETIRED_STATS.searches += THREAD_STATS.searches;
+                RETIRED_STATS.fast_fails += THREAD_STATS.fast_fails;
+                RETIRED_STATS.scanned += THREAD_STATS.scanned;
+                if (THREAD_STATS.max_scanned > RETIRED_STATS.max_scanned)
+                        RETIRED_STATS.max_scanned = THREAD_STATS.max_scanned;
+                RETIRED_STATS.bytes_in_use += THREAD_STATS.bytes_in_use;
+                RETIRED_STATS.bytes_cached += THREAD_STATS.bytes_cached;
         }
+        pthread_mutex_unlock(&STATS_LOCK);
 }
 
 /*
- *      Given a valid size and enough contiguous memory located on the HEAP,
- *      mymalloc will return a pointer to the beginning of the block.
- *      Otherwise, mymalloc will return NULL and print an error to stderr.
+ *      Adds the bytes free and taken by metadata in every arena, and the bytes
+ *      of every mapped block, to stats, which already holds the bytes in use
+ *      and cached summed from the thread counters. Free bytes are the
+ *      available space of each arena plus the cached ones, and metadata is
+ *      whatever the arenas map beyond those and the bytes in use. Nothing is
+ *      walked and no arena lock is taken.
  */
-void * mymalloc(size_t size, char * file, int line)
+void heap_usage(struct mymalloc_stats * stats)
 {
-        /* Check if superblock metadata was initialized. */
-        if (!heap_initialized())
+        size_t mapped = 0;
+        size_t available = 0;
+        struct superblock * arena = __atomic_load_n(&ARENA_LIST, __ATOMIC_ACQUIRE);
+        for (; arena != NULL; arena = arena->next)
         {
-                HEAP[0] = IN_USE;                  /* Mark first byte as IN_USE to denote initialization */
-                HEAP[1] = IN_USE;
-                dec_to_base64(MAX_FREE_SPACE, SUPERBLOCK_SPACE_INDEX);               /* Set available space to 4088 bytes */
-
-                /* Initialize first node */
-                HEAP[FIRST_NODE_INDEX] = NOT_IN_USE;              /* Bytes 0-3 are superblock, 4-7 is metadata for first node */
-                dec_to_base64(MAX_FREE_SPACE, FIRST_NODE_INDEX+METADATA_FLAG_SIZE);               /* 4088 bytes remain for usage. */
+                mapped += arena->size;
+                available += __atomic_load_n(&arena->available_space, __ATOMIC_RELAXED);
         }
-
-        /* Check if requested size is greater than 0 */
-        int s = (int) size;
-        if (s < 1 || size < 1)
+        arena = __atomic_load_n(&SLAB_LIST, __ATOMIC_ACQUIRE);
+        for (; arena != NULL; arena = arena->next)
         {
-                fprintf(stderr, "[malloc] Error in malloc: Invalid size requested. FILE: %s\tLINE:%d\n", file, line);
-                return NULL;
+                mapped += arena->size;
+                available += __atomic_load_n(&arena->available_space, __ATOMIC_RELAXED);
         }
 
-        /* Check to see if there is enough space available to allocate */
-        int available_space = base64_to_dec(SUPERBLOCK_SPACE_INDEX);
-        if (DEBUG) printf("[malloc] found available space of %d bytes\n", available_space);
+        /* The counters of running threads can lag the arenas for a moment, so neither figure may pass what is mapped */
+        if (stats->bytes_in_use > mapped)
+                stats->bytes_in_use = 0;
+        stats->bytes_free += available;
+        if (stats->bytes_free > mapped - stats->bytes_in_use)
+                stats->bytes_free = mapped - stats->bytes_in_use;
+        stats->bytes_metadata = mapped - stats->bytes_in_use - stats->bytes_free;
 
+        /* Mapped blocks are in use until they are unmapped, their headers and page tails are metadata */
+        pthread_mutex_lock(&MAPPED_LOCK);
+        stats->bytes_in_use += MAPPED_REQUESTED;
+        stats->bytes_metadata += MAPPED_LENGTH - MAPPED_REQUESTED;
+        pthread_mutex_unlock(&MAPPED_LOCK);
+}
 
-        /* if total available space is less than requested size, don't bother looking for a spot */
-        if (available_space < size)
+/*
+ *      Adds the blocks of data node arena to the histograms of map and the
+ *      bytes in use and blocks starting in each HEAP_MAP_REGION_SIZE region of
+ *      the arena to used and blocks. Only the walk itself is done under the
+ *      arena's lock.
+ */
+void heap_map_arena(struct superblock * arena, struct heap_map * map, size_t * used, size_t * blocks)
+{
+        pthread_mutex_lock(&arena->lock);
+        int index = FIRST_NODE_INDEX;
+        while ((size_t) index < arena->size)
         {
-                clean();
-                available_space = base64_to_dec(SUPERBLOCK_SPACE_INDEX);
-                if (available_space < size)
+                int block_size = get_block_size(arena, index);
+                int bucket = size_class(block_size) / SL_CLASSES;
+                blocks[index / HEAP_MAP_REGION_SIZE]++;
+                if (__atomic_load_n(&HEAP(arena)[index], __ATOMIC_RELAXED) == IN_USE)
                 {
-                        fprintf(stderr, "[malloc] Not enough space remaining. Requested: %ld. Available: %d FILE: %s\tLINE: %d\n", size, available_space, file, line);
-                        return NULL;
+                        map->used_blocks[bucket]++;
+                        map->used_bytes[bucket] += block_size;
+                        /* A block can span several regions, each gets the bytes that lie in it */
+                        size_t start = index + HEADER_SIZE, end = start + block_size;
+                        while (start < end)
+                        {
+                                size_t region_end = (start / HEAP_MAP_REGION_SIZE + 1) * HEAP_MAP_REGION_SIZE;
+                                size_t stop = region_end < end ? region_end : end;
+                                used[start / HEAP_MAP_REGION_SIZE] += stop - start;
+                                start = stop;
+                        }
                 }
-        }
-
-        if (DEBUG) printf("[malloc] received valid size request of %ld bytes\n", size);
-
-        /* Fetch optimal node to store data in */
-        int block_index = fetch_optimal_location(size);
-
-        if (DEBUG) printf("[malloc] found optimal index to store data at index %d val: %4s end\n", block_index, &HEAP[block_index]);
-
-        /*      if returned index is -1, it failed to find free space
-                Time to combine contiguous blocks
-        */
-        if (block_index == -1)
-        {
-                if (DEBUG) printf("Cleaning...\n");
-                clean();
-                if (DEBUG) printf("Cleaned.\n");
-                /* Fetch optimal node to store data in */
-                block_index = fetch_optimal_location(size);
-
-                if (DEBUG) printf("[malloc] found optimal index to store data at index %d val: %c end\n", block_index, HEAP[block_index]);
-                if (block_index == -1)
+                else
                 {
-                        fprintf(stderr, "[malloc] Error in malloc: No space available. Available: %d. Requested: %ld. FILE: %s\tLINE: %d\n", base64_to_dec(2), size, file, line);
-                        return NULL;
+                        map->free_blocks[bucket]++;
+                        map->free_bytes[bucket] += block_size;
+                        if ((size_t) block_size > map->largest_free)
+                                map->largest_free = block_size;
                 }
+                index += block_size + METADATA_SIZE;
         }
+        pthread_mutex_unlock(&arena->lock);
+}
 
-        /* Fetch block size */
-        int block_size = base64_to_dec(block_index+METADATA_FLAG_SIZE);
-        if (block_size == 0)
+/*
+ *      Adds the slots of slab arena arena to the histograms of map and the
+ *      bytes and slots in use in each HEAP_MAP_REGION_SIZE region of the arena
+ *      to used and blocks, under the slab lock.
+ */
+void heap_map_slab_arena(struct superblock * arena, struct heap_map * map, size_t * used, size_t * blocks)
+{
+        pthread_mutex_lock(&SLAB_LOCK);
+        char * page_start = HEAP(arena) + SLAB_PAGE_SIZE;
+        for (; page_start < HEAP(arena) + arena->size; page_start += SLAB_PAGE_SIZE)
         {
-                fprintf(stderr, "[malloc] Error in malloc: block size 0. FILE: %s\tLINE: %d\n", file, line);
-                return NULL;
+                struct slab_page * page = (struct slab_page *) page_start;
+                if (page->object_size == 0)
+                        continue;
+                int bucket = size_class(page->object_size) / SL_CLASSES;
+                size_t free_slots = __atomic_load_n(&page->free_slots, __ATOMIC_RELAXED);
+                size_t used_slots = page->capacity - free_slots;
+                map->used_blocks[bucket] += used_slots;
+                map->used_bytes[bucket] += used_slots * page->object_size;
+                map->free_blocks[bucket] += free_slots;
+                map->free_bytes[bucket] += free_slots * page->object_size;
+                int region = (page_start - HEAP(arena)) / HEAP_MAP_REGION_SIZE;
+                used[region] += used_slots * page->object_size;
+                blocks[region] += used_slots;
         }
-        if (DEBUG) printf("[malloc] block size: %d == %3s, index %d == %ld\n", block_size, &HEAP[block_index+METADATA_FLAG_SIZE], block_index, &HEAP[block_index] - &HEAP[0]);
+        pthread_mutex_unlock(&SLAB_LOCK);
+}
 
-        /* if fetched data block's size is equal to requested size,
-         return pointer to block without any modifications
-        */
-        if (block_size == size)
+/*
+ *      Writes label to out as a JSON string, with quotes, backslashes and
+ *      control characters escaped, or as a CSV field, quoted with its quotes
+ *      doubled when it holds a comma, a quote or a line break.
+ */
+void heap_map_label(FILE * out, int format, char * label)
+{
+        char * c = label;
+        if (format == HEAP_MAP_CSV && strpbrk(label, ",\"\r\n") == NULL)
         {
-                update_available_space(size);
-                HEAP[block_index] = IN_USE;
-                if (DEBUG) printf("[malloc] returning pointer to index %d, pointer: %p end\n", block_index+METADATA_SIZE, &HEAP[block_index+METADATA_SIZE]);
-                return &HEAP[block_index+METADATA_SIZE];
+                fputs(label, out);
+                return;
         }
-
-        /* if fetched data block's size is greater than requested size,
-        split the data block into requested size and remainder bytes
-        */
-        else if (block_size > size)
+        fputc('"', out);
+        for (; *c != '\0'; c++)
         {
-                /* Keep track of remainder bytes */
-                int remainder_bytes = block_size - size;
-                /* Set data block metadata */
-                HEAP[block_index] = IN_USE;
-                dec_to_base64(size, block_index+METADATA_FLAG_SIZE);
-
-                if (DEBUG) printf("[malloc] block_size=%d, block_index=%d, size=%ld end\n", block_size, block_index, size);
-                /* create a new data node on the remainder bytes if there's enough space */
-                if (remainder_bytes > METADATA_SIZE)
+                if (format == HEAP_MAP_CSV)
                 {
-                        if (DEBUG) printf("[malloc] creating new data node at index %ld, with size %d end\n", block_index+METADATA_SIZE+size, remainder_bytes-METADATA_SIZE);
-                        if (!create_data_node(block_index + METADATA_SIZE + size, remainder_bytes - METADATA_SIZE))
-                        {
-                                fprintf(stderr, "[malloc] Error in malloc: New data node could not be created. FILE: %s\tLINE: %d\n", file, line);
-                                return NULL;
-                        }
-                        update_available_space(size + METADATA_SIZE);
+                        if (*c == '"')
+                                fputc('"', out);
+                        fputc(*c, out);
                 }
+                else if (*c == '"' || *c == '\\')
+                        fprintf(out, "\\%c", *c);
+                else if ((unsigned char) *c < 0x20)
+                        fprintf(out, "\\u%04x", (unsigned char) *c);
                 else
-                {
-                        /* if enough space wasn't available to allocate a new block, mark the entire block as used space */
-                        if (DEBUG) printf("Adding extra space to prev block\n");
-                        update_available_space(size + remainder_bytes);
-                        dec_to_base64(size + remainder_bytes, block_index+METADATA_FLAG_SIZE);
-                }
-
-                if (DEBUG) printf("[malloc] returning pointer to index %d, pointer: %p end\n", block_index+METADATA_SIZE, &HEAP[block_index+METADATA_SIZE]);
-                return &HEAP[block_index + METADATA_SIZE];
+                        fputc(*c, out);
         }
-        fprintf(stderr, "[malloc] Error in malloc. FILE: %s\tLINE: %d\n", file, line);
-        return NULL;
+        fputc('"', out);
 }
 
 /*
- *      Combines contiguous free blocks in HEAP and updates superblock metadata
- *      to reclaim space taken up by block metadata.
+ *      Writes a map of the heap to out, as one line of JSON or as CSV rows,
+ *      both tagged with label, escaped as each format needs:
+ *      - for every HEAP_MAP_REGION_SIZE region of every arena, the blocks
+ *        starting in it and the bytes of data in use in it, or for slab
+ *        arenas the slots and bytes in use
+ *      - histograms of the number and bytes of free and used blocks, with one
+ *        bucket per power of two
+ *      - the largest free block
+ *      Free blocks include blocks held in thread caches. The CSV header is only
+ *      written when out is at its start, so maps can be appended to one file.
+ *
+ *      Each arena is locked only while its blocks are tallied and the output
+ *      is written with no lock held, so allocation is never stalled for longer
+ *      than one arena's walk. In exchange, each arena is seen as it was at a
+ *      slightly different moment.
+ *
+ *      Returns 0, or -1 if format is unknown.
  */
-void clean()
+int mymalloc_heap_map(FILE * out, int format, char * label)
 {
-        int prev_contig_free_ptr = -1;
-        int ptr = FIRST_NODE_INDEX;
-        for (; ptr < HEAP_SIZE - METADATA_SIZE; )
+        if (format != HEAP_MAP_JSON && format != HEAP_MAP_CSV)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in mymalloc_heap_map: Unknown format: %d\n", format);
+                return -1;
+        }
+        if (label == NULL)
+                label = "";
+        struct heap_map map;
+        memset(&map, 0, sizeof(map));
+        size_t used[HEAP_MAP_REGIONS], blocks[HEAP_MAP_REGIONS];
+
+        if (format == HEAP_MAP_JSON)
+        {
+                fprintf(out, "{\"label\": ");
+                heap_map_label(out, format, label);
+                fprintf(out, ", \"region_size\": %ld, \"regions\": [", HEAP_MAP_REGION_SIZE);
+        }
+        else if (ftell(out) <= 0)
+                fprintf(out, "label,record,arena,start,size,blocks,bytes\n");
+        int first = 1;
+        int slabs = 0;
+        for (; slabs < 2; slabs++)
         {
-                if (HEAP[ptr] == NOT_IN_USE)
+                struct superblock * arena = __atomic_load_n(slabs ? &SLAB_LIST : &ARENA_LIST, __ATOMIC_ACQUIRE);
+                for (; arena != NULL; arena = arena->next)
                 {
-                        /* Join free space of block at ptr with start of free block */
-                        if (prev_contig_free_ptr != -1)
-                        {
+                        int regions = (int) ((arena->size + HEAP_MAP_REGION_SIZE - 1) / HEAP_MAP_REGION_SIZE);
+                        memset(used, 0, regions * sizeof(size_t));
+                        memset(blocks, 0, regions * sizeof(size_t));
+                        if (slabs)
+                                heap_map_slab_arena(arena, &map, used, blocks);
+                        else
+                                heap_map_arena(arena, &map, used, blocks);
 
-                                int next_ptr = ptr + base64_to_dec(ptr+METADATA_FLAG_SIZE) + METADATA_SIZE;
-                                dec_to_base64(base64_to_dec(ptr + METADATA_FLAG_SIZE) + base64_to_dec(prev_contig_free_ptr + METADATA_FLAG_SIZE) + METADATA_SIZE, prev_contig_free_ptr + METADATA_FLAG_SIZE);
-                                int i = 0;
-                                for (; i < METADATA_SIZE && ptr+i < HEAP_SIZE; i++)
+                        int region = 0;
+                        for (; region < regions; region++)
+                        {
+                                size_t start = region * HEAP_MAP_REGION_SIZE;
+                                size_t size = arena->size - start < HEAP_MAP_REGION_SIZE ? arena->size - start : HEAP_MAP_REGION_SIZE;
+                                if (format == HEAP_MAP_JSON)
+                                        fprintf(out, "%s{\"arena\": \"%p\", \"kind\": \"%s\", \"start\": %ld, \"size\": %ld, \"blocks\": %ld, \"used\": %ld}",
+                                                first ? "" : ", ", (void *) arena, slabs ? "slab" : "data", start, size, blocks[region], used[region]);
+                                else
                                 {
-                                        HEAP[ptr+i] = '\0';
+                                        heap_map_label(out, format, label);
+                                        fprintf(out, ",%s,%p,%ld,%ld,%ld,%ld\n", slabs ? "slab" : "data", (void *) arena, start, size, blocks[region], used[region]);
                                 }
-                                mark_free_space(METADATA_SIZE);
-                                ptr = next_ptr;
+                                first = 0;
                         }
-                        /* Mark ptr as start of new free block */
+                }
+        }
+
+        /* Histograms, free blocks first */
+        int used_side = 0;
+        for (; used_side < 2; used_side++)
+        {
+                size_t * counts = used_side ? map.used_blocks : map.free_blocks;
+                size_t * bytes = used_side ? map.used_bytes : map.free_bytes;
+                char * name = used_side ? "used" : "free";
+                if (format == HEAP_MAP_JSON)
+                        fprintf(out, "], \"%s\": [", name);
+                first = 1;
+                int bucket = 0;
+                for (; bucket < FL_CLASSES; bucket++)
+                {
+                        if (counts[bucket] == 0)
+                                continue;
+                        if (format == HEAP_MAP_JSON)
+                                fprintf(out, "%s{\"size\": %ld, \"blocks\": %ld, \"bytes\": %ld}", first ? "" : ", ", (size_t) 1 << bucket, counts[bucket], bytes[bucket]);
                         else
                         {
-                                prev_contig_free_ptr = ptr;
-                                ptr += base64_to_dec(ptr+METADATA_FLAG_SIZE) + METADATA_SIZE;
+                                heap_map_label(out, format, label);
+                                fprintf(out, ",%s,,%ld,%ld,%ld,%ld\n", name, (size_t) 1 << bucket, (size_t) 2 << bucket, counts[bucket], bytes[bucket]);
                         }
+                        first = 0;
                 }
-                /* Block used. Reset start of new free block ptr. */
-                else
-                {
-                        prev_contig_free_ptr = -1;
-                        ptr += base64_to_dec(ptr+METADATA_FLAG_SIZE) + METADATA_SIZE;
-                }
+        }
+        if (format == HEAP_MAP_JSON)
+                fprintf(out, "], \"largest_free\": %ld}\n", map.largest_free);
+        else
+        {
+                heap_map_label(out, format, label);
+                fprintf(out, ",largest_free,,,,,%ld\n", map.largest_free);
+        }
+        return 0;
+}
 
+/*
+ *      Returns the counters of every thread summed up, along with the current
+ *      use of the heap's memory and its fragmentation. The counters are read
+ *      while their threads keep running, so the sum is close to, not exactly,
+ *      a snapshot.
+ */
+struct mymalloc_stats mymalloc_stats()
+{
+        struct mymalloc_stats stats;
+        memset(&stats, 0, sizeof(stats));
+        pthread_mutex_lock(&STATS_LOCK);
+        stats.allocs = RETIRED_STATS.allocs;
+        stats.frees = RETIRED_STATS.frees;
+        stats.failures = RETIRED_STATS.failures;
+        stats.cleans = RETIRED_STATS.cleans;
+        stats.searches = RETIRED_STATS.searches;
+        stats.fast_fails = RETIRED_STATS.fast_fails;
+        stats.scanned = RETIRED_STATS.scanned;
+        stats.max_scanned = RETIRED_STATS.max_scanned;
+        /* Bytes cached are free, heap_usage adds the rest of the free bytes to them */
+        stats.bytes_in_use = RETIRED_STATS.bytes_in_use;
+        stats.bytes_free = RETIRED_STATS.bytes_cached;
+        struct thread_stats * thread = THREAD_STATS_LIST;
+        for (; thread != NULL; thread = thread->next)
+        {
+                stats.allocs += __atomic_load_n(&thread->allocs, __ATOMIC_RELAXED);
+                stats.frees += __atomic_load_n(&thread->frees, __ATOMIC_RELAXED);
+                stats.failures += __atomic_load_n(&thread->failures, __ATOMIC_RELAXED);
+                stats.cleans += __atomic_load_n(&thread->cleans, __ATOMIC_RELAXED);
+                stats.searches += __atomic_load_n(&thread->searches, __ATOMIC_RELAXED);
+                stats.fast_fails += __atomic_load_n(&thread->fast_fails, __ATOMIC_RELAXED);
+                stats.scanned += __atomic_load_n(&thread->scanned, __ATOMIC_RELAXED);
+                stats.bytes_in_use += __atomic_load_n(&thread->bytes_in_use, __ATOMIC_RELAXED);
+                stats.bytes_free += __atomic_load_n(&thread->bytes_cached, __ATOMIC_RELAXED);
+                size_t max_scanned = __atomic_load_n(&thread->max_scanned, __ATOMIC_RELAXED);
+                if (max_scanned > stats.max_scanned)
+                        stats.max_scanned = max_scanned;
         }
+        pthread_mutex_unlock(&STATS_LOCK);
+
+        heap_usage(&stats);
+        stats.fragmentation = heap_fragmentation();
+        return stats;
 }
 
 /*
- *      Function to fetch most optimal data block to store data in using first fit selection.
+ *      Function to fetch most optimal data block in arena to store data in using
+ *      the placement policy in effect over the segregated free lists. A request
+ *      larger than the arena's largest free block fails before any search.
  *
  *      Returns -1 if it is unable to find a block, otherwise it returns
- *      index in HEAP[] of start of data block.
+ *      index in arena of start of data block.
  *
  */
-int fetch_optimal_location(size_t size)
+int fetch_optimal_location(struct superblock * arena, size_t size)
 {
 
         if (size < 1)
                 return -1;
-        /* Keep track of index pointer */
-        int ptr = FIRST_NODE_INDEX;
+        if ((size_t) largest_free_block(arena) < size)
+        {
+                COUNT(fast_fails, 1);
+                return -1;
+        }
+        COUNT(searches, 1);
+
+        int index;
+        SEARCH_SCANNED = 0;
+        switch (mymalloc_get_policy())
+        {
+                case NEXT_FIT:
+                        index = fetch_next_fit(arena, size);
+                        break;
+                case BEST_FIT:
+                        index = fetch_best_fit(arena, size);
+                        break;
+                case GOOD_FIT:
+                        /* bounded space optimality used for time efficiency */
+                        index = fetch_good_fit(arena, size, GOOD_FIT_SLACK);
+                        break;
+                case SEGREGATED_FIT:
+                        index = fetch_segregated_fit(arena, size);
+                        break;
+                default:
+                        index = fetch_first_fit(arena, size);
+        }
+        COUNT(scanned, SEARCH_SCANNED);
+        if ((size_t) SEARCH_SCANNED > THREAD_STATS.max_scanned)
+                __atomic_store_n(&THREAD_STATS.max_scanned, SEARCH_SCANNED, __ATOMIC_RELAXED);
+        return index;
+}
 
-        /* Keep track of */
-        int optimal_index = -1;
-        int optimal_size = 4096;
+/*
+ *      First fit: the first block of the requested size's class that fits, or
+ *      else the head of the next non-empty class.
+ *
+ *      Only the list of the requested size's own class has to be searched: every
+ *      block in a higher class is larger than any size of the requested class,
+ *      so the head of the next non-empty class always fits.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
+ */
+int fetch_first_fit(struct superblock * arena, size_t size)
+{
+        int class = size_class(size);
+        int ptr = arena->free_lists[class];
 
-        /* Traverse through HEAP until last node is visited or pointer has reached
-         last possible array index (leaving space for data block of size 0)
-        */
-        while (ptr < HEAP_SIZE - METADATA_SIZE - 1)
+        /* Walk the candidates of the requested class only */
+        while (ptr != NULL_INDEX)
+        {
+                SEARCH_SCANNED++;
+                if ((size_t) get_block_size(arena, ptr) >= size)
+                        return ptr;
+                ptr = base64_to_dec(&HEAP(arena)[link_index(arena, ptr)]);
+        }
+
+        /* Any block of a larger class is big enough, take the first one found */
+        class = find_nonempty_class(arena, class + 1);
+        if (class == -1)
+                return -1;
+        SEARCH_SCANNED++;
+        return arena->free_lists[class];
+}
+
+/*
+ *      Next fit: like first fit, but the search of the requested size's class
+ *      resumes after the block last taken from it, wrapping around once. The
+ *      rover of a class is moved on by free_list_remove whenever the block it
+ *      points at leaves the list.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
+ */
+int fetch_next_fit(struct superblock * arena, size_t size)
+{
+        int class = size_class(size);
+        int start = arena->rovers[class];
+        if (start == NULL_INDEX)
+                start = arena->free_lists[class];
+
+        int ptr = start;
+        while (ptr != NULL_INDEX)
         {
-                char block_status = HEAP[ptr];
-                int block_size = base64_to_dec(ptr+METADATA_FLAG_SIZE);
-                /*if (DEBUG) printf("Looking at %d, %c\n", ptr, HEAP[ptr]); */
+                SEARCH_SCANNED++;
+                int next = base64_to_dec(&HEAP(arena)[link_index(arena, ptr)]);
+                if ((size_t) get_block_size(arena, ptr) >= size)
+                {
+                        arena->rovers[class] = next;
+                        return ptr;
+                }
+                /* Wrap around to the head, once */
+                ptr = next != NULL_INDEX ? next : arena->free_lists[class];
+                if (ptr == start)
+                        break;
+        }
+
+        class = find_nonempty_class(arena, class + 1);
+        if (class == -1)
+                return -1;
+        SEARCH_SCANNED++;
+        return arena->free_lists[class];
+}
+
+/*
+ *      Best fit: the smallest block that fits, from the size tree, which is
+ *      built first if it is not up to date.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
+ */
+int fetch_best_fit(struct superblock * arena, size_t size)
+{
+        if (!arena->tree_built)
+                tree_build(arena);
+        return tree_lower_bound(arena, size);
+}
 
-                /* if block isn't in use, compare size difference against current optimal */
-                if (block_status == NOT_IN_USE)
+/*
+ *      Good fit: the smallest block of the first class holding one that fits,
+ *      stopping at the first one wasting no more than slack bytes. Every block
+ *      of a class is smaller than any block of a higher class, so with a slack
+ *      of 0 this walks the lists to the block the size tree finds directly.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
+ */
+int fetch_good_fit(struct superblock * arena, size_t size, int slack)
+{
+        int class = find_nonempty_class(arena, size_class(size));
+        for (; class != -1; class = find_nonempty_class(arena, class + 1))
+        {
+                int optimal_index = -1;
+                int optimal_size = 0;
+                int ptr = arena->free_lists[class];
+                while (ptr != NULL_INDEX)
                 {
-                        int block_compare   = block_size - size;
-                        int optimal_compare = optimal_size - size;
-                        if (block_compare >= 0)
-                                return ptr;
-                        /* bounded space optimality used for time efficiency */
-                        /*
-                        if (block_compare <= 16 && block_compare >= 0)
-                                return ptr;
-                        if (block_compare >= 0 && block_compare < optimal_compare)
+                        SEARCH_SCANNED++;
+                        int block_size = get_block_size(arena, ptr);
+                        if ((size_t) block_size >= size && (optimal_index == -1 || block_size < optimal_size))
                         {
                                 optimal_index = ptr;
                                 optimal_size = block_size;
+                                if (block_size - size <= (size_t) slack)
+                                        return ptr;
                         }
-                        */
-
+                        ptr = base64_to_dec(&HEAP(arena)[link_index(arena, ptr)]);
                 }
+                if (optimal_index != -1)
+                        return optimal_index;
+        }
+
+        return -1;
+}
+
+/*
+ *      Segregated fit in constant time: the head of the requested size's own
+ *      class if it fits, or else the head of the next non-empty class, found
+ *      from the class bitmaps. No list is walked and the size tree is not kept,
+ *      so the time taken does not depend on how many blocks the arena holds.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
+ */
+int fetch_segregated_fit(struct superblock * arena, size_t size)
+{
+        int class = size_class(size);
+        int head = arena->free_lists[class];
+        if (head != NULL_INDEX)
+        {
+                SEARCH_SCANNED++;
+                if ((size_t) get_block_size(arena, head) >= size)
+                        return head;
+        }
+        class = find_nonempty_class(arena, class + 1);
+        if (class == -1)
+                return -1;
+        SEARCH_SCANNED++;
+        return arena->free_lists[class];
+}
+
+/*
+ *      Selects the placement policy used by every later allocation from the
+ *      data node arenas: FIRST_FIT, NEXT_FIT, BEST_FIT, GOOD_FIT or
+ *      SEGREGATED_FIT.
+ */
+void mymalloc_set_policy(int policy)
+{
+        if (policy < 0 || policy >= NUM_POLICIES)
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in mymalloc_set_policy: Unknown placement policy: %d\n", policy);
+                return;
+        }
+        __atomic_store_n(&PLACEMENT_POLICY, policy, __ATOMIC_RELAXED);
+}
 
-                if (block_size == 0) break;
+/*
+ *      Returns the placement policy in effect. Until mymalloc_set_policy is
+ *      called it is read from the MYMALLOC_POLICY environment variable
+ *      ("first", "next", "best", "good" or "segregated"), defaulting to
+ *      FIRST_FIT.
+ */
+int mymalloc_get_policy()
+{
+        int policy = __atomic_load_n(&PLACEMENT_POLICY, __ATOMIC_RELAXED);
+        if (policy != -1)
+                return policy;
 
-                ptr += METADATA_SIZE + block_size;     /* set pointer to heap array to next data block */
+        char * name = getenv("MYMALLOC_POLICY");
+        if (name == NULL || strcmp(name, "first") == 0)
+                policy = FIRST_FIT;
+        else if (strcmp(name, "next") == 0)
+                policy = NEXT_FIT;
+        else if (strcmp(name, "best") == 0)
+                policy = BEST_FIT;
+        else if (strcmp(name, "good") == 0)
+                policy = GOOD_FIT;
+        else if (strcmp(name, "segregated") == 0)
+                policy = SEGREGATED_FIT;
+        else
+        {
+                REPORT_ERROR(MYMALLOC_EINVAL, NULL, "[malloc] Error in MYMALLOC_POLICY: Unknown placement policy: %s. Using first fit.\n", name);
+                policy = FIRST_FIT;
         }
+        /* Keep a policy set by another thread in the meantime */
+        int unset = -1;
+        __atomic_compare_exchange_n(&PLACEMENT_POLICY, &unset, policy, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return __atomic_load_n(&PLACEMENT_POLICY, __ATOMIC_RELAXED);
+}
 
-        return optimal_index;
+/*
+ *      Returns the external fragmentation of the data node arenas: the share
+ *      of their free space lying outside of the largest free block of its
+ *      arena, from 0 to 1.
+ */
+double heap_fragmentation()
+{
+        size_t free_space = 0, largest_blocks = 0;
+        struct superblock * arena = __atomic_load_n(&ARENA_LIST, __ATOMIC_ACQUIRE);
+        for (; arena != NULL; arena = arena->next)
+        {
+                pthread_mutex_lock(&arena->lock);
+                free_space += arena->available_space;
+                largest_blocks += largest_free_block(arena);
+                pthread_mutex_unlock(&arena->lock);
+        }
+        if (free_space == 0)
+                return 0;
+        return 1 - (double) largest_blocks / free_space;
 }
 
 /*
- *      Removes total available space in the metadata in superblock of heap
+ *      Removes total available space in the metadata in superblock of arena
  */
-void update_available_space(int bytes_used)
+void update_available_space(struct superblock * arena, int bytes_used)
 {
-        int available_space = base64_to_dec(SUPERBLOCK_SPACE_INDEX);
-        available_space -= bytes_used;
-        dec_to_base64(available_space, SUPERBLOCK_SPACE_INDEX);
+        __atomic_store_n(&arena->available_space, arena->available_space - bytes_used, __ATOMIC_RELAXED);
 }
 
 /*
- *      Reclaims available space metadata in superblock
+ *      Reclaims available space metadata in superblock of arena
  */
-void mark_free_space(int size)
+void mark_free_space(struct superblock * arena, int size)
 {
-        int available_space = base64_to_dec(SUPERBLOCK_SPACE_INDEX);
-        available_space += size;
-        dec_to_base64(available_space, SUPERBLOCK_SPACE_INDEX);
+        __atomic_store_n(&arena->available_space, arena->available_space + size, __ATOMIC_RELAXED);
 }
 
 /*
- *      Function used to create new unused data node in HEAP structure given
- *      the index and size.
+ *      Function used to create new unused data node in arena given the index
+ *      and size, and link it into its free list.
  *
  *       Returns 1 if operation succeeded, and 0 if there was an error.
  *
  */
-int create_data_node(int index, size_t size)
+int create_data_node(struct superblock * arena, int index, size_t size)
 {
         /* Don't create a new data node where the index is too large */
-        if (index > HEAP_SIZE-METADATA_SIZE-size)
+        if (index + METADATA_SIZE + size > arena->size)
                 return 0;
-        HEAP[index] = NOT_IN_USE;
-        dec_to_base64(size, index+METADATA_FLAG_SIZE);
+        HEAP(arena)[index] = NOT_IN_USE;
+        set_block_size(arena, index, size);
+        free_list_insert(arena, index);
         return 1;
 }
 
 /*
- *      Given a valid pointer with a flag set to IN_USE, myfree will mark the
- *      flag as NOT_IN_USE and update the superblock with the reclaimed space
- *      from the no longer in use block.
- *      On all other inputs, it will print an error to stderr explaining the
+ *      Checks that pointer, whose header is flagged IN_USE, is the data space of
+ *      a data node: it must start on an ALIGNMENT boundary and the footer its
+ *      size points to must lie inside arena and repeat that size. A stray
+ *      pointer into the middle of a block can follow a byte that looks like
+ *      IN_USE, but rarely also lines up with a matching footer.
+ *
+ *      Returns 1 if the block is valid, 0 otherwise.
+ */
+int valid_block(struct superblock * arena, char * pointer)
+{
+        if ((uintptr_t) pointer % ALIGNMENT != 0)
+                return 0;
+        int index = pointer - HEAP(arena) - HEADER_SIZE;
+        int block_size = get_block_size(arena, index);
+        if (block_size < MIN_BLOCK_SIZE || (size_t) index + METADATA_SIZE + block_size > arena->size)
+                return 0;
+        return base64_to_dec(&HEAP(arena)[index+HEADER_SIZE+block_size]) == block_size;
+}
+
+/*
+ *      Given a valid pointer to a mapped block, myfree will unmap it. Given a
+ *      valid pointer to a slab slot in use, myfree will clear its bit in the
+ *      page's bitmap. Given a valid pointer with a flag set to IN_USE, myfree
+ *      will keep small blocks in the calling thread's cache, or else mark the
+ *      flag as NOT_IN_USE, merge the block with any free neighbours and update
+ *      the superblock with the reclaimed space from the no longer in use
+ *      block. On all other inputs, it will report an error explaining the
  *      possible error.
  */
 void myfree(void * pointer, char * file, int line)
 {
-        if (!heap_initialized())
+        if (TRACING())
         {
-                fprintf(stderr, "[free] Error in free. Nothing has been allocated yet. FILE: %s\tLINE: %d\n", file, line);
+                traced_free(pointer, file, line);
                 return;
         }
         char * heap_pointer = (char *) pointer;
-        if (heap_pointer < &HEAP[FIRST_NODE_INDEX] || heap_pointer > &HEAP[4095] || pointer == NULL)
+        struct superblock * arena = find_arena(pointer);
+        /* Mapped blocks lie outside every arena and go straight back to the system */
+        if (arena == NULL && unmap_block(pointer))
+        {
+                COUNT(frees, 1);
+                return;
+        }
+        if (!heap_initialized())
+        {
+                REPORT_ERROR(MYMALLOC_EPOINTER, pointer, "[free] Error in free. Nothing has been allocated yet. FILE: %s\tLINE: %d\n", file, line);
+                return;
+        }
+        if (pointer == NULL || arena == NULL || heap_pointer < &HEAP(arena)[FIRST_NODE_INDEX+HEADER_SIZE])
+        {
+                REPORT_ERROR(MYMALLOC_EPOINTER, pointer, "[free] Error in free: Invalid pointer passed. Outside of heap?: %d\t NULL? %d? FILE: %s\tLINE: %d\n", (int)(arena == NULL), (int)(pointer == NULL), file, line);
+                return;
+        }
+        if (arena->slab)
+        {
+                slab_free(arena, heap_pointer, file, line);
+                if (DEBUG) printf("[free] Freed slab slot %p\n\n", pointer);
+                return;
+        }
+        if (heap_pointer[-HEADER_SIZE] == IN_USE && !valid_block(arena, heap_pointer))
         {
-                fprintf(stderr, "[free] Error in free: Invalid pointer passed. Too low?: %d\t Too high? %d\t NULL? %d? FILE: %s\tLINE: %d\n", (int)(heap_pointer < &HEAP[FIRST_NODE_INDEX]), (int)(heap_pointer > &HEAP[4095]), (int)(pointer == NULL), file, line);
+                REPORT_ERROR(MYMALLOC_EPOINTER, pointer, "[free] Error in free: Not the start of a data node. Pointer: %p FILE: %s\tLINE: %d\n", pointer, file, line);
                 return;
         }
 
-        if (heap_pointer[-METADATA_SIZE] == IN_USE)
+        if (heap_pointer[-HEADER_SIZE] == IN_USE)
         {
                 /* Fetch block size */
-                int block_size = base64_to_dec_pointer(&heap_pointer[METADATA_FLAG_SIZE-METADATA_SIZE]);
-                /* Zero data */
-                int j = 0;
-                for (; j < block_size; j++)
+                int block_size = base64_to_dec(&heap_pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+                scrub(heap_pointer, block_size);
+                UNCOUNT(bytes_in_use, block_size);
+                /* Blocks of another thread's home arena are handed back to it without taking its lock */
+                int bin = tcache_bin(block_size);
+                if (arena != TCACHE.home && __atomic_load_n(&arena->threads, __ATOMIC_RELAXED) > 0)
+                {
+                        remote_free_push(arena, heap_pointer);
+                }
+                /* Small blocks go to the thread cache without taking any lock */
+                else if (bin < TCACHE_BINS)
+                {
+                        if (!TCACHE.registered)
+                                tcache_register();
+                        tcache_push(bin, heap_pointer);
+                        if (TCACHE.counts[bin] > TCACHE_MAX_COUNT)
+                                tcache_flush(bin, TCACHE_BATCH);
+                }
+                /* Mark as free, merge with free neighbours and link the result in */
+                else
                 {
-                        heap_pointer[j] = '\0';
+                        pthread_mutex_lock(&arena->lock);
+                        release_block(arena, heap_pointer);
+                        pthread_mutex_unlock(&arena->lock);
                 }
-                /* Mark as free */
-                heap_pointer[-METADATA_SIZE] = NOT_IN_USE;
-                mark_free_space(block_size);
+                COUNT(frees, 1);
         }
         else
         {
-                fprintf(stderr, "[free] Error in free: Found: %c. Expected: Y. Pointer: %ld FILE: %s\tLINE: %d\n", heap_pointer[-METADATA_SIZE], heap_pointer - &HEAP[0], file, line);
+                REPORT_ERROR(MYMALLOC_ENOTINUSE, pointer, "[free] Error in free: Found: %c. Expected: Y. Pointer: %p FILE: %s\tLINE: %d\n", heap_pointer[-HEADER_SIZE], pointer, file, line);
                 return;
         }
-        if (DEBUG) printf("[free] Successfully freed pointer %p\t %ld\n\n", pointer, heap_pointer - &HEAP[0]);
+        if (DEBUG) printf("[free] Successfully freed pointer %p\n\n", pointer);
         return;
 }
+
+/*
+ *      Checks that pointer is a slot or block in use in arena that size bytes
+ *      were asked for. A slot must be at least size bytes. A block must be at
+ *      least size bytes once rounded like mymalloc rounds it, and less than a
+ *      whole data node larger, since anything that large is always split off.
+ *
+ *      Returns 1 if size matches the block, 0 otherwise.
+ */
+int valid_size(struct superblock * arena, char * pointer, size_t size)
+{
+        if (arena == NULL || size < 1 || pointer < &HEAP(arena)[FIRST_NODE_INDEX+HEADER_SIZE])
+                return 0;
+        if (arena->slab)
+        {
+                struct slab_page * page = (struct slab_page *) ((uintptr_t) pointer & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+                return size <= (size_t) page->object_size;
+        }
+        if (pointer[-HEADER_SIZE] != IN_USE || !valid_block(arena, pointer))
+                return 0;
+        size_t block_size = base64_to_dec(&pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+        size_t rounded = align_size(size);
+        return rounded <= block_size && block_size < rounded + METADATA_SIZE + MIN_BLOCK_SIZE;
+}
+
+/*
+ *      Frees pointer like myfree, trusting the caller that size bytes were
+ *      asked for it. The thread cache bin follows from size, so the size field
+ *      of the block is only decoded for scrubbing, which covers the whole data
+ *      space: usable_size lets callers write past size, and calloc counts on
+ *      freed blocks being zero. Unless RELEASE is set, the
+ *      pointer and size are checked first and a mismatch is reported as an
+ *      error instead of freeing anything. Freeing NULL does nothing, in either
+ *      build.
+ */
+void myfree_sized(void * pointer, size_t size, char * file, int line)
+{
+        if (pointer == NULL)
+                return;
+        if (TRACING())
+        {
+                traced_free_sized(pointer, size, file, line);
+                return;
+        }
+        char * heap_pointer = (char *) pointer;
+        struct superblock * arena = find_arena(pointer);
+        if (arena == NULL && unmap_block(pointer))
+        {
+                COUNT(frees, 1);
+                return;
+        }
+        if (!RELEASE && !valid_size(arena, heap_pointer, size))
+        {
+                REPORT_ERROR(MYMALLOC_EPOINTER, pointer, "[free] Error in free_sized: Pointer is not a block in use of the size given. Pointer: %p Size: %ld FILE: %s\tLINE: %d\n", pointer, size, file, line);
+                return;
+        }
+        if (arena->slab)
+        {
+                slab_free(arena, heap_pointer, file, line);
+                return;
+        }
+
+        int block_size = base64_to_dec(&heap_pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+        scrub(heap_pointer, block_size);
+        UNCOUNT(bytes_in_use, block_size);
+        int bin = tcache_bin(align_size(size));
+        if (arena != TCACHE.home && __atomic_load_n(&arena->threads, __ATOMIC_RELAXED) > 0)
+        {
+                remote_free_push(arena, heap_pointer);
+        }
+        else if (bin < TCACHE_BINS)
+        {
+                if (!TCACHE.registered)
+                        tcache_register();
+                tcache_push(bin, heap_pointer);
+                if (TCACHE.counts[bin] > TCACHE_MAX_COUNT)
+                        tcache_flush(bin, TCACHE_BATCH);
+        }
+        else
+        {
+                pthread_mutex_lock(&arena->lock);
+                release_block(arena, heap_pointer);
+                pthread_mutex_unlock(&arena->lock);
+        }
+        COUNT(frees, 1);
+        if (DEBUG) printf("[free] Freed pointer %p of %ld bytes\n\n", pointer, size);
+}
+
+/*
+ *      Returns the number of bytes that can be used at pointer: the object size
+ *      of its slab slot, the data space of its block or the rest of the pages
+ *      of its mapping, any of which can be more than was asked for. Returns 0
+ *      for NULL and for anything that is not a slot or block handed out by
+ *      mymalloc.
+ */
+size_t mymalloc_usable_size(void * pointer)
+{
+        char * heap_pointer = (char *) pointer;
+        struct superblock * arena = find_arena(pointer);
+        struct mapped_block * block = arena == NULL ? find_mapped(pointer) : NULL;
+        if (block != NULL)
+                return block->length - block->offset;
+        if (pointer == NULL || arena == NULL || heap_pointer < &HEAP(arena)[FIRST_NODE_INDEX+HEADER_SIZE])
+                return 0;
+        if (arena->slab)
+        {
+                struct slab_page * page = (struct slab_page *) ((uintptr_t) pointer & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+                return (char *) page == HEAP(arena) ? 0 : page->object_size;
+        }
+        if (heap_pointer[-HEADER_SIZE] != IN_USE || !valid_block(arena, heap_pointer))
+                return 0;
+        return base64_to_dec(&heap_pointer[METADATA_FLAG_SIZE-HEADER_SIZE]);
+}
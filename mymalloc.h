@@ -8,80 +8,915 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdint.h>
 
+#ifndef DEBUG
 #define DEBUG 0
+#endif
+/*
+ *      Set to 1 for the release build: calls no longer pass their location,
+ *      errors are no longer printed to stderr and the pointer and size checks
+ *      of free_sized are compiled out.
+ */
+#ifndef RELEASE
+#define RELEASE 0
+#endif
+
+#if RELEASE
+#define MYMALLOC_LOCATION NULL, 0
+#else
+#define MYMALLOC_LOCATION __FILE__, __LINE__
+#endif
+
+#define malloc(x) mymalloc(x, MYMALLOC_LOCATION)
+#define free(x) myfree(x, MYMALLOC_LOCATION)
+#define realloc(x, y) myrealloc(x, y, MYMALLOC_LOCATION)
+#define calloc(n, x) mycalloc(n, x, MYMALLOC_LOCATION)
+#define aligned_alloc(x, y) myaligned_alloc(x, y, MYMALLOC_LOCATION)
+#define posix_memalign(p, x, y) myposix_memalign(p, x, y, MYMALLOC_LOCATION)
+#define malloc_batch(n, x, p) mymalloc_batch(n, x, p, MYMALLOC_LOCATION)
+#define free_batch(p, n) myfree_batch(p, n, MYMALLOC_LOCATION)
+#define free_sized(x, y) myfree_sized(x, y, MYMALLOC_LOCATION)
+
+#define FL_CLASSES 24
+#define SL_SHIFT 2
+#define SL_CLASSES (1 << SL_SHIFT)
+#define NUM_SIZE_CLASSES (FL_CLASSES * SL_CLASSES)
+#define SLAB_BITMAP_WORDS 8
+
+#define FIRST_FIT 0
+#define NEXT_FIT 1
+#define BEST_FIT 2
+#define GOOD_FIT 3
+#define SEGREGATED_FIT 4
+#define NUM_POLICIES 5
+#define GOOD_FIT_SLACK 16
+
+#define SCRUB_NONE 0
+#define SCRUB_ZERO_ON_FREE 1
+#define SCRUB_ZERO_ON_ALLOC 2
+#define SCRUB_POISON 3
+#define NUM_SCRUB_MODES 4
+#define SCRUB_POISON_BYTE 0xA5
+
+#define DEFAULT_MMAP_THRESHOLD ((size_t) 128 << 10)
+
+#define MYMALLOC_OK 0
+#define MYMALLOC_EINVAL 1       /* Invalid size, alignment, policy or scrub mode */
+#define MYMALLOC_ENOMEM 2       /* Request too large, or no memory could be mapped */
+#define MYMALLOC_EPOINTER 3     /* Pointer not handed out by mymalloc */
+#define MYMALLOC_ENOTINUSE 4    /* Pointer to a block that is already free */
+
+/*
+ *      Called with the error code and the pointer involved, or NULL, whenever
+ *      mymalloc runs into an error.
+ */
+typedef void (* mymalloc_error_handler)(int error, void * pointer);
+
+/*
+ *      Every arena starts with a superblock. Arenas are mapped on demand and are
+ *      aligned to ARENA_SIZE so the arena owning a pointer can be found from the
+ *      pointer alone. Data nodes start at FIRST_NODE_INDEX bytes into the arena
+ *      and free list links are stored as offsets from the start of the arena.
+ */
+struct superblock
+{
+        char initialized[2];                    /* Both set to IN_USE once the arena is set up */
+        size_t available_space;                 /* Sum of the data space of all unused data nodes */
+        size_t size;                            /* Bytes mapped for the arena, superblock included */
+        struct superblock * next;               /* Next arena of the heap */
+        int free_lists[NUM_SIZE_CLASSES];       /* Offset of the first free block of each size class */
+        int rovers[NUM_SIZE_CLASSES];           /* Offset next fit resumes the search of each size class at */
+        unsigned int fl_bitmap;                 /* Bit fl set if any class of first level fl is non-empty */
+        unsigned int sl_bitmaps[FL_CLASSES];    /* Bit sl set if class (fl, sl) is non-empty */
+        int tree_root;                          /* Offset of the root of the size tree of free blocks */
+        int tree_built;                         /* 1 while the size tree holds every free block */
+        int largest_free;                       /* Size of the largest free block, -1 until it is looked up again */
+        pthread_mutex_t lock;                   /* Guards every data node and free list of the arena */
+        int threads;                            /* Number of threads using the arena as their home */
+        char * remote_frees;                    /* Blocks freed by other threads, waiting to be released */
+        int slab;                               /* 1 if the arena is carved into slab pages instead of data nodes */
+        int trim_cursor;                        /* Offset of the block the next trim step of the arena starts at */
+};
 
-#define malloc(x) mymalloc(x, __FILE__, __LINE__)
-#define free(x) myfree(x, __FILE__, __LINE__)
+/*
+ *      Header at the start of a block mapped on its own, offset bytes in front
+ *      of its data space. The mapping starts on a page boundary and the data
+ *      space within its first page, so the header is found by rounding the
+ *      data space down. The byte right before the data space is flagged as
+ *      MAPPED, in place of the header flag of a data node.
+ */
+struct mapped_block
+{
+        size_t length;                          /* Bytes mapped, a whole number of pages */
+        size_t offset;                          /* Bytes from the start of the mapping to the data space */
+        size_t size;                            /* Bytes requested */
+};
+
+/*
+ *      Allocator counters, summed over every thread by mymalloc_stats, and the
+ *      use of the heap's memory, measured when they are read.
+ */
+struct mymalloc_stats
+{
+        size_t allocs;                          /* Blocks and slots handed out */
+        size_t frees;                           /* Blocks and slots taken back */
+        size_t failures;                        /* Calls that reported an error */
+        size_t cleans;                          /* Runs of clean */
+        size_t searches;                        /* Free list searches run by fetch_optimal_location */
+        size_t fast_fails;                      /* Arena searches skipped because the largest free block is too small */
+        size_t scanned;                         /* Free blocks looked at by all searches */
+        size_t max_scanned;                     /* Most free blocks looked at by a single search */
+        size_t bytes_in_use;                    /* Data space of blocks and slots in use */
+        size_t bytes_free;                      /* Data space of free and cached blocks, free slots and uncarved pages */
+        size_t bytes_metadata;                  /* Superblocks, headers and footers, slab page headers and page tails */
+        double fragmentation;                   /* External fragmentation, as heap_fragmentation reports it */
+};
+
+#define HEAP_MAP_JSON 0
+#define HEAP_MAP_CSV 1
+
+/*
+ *      Histograms of a heap map, one bucket per power of two: bucket i counts
+ *      the blocks of 2^i to 2^(i+1)-1 bytes of data space and their bytes.
+ */
+struct heap_map
+{
+        size_t free_blocks[FL_CLASSES];
+        size_t free_bytes[FL_CLASSES];
+        size_t used_blocks[FL_CLASSES];
+        size_t used_bytes[FL_CLASSES];
+        size_t largest_free;                    /* Data space of the largest free block */
+};
 
-static char HEAP[4096];
+#define TRACE_FILE 0
+#define TRACE_MALLOC 1
+#define TRACE_FREE 2
+#define TRACE_REALLOC 3
+#define TRACE_CALLOC 4
+#define TRACE_ALIGNED_ALLOC 5
+#define TRACE_FREE_SIZED 6
+#define TRACE_MAGIC "MYMTRACE"
+#define TRACE_VERSION 1
 
 /*
- *      Converts x from an integer to a psuedo-base 64 character stored at
- *      HEAP[address] and HEAP[address+1]. The two byte representation can store
- *      values 0-4095.
+ *      A trace file starts with this header, followed by one record per call.
+ *      A TRACE_FILE record is followed by the size bytes of the name of the
+ *      source file it gives an index to, without a terminating NUL.
  */
-void dec_to_base64(int x, int address);
+struct trace_header
+{
+        char magic[8];                          /* TRACE_MAGIC */
+        uint32_t version;                       /* TRACE_VERSION */
+        uint32_t record_size;                   /* sizeof(struct trace_record) */
+};
+
 /*
- *      Converts the psuedo-base 64 characters stored and HEAP[address] and
- *      HEAP[address+1] to an integer and returns the integer.
+ *      One call recorded to a trace file. Handles are the addresses the traced
+ *      process saw, so a replay only uses them to match a free to the
+ *      allocation it frees.
  */
-int base64_to_dec(int address);
+struct trace_record
+{
+        uint64_t time;                          /* Nanoseconds since the trace started */
+        uint64_t handle;                        /* Pointer returned or freed, 0 for an allocation that failed */
+        uint64_t argument;                      /* Pointer passed to realloc, count of calloc, alignment of aligned_alloc */
+        uint64_t size;                          /* Bytes requested, or length of the name of a TRACE_FILE record */
+        uint32_t line;                          /* Line of the call, 0 if unknown */
+        uint16_t file;                          /* Index of the file of the call, 0 if unknown */
+        uint8_t op;                             /* TRACE_ operation */
+        uint8_t thread;                         /* Number of the calling thread, modulo 256 */
+};
+
+/*
+ *      Every page of a slab arena starts with this header, followed by equal
+ *      slots of object_size bytes with no per-object metadata. A set bit in the
+ *      bitmap marks a slot in use. Only the thread owning the page sets bits,
+ *      any thread may clear them.
+ */
+struct slab_page
+{
+        int object_size;                        /* Bytes in every slot, 0 until the page is carved */
+        int capacity;                           /* Number of slots in the page */
+        int free_slots;                         /* Number of clear bits in the bitmap */
+        int state;                              /* SLAB_OWNED, SLAB_LISTED or SLAB_DETACHED */
+        struct slab_page * next;                /* Next page of the partial list the page is on */
+        unsigned long bitmap[SLAB_BITMAP_WORDS];
+};
+
 /*
- *      Converts the psuedo-base 64 characters stored and address[0] and
- *      adresss[1] to an integer and returns the integer.
+ *      Converts x from an integer to BASE64_DIGITS psuedo-base 64 characters
+ *      stored at address[0] to address[BASE64_DIGITS-1]. The four byte
+ *      representation can store values 0-16777215.
  */
-int base_to_dec_pointer(char * address);
+void dec_to_base64(int x, char * address);
+/*
+ *      Converts the BASE64_DIGITS psuedo-base 64 characters stored at address
+ *      to an integer and returns the integer.
+ */
+int base64_to_dec(char * address);
 /*
  *      Returns 1 if heap is initialized, 0 otherwise.
  */
 int heap_initialized();
 /*
- *      Prints indices of the heap for debugging
+ *      Returns the sum of the available space of every arena in the heap.
+ */
+size_t heap_available_space();
+/*
+ *      Prints indices of the first arena for debugging
  */
 void print_heap(int max);
 /*
- *      Combines contiguous free blocks in HEAP and updates superblock metadata
- *      to reclaim space taken up by block metadata.
+ *      Returns the segregated free list a block of the given size belongs to:
+ *      floor(log2(size)) as the first level, split into SL_CLASSES second level
+ *      classes by the bits that follow the highest set bit.
+ */
+int size_class(int size);
+/*
+ *      Returns the first non-empty size class of arena at or above class, found
+ *      from the class bitmaps, or -1 if every such class is empty.
+ */
+int find_nonempty_class(struct superblock * arena, int class);
+/*
+ *      Returns the size of the data space of the block at index in arena.
+ */
+int get_block_size(struct superblock * arena, int index);
+/*
+ *      Returns the index in arena of the next link stored in the free block at
+ *      index. The prev link directly follows it.
+ */
+int link_index(struct superblock * arena, int index);
+/*
+ *      Writes size into both the header and the footer (boundary tag) of the
+ *      block at index.
+ */
+void set_block_size(struct superblock * arena, int index, int size);
+/*
+ *      Merges the free block at index with its free neighbours, using the
+ *      footer of the previous block to find its start in constant time.
+ *
+ *      Returns the index of the merged block, which is not on any free list.
+ */
+int coalesce(struct superblock * arena, int index);
+/*
+ *      Pushes the free block at index onto the head of its size class list,
+ *      marks the class as non-empty and inserts the block into the size tree.
+ */
+void free_list_insert(struct superblock * arena, int index);
+/*
+ *      Unlinks the free block at index from its size class list and the size
+ *      tree, marking the class as empty if it was the last one. Must be called
+ *      before the block's size field is modified.
+ */
+void free_list_remove(struct superblock * arena, int index);
+/*
+ *      Returns the index in arena of the tree links stored in the free block at
+ *      index, the left child directly followed by the right child. They sit
+ *      right before the free list links.
+ */
+int tree_index(struct superblock * arena, int index);
+/*
+ *      Returns the left (side 0) or right (side 1) child of the tree node at
+ *      index, or NULL_INDEX.
+ */
+int tree_child(struct superblock * arena, int index, int side);
+/*
+ *      Sets the left (side 0) or right (side 1) child of the tree node at index.
+ */
+void set_tree_child(struct superblock * arena, int index, int side, int child);
+/*
+ *      Returns 1 if the free block at a orders before the free block at b in
+ *      the size tree, by size and then by index, 0 otherwise.
+ */
+int tree_less(struct superblock * arena, int a, int b);
+/*
+ *      Returns the heap priority of the tree node at index.
+ */
+unsigned int tree_priority(int index);
+/*
+ *      Inserts the free block at index into the subtree rooted at root.
+ *
+ *      Returns the new root of the subtree.
+ */
+int tree_insert(struct superblock * arena, int root, int index);
+/*
+ *      Joins the subtrees a and b, every node of a ordering before every node
+ *      of b.
+ *
+ *      Returns the root of the joined tree.
+ */
+int tree_merge(struct superblock * arena, int a, int b);
+/*
+ *      Removes the free block at index from the subtree rooted at root.
+ *
+ *      Returns the new root of the subtree.
+ */
+int tree_remove(struct superblock * arena, int root, int index);
+/*
+ *      Returns the index of the smallest free block of arena with at least size
+ *      bytes of data space, the lowest one among equals, or -1 if there is none.
+ */
+int tree_lower_bound(struct superblock * arena, size_t size);
+/*
+ *      Inserts every free block of arena into an empty size tree.
+ */
+void tree_build(struct superblock * arena);
+/*
+ *      Marks the IN_USE block with data space at pointer as NOT_IN_USE, merges
+ *      it with its free neighbours and links the result into its free list.
+ *      The caller must hold the arena's lock.
+ */
+void release_block(struct superblock * arena, char * pointer);
+/*
+ *      Pushes the block with data space at pointer onto the remote free list of
+ *      arena with a compare-and-swap loop, so threads freeing blocks of an
+ *      arena they do not allocate from never wait on its lock.
+ */
+void remote_free_push(struct superblock * arena, char * pointer);
+/*
+ *      Detaches the whole remote free list of arena in one atomic exchange and
+ *      releases every block on it. The caller must hold the arena's lock.
+ */
+void drain_remote_frees(struct superblock * arena);
+/*
+ *      Returns the slab class serving requests of size bytes.
+ */
+int slab_class(size_t size);
+/*
+ *      Carves the next unused page of the slab arenas into slots for class,
+ *      mapping a new slab arena when every page is in use. The caller must
+ *      hold the slab lock.
+ *
+ *      Returns the page, or NULL if no memory could be mapped.
+ */
+struct slab_page * slab_carve_page(int class);
+/*
+ *      Gives up the calling thread's ownership of page, putting it on its
+ *      partial list right away if enough of its slots are free. The caller
+ *      must hold the slab lock.
+ */
+void slab_release_page(struct slab_page * page);
+/*
+ *      Replaces the calling thread's page for class, which is full or missing,
+ *      with a partially free page or a newly carved one.
+ *
+ *      Returns the page, or NULL if no memory could be mapped.
+ */
+struct slab_page * slab_acquire_page(int class);
+/*
+ *      Takes a free slot of the calling thread's slab page for size bytes.
+ *
+ *      Returns a pointer to the slot, or NULL if no memory could be mapped.
+ */
+void * slab_allocate(size_t size);
+/*
+ *      Clears the slot at pointer in slab arena arena, reporting an error
+ *      instead if pointer is not the start of a slot in use.
+ */
+void slab_free(struct superblock * arena, char * pointer, char * file, int line);
+/*
+ *      Creates the key whose destructor flushes a thread's cache when it exits.
+ */
+void tcache_create_key();
+/*
+ *      Makes sure tcache_exit runs when the calling thread exits.
+ */
+void tcache_register();
+/*
+ *      Pushes the block with data space at pointer onto cache bin and flags it
+ *      as CACHED.
+ */
+void tcache_push(int bin, char * pointer);
+/*
+ *      Pops the most recently cached block of bin, which must not be empty, and
+ *      flags it as IN_USE again.
+ *
+ *      Returns a pointer to the data space of the block.
+ */
+char * tcache_pop(int bin);
+/*
+ *      Returns the arena the calling thread allocates from first, picking an
+ *      arena no other thread uses or mapping a new one on the thread's first
+ *      call.
+ */
+struct superblock * home_arena();
+/*
+ *      Serves size bytes from the shared arenas: the calling thread's home
+ *      arena first, then every other arena, then a newly mapped arena.
+ *
+ *      Returns NULL if no memory could be mapped.
+ */
+void * heap_allocate(size_t size);
+/*
+ *      Moves up to TCACHE_BATCH blocks for cache bin from the calling thread's
+ *      home arena into its thread cache, taking the arena's lock only once.
+ */
+void tcache_refill(int bin);
+/*
+ *      Returns the count least recently cached blocks of bin to their arenas,
+ *      taking each arena's lock once per run of blocks from the same arena.
+ */
+void tcache_flush(int bin, int count);
+/*
+ *      Flushes every bin of the exiting thread's cache and gives up its slab
+ *      pages and home arena. Registered as the destructor of the thread cache
+ *      key.
+ */
+void tcache_exit(void * unused);
+/*
+ *      Takes every lock of the allocator ahead of a fork, in the order they
+ *      nest everywhere else.
+ */
+void mymalloc_fork_prepare();
+/*
+ *      Releases the locks mymalloc_fork_prepare took, in the parent.
+ */
+void mymalloc_fork_parent();
+/*
+ *      Sets up the locks mymalloc_fork_prepare took again in the child, and
+ *      makes the forking thread the only one with a home arena.
+ */
+void mymalloc_fork_child();
+/*
+ *      Maps arena_size bytes aligned to ARENA_SIZE and registers each of its
+ *      windows in the arena table. The caller must hold the heap lock.
+ *
+ *      Returns the start of the mapping, or NULL if no memory could be mapped.
+ */
+char * map_arena(size_t arena_size);
+/*
+ *      Maps a new arena large enough to hold a data node of size bytes, sets up
+ *      its superblock and first data node and links it into the heap. The
+ *      caller must hold the heap lock.
+ *
+ *      Returns the new arena, or NULL if no memory could be mapped.
+ */
+struct superblock * create_arena(size_t size);
+/*
+ *      Maps a new slab arena and links it into the list of slab arenas. Its
+ *      pages are handed out by slab_carve_page. The caller must hold the heap
+ *      lock.
+ *
+ *      Returns the new arena, or NULL if no memory could be mapped.
+ */
+struct superblock * create_slab_arena();
+/*
+ *      Returns the arena that pointer lies in, or NULL if pointer does not
+ *      belong to any arena of the heap.
+ */
+struct superblock * find_arena(void * pointer);
+/*
+ *      Returns 1 if a request of size bytes is served by a mapping of its own
+ *      rather than by the arenas, 0 otherwise.
+ */
+int mapped_size(size_t size);
+/*
+ *      Adds start to the table of mapped blocks, or removes it if remove is
+ *      set. The caller must hold MAPPED_LOCK.
+ *
+ *      Returns 0, or -1 if the table is full.
+ */
+int mapped_table_update(uintptr_t start, int remove);
+/*
+ *      Maps a block of size bytes of data space aligned to alignment, a power
+ *      of two, on pages of its own and registers it.
+ *
+ *      Returns a pointer to the data space, or NULL if it could not be mapped
+ *      or registered.
+ */
+void * map_block(size_t size, size_t alignment);
+/*
+ *      Returns the header of the mapped block whose data space starts at
+ *      pointer, or NULL if there is none. Never reads memory it did not map.
+ */
+struct mapped_block * find_mapped(void * pointer);
+/*
+ *      Unmaps the mapped block whose data space starts at pointer.
+ *
+ *      Returns 1 if pointer was a mapped block, 0 otherwise.
+ */
+int unmap_block(void * pointer);
+/*
+ *      Resizes mapped block block to size bytes with mremap, moving it if it
+ *      cannot grow in place.
+ *
+ *      Returns a pointer to its data space, or NULL if it could not be resized.
+ */
+void * remap_block(struct mapped_block * block, size_t size);
+/*
+ *      Combines contiguous free blocks in every arena and updates superblock
+ *      metadata to reclaim space taken up by block metadata, in one pass of
+ *      trim_heap. myfree already coalesces on every call, so this full sweep
+ *      is only needed to recover or verify the heap while debugging.
  */
 void clean();
 /*
- *      Function to fetch most optimal data block to store data in using first fit selection.
+ *      Hands the resident whole pages inside the data space of the free block
+ *      at index back to the system, unless the scrub mode is SCRUB_POISON.
+ *
+ *      Returns the number of bytes released.
+ */
+size_t release_pages(struct superblock * arena, int index);
+/*
+ *      Walks at most *budget blocks of arena from its trim cursor, merging free
+ *      neighbours and, if release is set, releasing the pages of free blocks
+ *      and adding their bytes to released. The caller must hold the arena's
+ *      lock.
+ *
+ *      Returns 1 if the walk reached the end of the arena, 0 otherwise.
+ */
+int trim_arena(struct superblock * arena, int * budget, int release, size_t * released);
+/*
+ *      Runs trim_arena over the heap from where the last walk stopped, for at
+ *      most budget blocks, or for one whole pass if budget is 0, holding each
+ *      arena's lock for at most TRIM_STEP blocks at a time.
+ *
+ *      Returns the bytes released.
+ */
+size_t trim_heap(int budget, int release);
+/*
+ *      Walks at most budget blocks of the heap, or all of it if budget is 0,
+ *      merging free neighbours and handing the resident pages of free blocks
+ *      back to the system. Meant for idle time.
+ *
+ *      Returns the bytes released, or 0 if budget is negative.
+ */
+size_t mymalloc_trim(int budget);
+/*
+ *      Returns the size of the largest free block of arena, walking the list of
+ *      its highest non-empty class if the cached value is out of date. The
+ *      caller must hold the arena's lock.
+ */
+int largest_free_block(struct superblock * arena);
+/*
+ *      Links the calling thread's counters into the list mymalloc_stats sums.
+ */
+void stats_register();
+/*
+ *      Adds the calling thread's counters to those of exited threads and
+ *      unlinks them, as the thread exits.
+ */
+void stats_unregister();
+/*
+ *      Adds the bytes free and taken by metadata in every arena, and the bytes
+ *      of every mapped block, to stats, which already holds the bytes in use
+ *      and cached summed from the thread counters.
+ */
+void heap_usage(struct mymalloc_stats * stats);
+/*
+ *      Returns the allocator counters of every thread summed up, along with the
+ *      current use of the heap's memory and its fragmentation.
+ */
+struct mymalloc_stats mymalloc_stats();
+/*
+ *      Adds the blocks of data node arena to the histograms of map and the
+ *      bytes in use and blocks starting in each region of the arena to used
+ *      and blocks, under the arena's lock.
+ */
+void heap_map_arena(struct superblock * arena, struct heap_map * map, size_t * used, size_t * blocks);
+/*
+ *      Adds the slots of slab arena arena to the histograms of map and the
+ *      bytes and slots in use in each region of the arena to used and blocks,
+ *      under the slab lock.
+ */
+void heap_map_slab_arena(struct superblock * arena, struct heap_map * map, size_t * used, size_t * blocks);
+/*
+ *      Writes label to out as a JSON string or as a CSV field, escaped or
+ *      quoted as the format needs.
+ */
+void heap_map_label(FILE * out, int format, char * label);
+/*
+ *      Writes a map of the heap to out as HEAP_MAP_JSON or HEAP_MAP_CSV, tagged
+ *      with label: the blocks and bytes in use in every region of every arena,
+ *      histograms of free and used block sizes and the largest free block.
+ *      Arenas are locked one at a time, and only while they are tallied.
+ *
+ *      Returns 0, or -1 if format is unknown.
+ */
+int mymalloc_heap_map(FILE * out, int format, char * label);
+/*
+ *      Function to fetch most optimal data block in arena to store data in using
+ *      the placement policy in effect over the segregated free lists. A request
+ *      larger than the arena's largest free block fails before any search.
  *
  *      Returns -1 if it is unable to find a block, otherwise it returns
- *      index in HEAP[] of start of data block.
+ *      index in arena of start of data block.
+ *
+ */
+int fetch_optimal_location(struct superblock * arena, size_t size);
+/*
+ *      First fit: the first block of the requested size's class that fits, or
+ *      else the head of the next non-empty class.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
+ */
+int fetch_first_fit(struct superblock * arena, size_t size);
+/*
+ *      Next fit: like first fit, but the search of the requested size's class
+ *      resumes after the block last taken from it, wrapping around once.
  *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
  */
-int fetch_optimal_location(size_t size);
+int fetch_next_fit(struct superblock * arena, size_t size);
 /*
- *      Removes total available space in the metadata in superblock of heap
+ *      Best fit: the smallest block that fits, from the size tree, which is
+ *      built first if it is not up to date.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
  */
-void update_available_space(int bytes_used);
+int fetch_best_fit(struct superblock * arena, size_t size);
 /*
- *      Reclaims available space metadata in superblock
+ *      Good fit: the smallest block of the first class holding one that fits,
+ *      stopping at the first one wasting no more than slack bytes.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
  */
-void mark_free_space(int size);
+int fetch_good_fit(struct superblock * arena, size_t size, int slack);
 /*
- *      Function used to create new unused data node in HEAP structure given
- *      the index and size.
+ *      Segregated fit in constant time: the head of the requested size's own
+ *      class if it fits, or else the head of the next non-empty class, found
+ *      from the class bitmaps.
+ *
+ *      Returns -1 if it is unable to find a block, otherwise its index.
+ */
+int fetch_segregated_fit(struct superblock * arena, size_t size);
+/*
+ *      Selects the placement policy used by every later allocation from the
+ *      data node arenas: FIRST_FIT, NEXT_FIT, BEST_FIT, GOOD_FIT or
+ *      SEGREGATED_FIT.
+ */
+void mymalloc_set_policy(int policy);
+/*
+ *      Returns the placement policy in effect. Until mymalloc_set_policy is
+ *      called it is read from the MYMALLOC_POLICY environment variable
+ *      ("first", "next", "best", "good" or "segregated"), defaulting to
+ *      FIRST_FIT.
+ */
+int mymalloc_get_policy();
+/*
+ *      Returns the external fragmentation of the data node arenas: the share
+ *      of their free space lying outside of the largest free block of its
+ *      arena, from 0 to 1.
+ */
+double heap_fragmentation();
+/*
+ *      Rounds a request of size bytes up to the data space of a block that can
+ *      hold its free list links once it is freed and whose data node, metadata
+ *      included, spans a whole number of ALIGNMENT bytes.
+ */
+size_t align_size(size_t size);
+/*
+ *      Returns the thread cache bin of blocks with size bytes of data space.
+ */
+int tcache_bin(size_t size);
+/*
+ *      Returns the data space requests served from cache bin are rounded up to.
+ */
+size_t tcache_bin_size(int bin);
+/*
+ *      Takes the free block at block_index off its free list, splits off any
+ *      remainder large enough to form a new data node and marks the block as
+ *      IN_USE.
+ *
+ *      Returns a pointer to the data space of the block.
+ */
+void * allocate_block(struct superblock * arena, int block_index, size_t size);
+/*
+ *      Removes total available space in the metadata in superblock of arena
+ */
+void update_available_space(struct superblock * arena, int bytes_used);
+/*
+ *      Reclaims available space metadata in superblock of arena
+ */
+void mark_free_space(struct superblock * arena, int size);
+/*
+ *      Function used to create new unused data node in arena given the index
+ *      and size, and link it into its free list.
  *
  *       Returns 1 if operation succeeded, and 0 if there was an error.
  *
  */
-int create_data_node(int index, size_t size);
+int create_data_node(struct superblock * arena, int index, size_t size);
 /*
- *      Given a valid size and enough contiguous memory located on the HEAP,
- *      mymalloc will return a pointer to the beginning of the block.
- *      Otherwise, mymalloc will return NULL and print an error to stderr.
+ *      Given a valid size, mymalloc will return a pointer to the beginning of a
+ *      slot of a slab page for requests of up to 64 bytes, or else of a block
+ *      from the calling thread's cache or, when the cache has none, from the
+ *      first arena with enough contiguous memory, mapping a new arena when none
+ *      has. Safe to call from any number of threads.
+ *      Otherwise, mymalloc will return NULL and report an error.
  */
 void * mymalloc(size_t size, char * file, int line);
 /*
- *      Given a valid pointer with a flag set to IN_USE, myfree will mark the
- *      flag as NOT_IN_USE and update the superblock with the reclaimed space
- *      from the no longer in use block.
- *      On all other inputs, it will print an error to stderr explaining the
+ *      Allocates count objects of size bytes each, all set to zero, without
+ *      zeroing again blocks the scrub mode already keeps zeroed.
+ *
+ *      Returns a pointer to the data space, or NULL if count * size overflows
+ *      or no memory could be found.
+ */
+void * mycalloc(size_t count, size_t size, char * file, int line);
+/*
+ *      Scrubs size bytes of freed data space at pointer as the scrub mode asks:
+ *      zeroes them under SCRUB_ZERO_ON_FREE, fills them with SCRUB_POISON_BYTE
+ *      under SCRUB_POISON and leaves them as they are otherwise.
+ */
+void scrub(char * pointer, size_t size);
+/*
+ *      Selects what is done with data space on free and on allocation from now
+ *      on: SCRUB_NONE, SCRUB_ZERO_ON_FREE, SCRUB_ZERO_ON_ALLOC or SCRUB_POISON.
+ */
+void mymalloc_set_scrub(int mode);
+/*
+ *      Returns the scrub mode in effect, read from the MYMALLOC_SCRUB
+ *      environment variable until one is set and SCRUB_ZERO_ON_FREE by default.
+ */
+int mymalloc_get_scrub();
+/*
+ *      Serves requests of threshold bytes or more, from now on, with mappings
+ *      of their own.
+ */
+void mymalloc_set_mmap_threshold(size_t threshold);
+/*
+ *      Returns the mmap threshold in effect, read from the
+ *      MYMALLOC_MMAP_THRESHOLD environment variable until one is set and
+ *      DEFAULT_MMAP_THRESHOLD by default.
+ */
+size_t mymalloc_get_mmap_threshold();
+/*
+ *      Records error as the calling thread's last error and passes it on to the
+ *      error handler if one is set.
+ */
+void report_error(int error, void * pointer);
+/*
+ *      Sets the function called with every error, or none if handler is NULL.
+ *      The handler must not call back into mymalloc.
+ */
+void mymalloc_set_error_handler(mymalloc_error_handler handler);
+/*
+ *      Returns the last error the calling thread ran into, or MYMALLOC_OK.
+ */
+int mymalloc_last_error();
+/*
+ *      Returns a monotonic time in nanoseconds.
+ */
+double trace_time();
+/*
+ *      Writes the buffered trace records out. The caller must hold TRACE_LOCK.
+ */
+void trace_drain();
+/*
+ *      Appends size bytes at data to the trace. The caller must hold TRACE_LOCK.
+ */
+void trace_write(void * data, size_t size);
+/*
+ *      Returns the index of file in the trace, recording its name the first
+ *      time it is seen, or 0 if it is NULL or there is no room left for it.
+ *      The caller must hold TRACE_LOCK.
+ */
+int trace_file_index(char * file);
+/*
+ *      Records a call of operation op at line of file, with the pointer it
+ *      returned or freed as its handle.
+ */
+void trace_event(int op, void * handle, size_t argument, size_t size, char * file, int line);
+/*
+ *      Writes out the trace records still buffered when the process exits.
+ */
+void trace_exit();
+/*
+ *      Starts a new trace file at path, or stops tracing if path is NULL. The
+ *      caller must hold TRACE_LOCK.
+ */
+void trace_open(char * path);
+/*
+ *      Records every call made from now on to a trace file at path, or stops
+ *      recording if path is NULL.
+ */
+void mymalloc_set_trace(char * path);
+/*
+ *      Returns 1 if calls are being recorded to a trace file. Until
+ *      mymalloc_set_trace is called, they are recorded to the file named by
+ *      MYMALLOC_TRACE, if it is set.
+ */
+int mymalloc_get_trace();
+/*
+ *      Record a call to the trace around making it untraced. Allocations are
+ *      recorded once they return, frees before they start.
+ */
+void * traced_malloc(size_t size, char * file, int line);
+void * traced_calloc(size_t count, size_t size, char * file, int line);
+void * traced_realloc(void * pointer, size_t size, char * file, int line);
+void * traced_aligned_alloc(size_t alignment, size_t size, char * file, int line);
+size_t traced_malloc_batch(size_t count, size_t size, void ** pointers, char * file, int line);
+void traced_free(void * pointer, char * file, int line);
+void traced_free_batch(void ** pointers, size_t count, char * file, int line);
+void traced_free_sized(void * pointer, size_t size, char * file, int line);
+/*
+ *      Carves up to count blocks of size bytes of data space, one right after
+ *      the other, from the front of the free block at block_index and splits
+ *      off what is left as a new data node if it is large enough to form one.
+ *      The caller must hold the arena's lock.
+ *
+ *      Returns the number of blocks carved, stored in pointers.
+ */
+int carve_blocks(struct superblock * arena, int block_index, size_t size, int count, void ** pointers);
+/*
+ *      Allocates count blocks of size bytes and stores pointers to them in
+ *      pointers, carving as many as possible one after the other from a single
+ *      free block found with one search.
+ *
+ *      Returns the number of blocks allocated. Pointers past them are NULL.
+ */
+size_t mymalloc_batch(size_t count, size_t size, void ** pointers, char * file, int line);
+/*
+ *      Frees count blocks, checking each one like myfree. Blocks lying one
+ *      right after the other are joined into a single extent and released with
+ *      one coalesce under one acquisition of the arena's lock.
+ */
+void myfree_batch(void ** pointers, size_t count, char * file, int line);
+/*
+ *      Cuts the IN_USE block at index in arena down to size bytes of data space
+ *      and frees the rest as a new data node, merged with a free block that
+ *      follows it. The rest must be large enough to form a data node. The
+ *      caller must hold the arena's lock.
+ */
+void split_block(struct superblock * arena, int index, size_t size);
+/*
+ *      Grows the IN_USE block at index in arena to at least size bytes of data
+ *      space by absorbing the free block that follows it, splitting off what is
+ *      not needed. The caller must hold the arena's lock.
+ *
+ *      Returns 1 if the block was grown, 0 if the following block is not free
+ *      or too small.
+ */
+int grow_block(struct superblock * arena, int index, size_t size);
+/*
+ *      Given a valid pointer from mymalloc, myrealloc will resize its block to
+ *      size bytes, keeping its contents up to the smaller of the two sizes. It
+ *      shrinks the block in place, or grows it in place into a free block that
+ *      follows it, and only moves it to a new block when neither is possible.
+ *      A NULL pointer is passed to mymalloc and a size of 0 to myfree.
+ *
+ *      Returns a pointer to the resized block, or NULL, leaving the block as it
+ *      was, if no memory could be found.
+ */
+void * myrealloc(void * pointer, size_t size, char * file, int line);
+/*
+ *      Allocates size bytes whose address is a multiple of alignment, which must
+ *      be a power of two. The padding in front of the aligned payload and the
+ *      tail it does not need are given back as free data nodes.
+ *
+ *      Returns a pointer to the aligned data space, or NULL if the alignment is
+ *      invalid or no memory could be found.
+ */
+void * myaligned_alloc(size_t alignment, size_t size, char * file, int line);
+/*
+ *      Stores in *pointer the address of size bytes aligned to alignment, which
+ *      must be a power of two and a multiple of sizeof(void *). A size of 0
+ *      stores NULL.
+ *
+ *      Returns 0 on success, EINVAL for an invalid alignment or ENOMEM if no
+ *      memory could be found, leaving *pointer unchanged on failure.
+ */
+int myposix_memalign(void ** pointer, size_t alignment, size_t size, char * file, int line);
+/*
+ *      Checks that pointer, whose header is flagged IN_USE, is the data space of
+ *      a data node: it must start on an ALIGNMENT boundary and the footer its
+ *      size points to must lie inside arena and repeat that size.
+ *
+ *      Returns 1 if the block is valid, 0 otherwise.
+ */
+int valid_block(struct superblock * arena, char * pointer);
+/*
+ *      Given a valid pointer to a mapped block, myfree will unmap it. Given a
+ *      valid pointer to a slab slot in use, myfree will clear its bit in the
+ *      page's bitmap. Given a valid pointer with a flag set to IN_USE, myfree
+ *      will keep small blocks in the calling thread's cache, or else mark the
+ *      flag as NOT_IN_USE, merge the block with any free neighbours and update
+ *      the superblock with the reclaimed space from the no longer in use
+ *      block. On all other inputs, it will report an error explaining the
  *      possible error.
  */
 void myfree(void * pointer, char * file, int line);
+/*
+ *      Checks that pointer is a slot or block in use in arena that size bytes
+ *      were asked for.
+ *
+ *      Returns 1 if size matches the block, 0 otherwise.
+ */
+int valid_size(struct superblock * arena, char * pointer, size_t size);
+/*
+ *      Frees pointer like myfree, trusting the caller that size bytes were
+ *      asked for it, so the size field of the block is only decoded to scrub
+ *      all of its data space. Unless RELEASE is set, the pointer and size
+ *      are checked first. Freeing NULL does nothing.
+ */
+void myfree_sized(void * pointer, size_t size, char * file, int line);
+/*
+ *      Returns the number of bytes that can be used at pointer, which can be
+ *      more than was asked for, or 0 if pointer was not handed out by mymalloc.
+ */
+size_t mymalloc_usable_size(void * pointer);
 
 #endif
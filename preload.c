@@ -0,0 +1,155 @@
+/************************************************
+ *      preload.c                               *
+ *      Authors:  Seth Karten, Yash Shah        *
+ *      2019                                    *
+ ************************************************/
+#include "mymalloc.h"
+#include <errno.h>
+#include <unistd.h>
+
+/*
+ *      The standard allocation functions, wrapping mymalloc so that programs
+ *      that never included mymalloc.h can be run against it with LD_PRELOAD.
+ *      The macros of mymalloc.h would rename the definitions below, so they
+ *      are undone first. Calls pass no location, since there is none to give.
+ */
+#undef malloc
+#undef free
+#undef realloc
+#undef calloc
+#undef aligned_alloc
+#undef posix_memalign
+
+/*
+ *      Like mymalloc, except that a size of 0 still returns a unique pointer and
+ *      a failure sets errno to ENOMEM, as programs expect of malloc.
+ */
+void * malloc(size_t size)
+{
+        void * pointer = mymalloc(size == 0 ? 1 : size, NULL, 0);
+        if (pointer == NULL)
+                errno = ENOMEM;
+        return pointer;
+}
+
+/*
+ *      Like myfree, except that freeing NULL does nothing.
+ */
+void free(void * pointer)
+{
+        if (pointer != NULL)
+                myfree(pointer, NULL, 0);
+}
+
+/*
+ *      Like mycalloc, except that a count or size of 0 still returns a unique
+ *      pointer and a failure sets errno to ENOMEM.
+ */
+void * calloc(size_t count, size_t size)
+{
+        if (count == 0 || size == 0)
+                count = size = 1;
+        void * pointer = mycalloc(count, size, NULL, 0);
+        if (pointer == NULL)
+                errno = ENOMEM;
+        return pointer;
+}
+
+/*
+ *      Like myrealloc, except that reallocating NULL to a size of 0 still
+ *      returns a unique pointer and a failure sets errno to ENOMEM.
+ */
+void * realloc(void * pointer, size_t size)
+{
+        if (pointer == NULL)
+                return malloc(size);
+        void * resized = myrealloc(pointer, size, NULL, 0);
+        if (resized == NULL && size != 0)
+                errno = ENOMEM;
+        return resized;
+}
+
+/*
+ *      Like myaligned_alloc. Alignments that are not a power of two are
+ *      rejected with EINVAL.
+ */
+void * aligned_alloc(size_t alignment, size_t size)
+{
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+        {
+                errno = EINVAL;
+                return NULL;
+        }
+        void * pointer = myaligned_alloc(alignment, size == 0 ? 1 : size, NULL, 0);
+        if (pointer == NULL)
+                errno = ENOMEM;
+        return pointer;
+}
+
+/*
+ *      Like myposix_memalign, except that a size of 0 still stores a unique
+ *      pointer.
+ */
+int posix_memalign(void ** pointer, size_t alignment, size_t size)
+{
+        return myposix_memalign(pointer, alignment, size == 0 ? 1 : size, NULL, 0);
+}
+
+/*
+ *      Obsolete form of aligned_alloc. Alignments that are not a power of two
+ *      are rounded up to the next one.
+ */
+void * memalign(size_t alignment, size_t size)
+{
+        size_t power = 1;
+        while (power < alignment)
+                power <<= 1;
+        return aligned_alloc(power, size);
+}
+
+/*
+ *      Obsolete form of aligned_alloc that aligns to the page size.
+ */
+void * valloc(size_t size)
+{
+        return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+/*
+ *      Like valloc, but also rounds size up to a whole number of pages.
+ */
+void * pvalloc(size_t size)
+{
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        return aligned_alloc(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+/*
+ *      Returns the number of bytes that can be used at pointer, or 0 for NULL.
+ */
+size_t malloc_usable_size(void * pointer)
+{
+        return mymalloc_usable_size(pointer);
+}
+
+/*
+ *      Like mymalloc_trim over the whole heap. pad is ignored, since only the
+ *      pages inside free blocks are ever released.
+ *
+ *      Returns 1 if any memory was released, 0 otherwise.
+ */
+int malloc_trim(size_t pad)
+{
+        (void) pad;
+        return mymalloc_trim(0) > 0;
+}
+
+/*
+ *      Registers the fork handlers of the allocator when the library is
+ *      loaded, so a child forked while another thread of the parent holds one
+ *      of its locks can still allocate.
+ */
+__attribute__((constructor)) void preload_init()
+{
+        pthread_atfork(mymalloc_fork_prepare, mymalloc_fork_parent, mymalloc_fork_child);
+}
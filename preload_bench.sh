@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+#       preload_bench.sh [library]
+#
+#       Times a set of standard programs with the system allocator and with
+#       library (./libmymalloc.so by default) preloaded, and prints the best of
+#       RUNS runs of each side by side. A program whose output differs under
+#       the library, or that fails under it, is reported instead of timed.
+#
+
+RUNS=${RUNS:-5}
+LIBRARY=$(realpath "${1:-./libmymalloc.so}")
+SOURCE=$(dirname "$(realpath "$0")")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ ! -f "$LIBRARY" ]
+then
+        echo "No library at $LIBRARY. Run make first." >&2
+        exit 1
+fi
+
+# Inputs: shuffled numbers, and words drawn from the sources of the allocator
+seq 1 200000 | awk 'BEGIN { srand(1) } { print int(rand() * 1000000) }' > "$WORK/numbers.txt"
+for i in $(seq 1 40)
+do
+        cat "$SOURCE"/*.c "$SOURCE"/*.h
+done | tr -cs 'A-Za-z_' '\n' > "$WORK/words.txt"
+
+NAMES=(sort-numbers sort-words awk gcc python3 perl tar sqlite3)
+PROGRAMS=(
+        "sort -n $WORK/numbers.txt"
+        "sort $WORK/words.txt"
+        "awk '{ count[\$1]++ } END { for (w in count) n++; print n }' $WORK/words.txt"
+        "gcc -O2 -c $SOURCE/mymalloc.c -o $WORK/mymalloc.o"
+        "python3 -c 'd = {str(i): [i] * 4 for i in range(100000)}; print(sum(len(v) for v in d.values()))'"
+        "perl -ne 'chomp; \$c{\$_}++; END { print scalar(keys %c), \"\\n\" }' $WORK/words.txt"
+        "tar -czf - -C $SOURCE mymalloc.c mymalloc.h memgrind.c README.md"
+        "sqlite3 :memory: 'WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 100000) SELECT count(DISTINCT i % 997) FROM n'"
+)
+
+#
+#       Runs command RUNS times, with LD_PRELOAD set to preload when it is not
+#       empty, and prints the best wall clock time in seconds. The output of
+#       the last run is left in $WORK/out.$2.
+#
+best_time()
+{
+        local command=$1 tag=$2 preload=$3 best="" i start end elapsed
+        for i in $(seq 1 "$RUNS")
+        do
+                start=$(date +%s.%N)
+                if ! LD_PRELOAD=$preload bash -c "$command" > "$WORK/out.$tag" 2> "$WORK/err.$tag"
+                then
+                        echo failed
+                        return
+                fi
+                end=$(date +%s.%N)
+                elapsed=$(echo "$start $end" | awk '{ printf "%.4f", $2 - $1 }')
+                if [ -z "$best" ] || awk "BEGIN { exit !($elapsed < $best) }"
+                then
+                        best=$elapsed
+                fi
+        done
+        echo "$best"
+}
+
+printf "%-14s %10s %10s %8s\n" program glibc mymalloc ratio
+for i in "${!PROGRAMS[@]}"
+do
+        command=${PROGRAMS[$i]}
+        name=${NAMES[$i]}
+        system=$(best_time "$command" system "")
+        mine=$(best_time "$command" mymalloc "$LIBRARY")
+        if [ "$mine" = failed ] || [ "$system" = failed ]
+        then
+                printf "%-14s %10s %10s %8s\n" "$name" "$system" "$mine" "-"
+                sed 's/^/        /' "$WORK/err.mymalloc" | head -3
+        elif ! cmp -s "$WORK/out.system" "$WORK/out.mymalloc"
+        then
+                printf "%-14s %10s %10s %8s\n" "$name" "$system" "$mine" "differs"
+        else
+                printf "%-14s %10s %10s %8s\n" "$name" "$system" "$mine" "$(echo "$mine $system" | awk '{ printf "%.2f", $1 / $2 }')"
+        fi
+done